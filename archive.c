@@ -0,0 +1,402 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "err.h"
+#include "callbacks.h"
+#include "netdata.h"
+#include "timer.h"
+#include "vector.h"
+#include "bucket.h"
+#include "pool.h"
+
+#include "archive.h"
+
+/* Smaller files are read by a single thread */
+#define ARCHIVE_CHUNK_MIN (4 << 20)
+/* Chunks of a file per thread, a thread done early takes over the rest */
+#define ARCHIVE_CHUNKS_PER_THREAD 4
+/* Read buffer of a chunk, longer lines are cut as by read_log_file */
+#define ARCHIVE_BUFSIZ (256 << 10)
+
+struct archive_bucket {
+	unsigned long tick;
+	void * data;
+};
+
+static inline
+int
+bucket_cmp(const unsigned long tick, const struct archive_bucket * bucket) {
+	return tick < bucket->tick ? -1 : tick > bucket->tick;
+}
+
+VECTOR(archive_bucket_vector, struct archive_bucket)
+VECTOR_SEARCH(archive_bucket_vector, const unsigned long, bucket_cmp)
+
+struct archive_chunk {
+	const struct stat_func * func;
+	int fd;                               /* shared by chunks of a file */
+	off_t start;                          /* lines starting in [start, end) */
+	off_t end;
+	long interval;
+	struct archive_bucket_vector buckets; /* sorted by tick */
+	size_t last;                          /* bucket of the last line */
+	unsigned long unlabelled;             /* lines without a TAI64N label */
+	enum nd_err err;
+};
+
+VECTOR(archive_chunk_vector, struct archive_chunk)
+
+enum nd_err
+archive_set_format(enum archive_format * format, const char * str) {
+	if (!strcmp(str, "report"))
+		*format = ARCHIVE_REPORT;
+	else if (!strcmp(str, "stream"))
+		*format = ARCHIVE_STREAM;
+	else
+		return ND_CONFIG;
+
+	return ND_SUCCESS;
+}
+
+static
+void *
+chunk_data(struct archive_chunk * chunk, const unsigned long tick) {
+	struct archive_bucket bucket;
+	size_t idx;
+
+	/* Lines of a file are in time order, mostly of the last tick */
+	if (chunk->last < chunk->buckets.len && archive_bucket_vector_item(&chunk->buckets, chunk->last)->tick == tick)
+		return archive_bucket_vector_item(&chunk->buckets, chunk->last)->data;
+
+	idx = archive_bucket_vector_lower_bound(&chunk->buckets, tick);
+	if (idx == chunk->buckets.len || archive_bucket_vector_item(&chunk->buckets, idx)->tick != tick) {
+		bucket.tick = tick;
+		if (!(bucket.data = chunk->func->init()))
+			return NULL;
+		if (archive_bucket_vector_insert(&chunk->buckets, idx, &bucket) != ND_SUCCESS) {
+			chunk->func->fini(bucket.data);
+			return NULL;
+		}
+	}
+
+	chunk->last = idx;
+
+	return archive_bucket_vector_item(&chunk->buckets, idx)->data;
+}
+
+static
+void
+process_line(struct archive_chunk * chunk, const char * line) {
+	uint64_t ms;
+	void * data;
+
+	if (!(ms = tai64n_unix_ms(line))) {
+		chunk->unlabelled++;
+		return;
+	}
+
+	if (!(data = chunk_data(chunk, ms / chunk->interval))) {
+		chunk->err = ND_ALLOC;
+		return;
+	}
+
+	chunk->func->process(line, data);
+}
+
+static
+void
+read_chunk(void * arg) {
+	struct archive_chunk * chunk = arg;
+	size_t buffered = 0;
+	char * buf, * line, * end;
+	off_t offset;
+	ssize_t ret = 0;
+	int skip;
+	int done = 0;
+
+	if (!(buf = malloc(ARCHIVE_BUFSIZ))) {
+		chunk->err = ND_ALLOC;
+		return;
+	}
+
+	/* The line crossing the start belongs to the previous chunk, the
+	 * first line of the chunk follows the first newline from start - 1 */
+	skip = chunk->start > 0;
+	offset = skip ? chunk->start - 1 : 0;
+
+	while (!done && chunk->err == ND_SUCCESS
+	&& (ret = pread(chunk->fd, buf + buffered, ARCHIVE_BUFSIZ - buffered, offset + buffered)) > 0) {
+		buffered += ret;
+
+		for (line = buf; (end = memchr(line, '\n', buf + buffered - line)); line = end + 1) {
+			if (offset + (line - buf) >= chunk->end) {
+				done = 1;
+				break;
+			}
+
+			*end = '\0';
+			if (!skip)
+				process_line(chunk, line);
+			skip = 0;
+		}
+
+		if (done)
+			break;
+
+		if (line == buf && buffered == ARCHIVE_BUFSIZ) {
+			/* The rest of a cut line is skipped up to its newline */
+			buf[ARCHIVE_BUFSIZ - 1] = '\0';
+			if (!skip && offset < chunk->end)
+				process_line(chunk, buf);
+			skip = 1;
+			offset += buffered;
+			buffered = 0;
+		} else {
+			buffered -= line - buf;
+			offset += line - buf;
+			memmove(buf, line, buffered);
+		}
+	}
+
+	if (!done && ret == -1) {
+		perror("E: Cannot read archive");
+		chunk->err = ND_FILE;
+	}
+
+	/* The last line of a file without a newline */
+	if (!done && !ret && buffered && !skip && offset < chunk->end) {
+		buf[buffered] = '\0';
+		process_line(chunk, buf);
+	}
+
+	free(buf);
+}
+
+static
+enum nd_err
+split_file(struct archive_chunk_vector * chunks, const struct stat_func * func, const char * file_name,
+		const size_t threads, const long interval) {
+	struct archive_chunk chunk;
+	struct stat st;
+	size_t n, i;
+	int fd;
+
+	if ((fd = open(file_name, O_RDONLY | O_CLOEXEC)) == -1 || fstat(fd, &st) == -1) {
+		fprintf(stderr, "Cannot open archive '%s': %s\n", file_name, strerror(errno));
+		if (fd != -1)
+			close(fd);
+		return ND_FILE;
+	}
+
+	n = st.st_size / ARCHIVE_CHUNK_MIN;
+	if (n > threads * ARCHIVE_CHUNKS_PER_THREAD)
+		n = threads * ARCHIVE_CHUNKS_PER_THREAD;
+	if (!n)
+		n = 1;
+
+	memset(&chunk, 0, sizeof chunk);
+	chunk.func = func;
+	chunk.fd = fd;
+	chunk.interval = interval;
+	chunk.last = (size_t)-1;
+
+	for (i = 0; i < n; i++) {
+		chunk.start = st.st_size * i / n;
+		chunk.end = st.st_size * (i + 1) / n;
+		if (archive_chunk_vector_add(chunks, &chunk) != ND_SUCCESS) {
+			if (!i)
+				close(fd);
+			return ND_ALLOC;
+		}
+	}
+
+	return ND_SUCCESS;
+}
+
+/* Moves statistics of the chunks into the merged ones */
+static
+enum nd_err
+merge_chunks(struct archive_bucket_vector * merged, struct archive_chunk_vector * chunks,
+		const struct stat_func * func) {
+	struct archive_bucket * bucket, * into;
+	struct archive_chunk * chunk;
+	enum nd_err ret = ND_SUCCESS;
+	size_t i, j, idx;
+
+	for (i = 0; i < chunks->len; i++) {
+		chunk = archive_chunk_vector_item(chunks, i);
+		for (j = 0; j < chunk->buckets.len; j++) {
+			bucket = archive_bucket_vector_item(&chunk->buckets, j);
+			idx = archive_bucket_vector_lower_bound(merged, bucket->tick);
+			into = archive_bucket_vector_item(merged, idx);
+
+			if (idx < merged->len && into->tick == bucket->tick) {
+				func->merge(into->data, bucket->data);
+				func->fini(bucket->data);
+			} else if (archive_bucket_vector_insert(merged, idx, bucket) != ND_SUCCESS) {
+				func->fini(bucket->data);
+				ret = ND_ALLOC;
+			}
+		}
+		chunk->buckets.len = 0;
+	}
+
+	return ret;
+}
+
+static
+enum nd_err
+write_report(const struct archive_bucket_vector * merged, const struct stat_func * func,
+		const char * name, const long interval, void * last) {
+	const struct archive_bucket * bucket;
+	unsigned long long ms;
+	char time_str[32];
+	struct tm tm;
+	time_t sec;
+	size_t i, len;
+
+	for (i = 0; i < merged->len; i++) {
+		bucket = archive_bucket_vector_item(merged, i);
+		ms = (unsigned long long)bucket->tick * interval;
+		sec = ms / 1000;
+		gmtime_r(&sec, &tm);
+		len = strftime(time_str, sizeof time_str, "%Y-%m-%dT%H:%M:%S", &tm);
+		snprintf(time_str + len, sizeof time_str - len, ".%03lluZ", ms % 1000);
+
+		nd_report_time = time_str;
+		if (func->carry)
+			func->carry(bucket->data, last);
+		if (func->postprocess)
+			func->postprocess(bucket->data);
+		if (func->print(name, bucket->data, interval * 1000)) {
+			nd_report_time = NULL;
+			return ND_FILE;
+		}
+	}
+
+	nd_report_time = NULL;
+
+	return ND_SUCCESS;
+}
+
+/* Ticks without lines are written with empty statistics, so the stream
+ * replays at the pace of the archive */
+static
+enum nd_err
+write_stream(const struct archive_bucket_vector * merged, const struct stat_func * func,
+		const char * name, const long interval, void * empty, void * last) {
+	const struct archive_bucket * bucket;
+	unsigned long tick;
+	size_t i;
+	void * data;
+
+	if (!merged->len)
+		return ND_SUCCESS;
+
+	nd_update_every = interval_update_every(interval);
+	if (func->print_hdr(name))
+		return ND_FILE;
+
+	bucket = archive_bucket_vector_item(merged, 0);
+	for (i = 0, tick = bucket->tick; i < merged->len; tick++) {
+		bucket = archive_bucket_vector_item(merged, i);
+		if (bucket->tick == tick) {
+			data = bucket->data;
+			i++;
+		} else
+			data = empty;
+
+		if (func->carry)
+			func->carry(data, last);
+		if (func->postprocess)
+			func->postprocess(data);
+		if (func->print(name, data, interval * 1000))
+			return ND_FILE;
+	}
+
+	return ND_SUCCESS;
+}
+
+enum nd_err
+archive_process(const struct stat_func * func, const char * name, const char * const * files, const size_t files_len,
+		const size_t threads, const long interval, const enum archive_format format) {
+	struct archive_chunk_vector chunks = VECTOR_EMPTY;
+	struct archive_bucket_vector merged = VECTOR_EMPTY;
+	struct archive_chunk * chunk;
+	unsigned long unlabelled = 0;
+	enum nd_err ret = ND_SUCCESS;
+	void * last = NULL;
+	struct pool pool;
+	void * empty;
+	size_t i, j;
+
+	/* Shared state of the collector is set up before the threads start */
+	if (!(empty = func->init()))
+		return ND_ALLOC;
+	if (func->carry && !(last = func->init())) {
+		func->fini(empty);
+		return ND_ALLOC;
+	}
+
+	if (archive_chunk_vector_init(&chunks, files_len) != ND_SUCCESS
+	|| archive_bucket_vector_init(&merged, 64) != ND_SUCCESS)
+		ret = ND_ALLOC;
+
+	for (i = 0; ret == ND_SUCCESS && i < files_len; i++)
+		ret = split_file(&chunks, func, files[i], threads, interval);
+
+	if (ret == ND_SUCCESS && (ret = pool_init(&pool, threads)) == ND_SUCCESS) {
+		for (i = 0; ret == ND_SUCCESS && i < chunks.len; i++)
+			ret = pool_add(&pool, &read_chunk, archive_chunk_vector_item(&chunks, i));
+		if (ret == ND_SUCCESS) {
+			pool_start(&pool);
+			pool_wait(&pool, NULL);
+		}
+		pool_free(&pool);
+	}
+
+	for (i = 0; ret == ND_SUCCESS && i < chunks.len; i++) {
+		chunk = archive_chunk_vector_item(&chunks, i);
+		unlabelled += chunk->unlabelled;
+		ret = chunk->err;
+	}
+
+	if (ret == ND_SUCCESS)
+		ret = merge_chunks(&merged, &chunks, func);
+
+	if (unlabelled)
+		fprintf(stderr, "%lu lines without a TAI64N label skipped\n", unlabelled);
+
+	if (ret == ND_SUCCESS) {
+		if (format == ARCHIVE_REPORT)
+			ret = write_report(&merged, func, name, interval, last);
+		else
+			ret = write_stream(&merged, func, name, interval, empty, last);
+	}
+
+	for (i = 0; i < chunks.len; i++) {
+		chunk = archive_chunk_vector_item(&chunks, i);
+		for (j = 0; j < chunk->buckets.len; j++)
+			func->fini(archive_bucket_vector_item(&chunk->buckets, j)->data);
+		archive_bucket_vector_free(&chunk->buckets);
+		if (!chunk->start)
+			close(chunk->fd);
+	}
+	for (i = 0; i < merged.len; i++)
+		func->fini(archive_bucket_vector_item(&merged, i)->data);
+	archive_chunk_vector_free(&chunks);
+	archive_bucket_vector_free(&merged);
+	func->fini(empty);
+	if (last)
+		func->fini(last);
+
+	return ret;
+}
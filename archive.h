@@ -0,0 +1,24 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+
+/* Offline processing of archived multilog files (`@*.s`, `@*.u` and
+ * `current`). Files are split at line boundaries into chunks read by a pool
+ * of threads, every chunk counts its lines in statistics of its own per tick
+ * of their TAI64N label. The statistics are then merged by tick and written
+ * in time order, either as a report or as a stream of the plugin protocol,
+ * which can be replayed to netdata.
+ *
+ * err.h and callbacks.h have to be included before this header. */
+
+enum archive_format {
+	ARCHIVE_REPORT,
+	ARCHIVE_STREAM,
+};
+
+enum nd_err
+archive_set_format(enum archive_format *, const char *);
+
+/* Processes the files by func, which has to be able to merge statistics,
+ * charts are named by name and ticks last interval milliseconds */
+enum nd_err
+archive_process(const struct stat_func *, const char *, const char * const *, const size_t,
+	const size_t, const long, const enum archive_format);
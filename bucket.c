@@ -0,0 +1,72 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+
+#include <stdlib.h>
+#include <time.h>
+
+#include "err.h"
+#include "callbacks.h"
+#include "timer.h"
+
+#include "bucket.h"
+
+enum nd_err
+buckets_init(struct event_buckets * buckets, const struct stat_func * func, const long interval, const unsigned long lag) {
+	size_t i;
+
+	/* The ticks up to the watermark, the tick being read and the one
+	 * starting while it is read */
+	buckets->len = lag + 2;
+	buckets->interval = interval;
+	buckets->first = interval_ticks(interval) - lag;
+	buckets->late = 0;
+	buckets->func = func;
+
+	if (!(buckets->data = calloc(buckets->len, sizeof * buckets->data)))
+		return ND_ALLOC;
+
+	for (i = 0; i < buckets->len; i++) {
+		if (!(buckets->data[i] = func->init())) {
+			buckets_free(buckets);
+			return ND_ALLOC;
+		}
+	}
+
+	return ND_SUCCESS;
+}
+
+void *
+buckets_close(struct event_buckets * buckets) {
+	const unsigned long lag = buckets->len - 2;
+	unsigned long cutoff, tick;
+	void * data;
+
+	/* The timer expires at the end of a tick, the previous one is complete */
+	cutoff = interval_ticks(buckets->interval) - 1 - lag;
+	if (cutoff < buckets->first)
+		cutoff = buckets->first;
+
+	/* Ticks missed by the timer are merged into the printed one */
+	data = buckets->data[cutoff % buckets->len];
+	for (tick = buckets->first; tick < cutoff && tick < buckets->first + buckets->len; tick++) {
+		if (tick % buckets->len == cutoff % buckets->len)
+			continue;
+		buckets->func->merge(data, buckets->data[tick % buckets->len]);
+		buckets->func->clear(buckets->data[tick % buckets->len]);
+	}
+
+	buckets->first = cutoff + 1;
+
+	return data;
+}
+
+void
+buckets_free(struct event_buckets * buckets) {
+	size_t i;
+
+	for (i = 0; buckets->data && i < buckets->len; i++)
+		if (buckets->data[i])
+			buckets->func->fini(buckets->data[i]);
+
+	free(buckets->data);
+	buckets->data = NULL;
+}
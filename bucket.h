@@ -0,0 +1,109 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+
+/* Attribution of log lines to the tick they were logged at. multilog starts
+ * every line with a TAI64N label, `@` followed by 16 hex digits of TAI
+ * seconds offset by 2^62 and 8 hex digits of nanoseconds. A line is counted
+ * in the statistics of the tick of its label, kept in a ring of one
+ * statistics per tick. A tick is printed once the watermark has passed it,
+ * lines logged before the oldest open tick are late and are counted in it.
+ *
+ * err.h has to be included before this header. */
+
+#include <stdint.h>
+
+/* multilog takes TAI as the UNIX time plus 10 seconds, leap seconds are not
+ * accounted */
+#define TAI64_UNIX_OFFSET ((UINT64_C(1) << 62) + 10)
+
+struct event_buckets {
+	void ** data;               /* ring of statistics, the tick modulo len */
+	size_t len;                 /* number of open ticks */
+	unsigned long first;        /* the oldest open tick */
+	long interval;              /* milliseconds of a tick */
+	unsigned long late;         /* lines logged before first since printed */
+	const struct stat_func * func;
+};
+
+/* Values of hex digits plus one, 0 for other characters */
+static const unsigned char tai64n_digit[256] = {
+	['0'] =  1, ['1'] =  2, ['2'] =  3, ['3'] =  4, ['4'] =  5,
+	['5'] =  6, ['6'] =  7, ['7'] =  8, ['8'] =  9, ['9'] = 10,
+	['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+	['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16,
+};
+
+static inline
+uint64_t
+tai64n_hex(const unsigned char * str, const int len, int * valid) {
+	uint64_t value = 0;
+	unsigned char digit;
+	int i;
+
+	for (i = 0; i < len; i++) {
+		/* A NUL terminator is not a digit, the string is not read past
+		 * it */
+		if (!(digit = tai64n_digit[str[i]])) {
+			*valid = 0;
+			return 0;
+		}
+		value = value << 4 | (digit - 1);
+	}
+
+	return value;
+}
+
+/* Decodes the TAI64N label at the start of a line to milliseconds of the
+ * UNIX time, returns 0 if the line has no label */
+static inline
+uint64_t
+tai64n_unix_ms(const char * line) {
+	const unsigned char * str = (const unsigned char *)line;
+	uint64_t sec, nsec;
+	int valid = 1;
+
+	if (*str != '@')
+		return 0;
+
+	sec  = tai64n_hex(str + 1, 16, &valid);
+	nsec = valid ? tai64n_hex(str + 17, 8, &valid) : 0;
+
+	if (!valid || sec < TAI64_UNIX_OFFSET || nsec >= 1000000000)
+		return 0;
+
+	return (sec - TAI64_UNIX_OFFSET) * 1000 + nsec / 1000000;
+}
+
+/* Returns the statistics a line is counted in */
+static inline
+void *
+buckets_line_data(struct event_buckets * buckets, const char * line) {
+	const unsigned long last = buckets->first + buckets->len - 1;
+	unsigned long tick;
+	uint64_t ms;
+
+	/* Lines without a label and from the future belong to the tick being
+	 * read */
+	if (!(ms = tai64n_unix_ms(line)) || (tick = ms / buckets->interval) > last)
+		tick = last;
+
+	if (tick < buckets->first) {
+		buckets->late++;
+		tick = buckets->first;
+	}
+
+	return buckets->data[tick % buckets->len];
+}
+
+/* Opens ticks from now to the watermark given in ticks. Statistics of the
+ * ring are created by func, which has to be able to merge them. */
+enum nd_err
+buckets_init(struct event_buckets *, const struct stat_func *, const long, const unsigned long);
+
+/* Closes the ticks the watermark has passed and returns their statistics to
+ * print, merged into one if more ticks were missed. The caller clears them
+ * after printing, they are reused for the newest tick. */
+void *
+buckets_close(struct event_buckets *);
+
+void
+buckets_free(struct event_buckets *);
@@ -8,4 +8,15 @@ struct stat_func {
 	int  (*print)        (const char *, const void *, unsigned long);
 	void (*process)      (const char *, void *);
 	void (*postprocess)  (void *);
+	/* Adds the second statistics to the first. If it is NULL, lines are
+	 * counted on the tick they are read. */
+	void (*merge)        (void *, const void *);
+	/* Sets gauges of the statistics to print from the second ones, the
+	 * last printed values kept by the watch, if their tick has no lines
+	 * for them, and updates the second ones otherwise. NULL if the
+	 * statistics have no gauges. */
+	void (*carry)        (void *, void *);
+	/* Bytes of statistics holding no pointers, which are handed over to
+	 * a new binary as they are. 0 if they are not handed over. */
+	size_t size;
 };
@@ -0,0 +1,828 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "err.h"
+#include "vector.h"
+
+#include "dfa.h"
+
+/* Maximum count in {m,n} quantifiers */
+#define MAX_REPEAT 255
+
+enum nfa_type {
+	NFA_SET,       /* consumes one byte from the set */
+	NFA_EPS,
+	NFA_SPLIT,
+	NFA_MATCH,     /* expression matched, the rest of the line is irrelevant */
+	NFA_MATCH_END, /* expression matched if the line ends here */
+};
+
+struct nfa_state {
+	enum nfa_type type;
+	int rule;
+	int out;
+	int out1;
+	unsigned char set[32];
+};
+
+/* Fragment of the automaton, `end` is an NFA_EPS state with dangling out */
+struct frag {
+	int start;
+	int end;
+};
+
+struct dfa_set {
+	size_t off; /* offset of NFA states in the pool */
+	size_t len;
+	unsigned int hash;
+};
+
+VECTOR(nfa_vector, struct nfa_state)
+VECTOR(int_vector, int)
+VECTOR(set_vector, struct dfa_set)
+VECTOR(state_vector, struct dfa_state)
+
+struct parser {
+	const char * re;
+	const char * p;
+	const char * err;
+	int rule;
+	struct nfa_vector * nfa;
+};
+
+static inline
+void
+set_add(unsigned char * set, const unsigned char c) {
+	set[c / 8] |= 1 << c % 8;
+}
+
+static inline
+int
+set_has(const unsigned char * set, const unsigned char c) {
+	return set[c / 8] & 1 << c % 8;
+}
+
+static
+int
+nfa_new(struct parser * ps, const enum nfa_type type, const int out, const int out1) {
+	struct nfa_state st;
+
+	memset(&st, 0, sizeof st);
+	st.type = type;
+	st.rule = ps->rule;
+	st.out = out;
+	st.out1 = out1;
+
+	if (nfa_vector_add(ps->nfa, &st) != ND_SUCCESS) {
+		ps->err = "out of memory";
+		return -1;
+	}
+
+	return ps->nfa->len - 1;
+}
+
+static inline
+void
+patch(struct parser * ps, const int end, const int target) {
+	nfa_vector_item(ps->nfa, end)->out = target;
+}
+
+static
+int
+frag_eps(struct parser * ps, struct frag * f) {
+	if ((f->start = f->end = nfa_new(ps, NFA_EPS, -1, -1)) == -1)
+		return -1;
+	return 0;
+}
+
+static
+int
+frag_set(struct parser * ps, struct frag * f, const unsigned char * set) {
+	if ((f->end = nfa_new(ps, NFA_EPS, -1, -1)) == -1)
+		return -1;
+	if ((f->start = nfa_new(ps, NFA_SET, f->end, -1)) == -1)
+		return -1;
+	memcpy(nfa_vector_item(ps->nfa, f->start)->set, set, 32);
+	return 0;
+}
+
+static
+void
+set_escape_class(unsigned char * set, const char c) {
+	int i, neg = 0;
+	unsigned char tmp[32];
+
+	memset(tmp, 0, sizeof tmp);
+	switch (c) {
+	case 'D': neg = 1; /* fall through */
+	case 'd':
+		for (i = '0'; i <= '9'; i++)
+			set_add(tmp, i);
+		break;
+	case 'W': neg = 1; /* fall through */
+	case 'w':
+		for (i = 0; i < 256; i++)
+			if ((i >= '0' && i <= '9') || (i >= 'a' && i <= 'z') || (i >= 'A' && i <= 'Z') || i == '_')
+				set_add(tmp, i);
+		break;
+	case 'S': neg = 1; /* fall through */
+	case 's':
+		set_add(tmp, ' ');
+		set_add(tmp, '\t');
+		set_add(tmp, '\r');
+		set_add(tmp, '\n');
+		set_add(tmp, '\v');
+		set_add(tmp, '\f');
+		break;
+	}
+
+	for (i = 0; i < 32; i++)
+		set[i] |= neg ? ~tmp[i] : tmp[i];
+}
+
+static
+int
+is_escape_class(const char c) {
+	return c && strchr("dDwWsS", c);
+}
+
+static
+unsigned char
+escape_char(const char c) {
+	switch (c) {
+	case 't': return '\t';
+	case 'n': return '\n';
+	case 'r': return '\r';
+	default: return c;
+	}
+}
+
+static
+int
+parse_class(struct parser * ps, struct frag * f) {
+	unsigned char set[32];
+	int neg = 0, first = 1;
+	unsigned char lo, hi;
+	int i;
+
+	memset(set, 0, sizeof set);
+	ps->p++;
+	if (*ps->p == '^') {
+		neg = 1;
+		ps->p++;
+	}
+
+	while (*ps->p && (*ps->p != ']' || first)) {
+		first = 0;
+		if (*ps->p == '\\') {
+			ps->p++;
+			if (!*ps->p)
+				break;
+			if (is_escape_class(*ps->p)) {
+				set_escape_class(set, *ps->p++);
+				continue;
+			}
+			lo = escape_char(*ps->p++);
+		} else {
+			lo = *ps->p++;
+		}
+
+		hi = lo;
+		if (ps->p[0] == '-' && ps->p[1] && ps->p[1] != ']') {
+			ps->p++;
+			if (*ps->p == '\\') {
+				ps->p++;
+				if (!*ps->p || is_escape_class(*ps->p)) {
+					ps->err = "invalid range";
+					return -1;
+				}
+				hi = escape_char(*ps->p++);
+			} else {
+				hi = *ps->p++;
+			}
+			if (hi < lo) {
+				ps->err = "invalid range";
+				return -1;
+			}
+		}
+
+		for (i = lo; i <= hi; i++)
+			set_add(set, i);
+	}
+
+	if (*ps->p != ']') {
+		ps->err = "unterminated character class";
+		return -1;
+	}
+	ps->p++;
+
+	if (neg)
+		for (i = 0; i < 32; i++)
+			set[i] = ~set[i];
+
+	return frag_set(ps, f, set);
+}
+
+static int parse_alt(struct parser *, struct frag *);
+
+static
+int
+parse_atom(struct parser * ps, struct frag * f) {
+	unsigned char set[32];
+
+	memset(set, 0, sizeof set);
+
+	switch (*ps->p) {
+	case '(':
+		ps->p++;
+		if (parse_alt(ps, f) == -1)
+			return -1;
+		if (*ps->p != ')') {
+			ps->err = "missing )";
+			return -1;
+		}
+		ps->p++;
+		return 0;
+	case '[':
+		return parse_class(ps, f);
+	case '.':
+		ps->p++;
+		memset(set, 0xff, sizeof set);
+		return frag_set(ps, f, set);
+	case '\\':
+		ps->p++;
+		if (!*ps->p) {
+			ps->err = "trailing \\";
+			return -1;
+		}
+		if (is_escape_class(*ps->p))
+			set_escape_class(set, *ps->p);
+		else
+			set_add(set, escape_char(*ps->p));
+		ps->p++;
+		return frag_set(ps, f, set);
+	case '*':
+	case '+':
+	case '?':
+	case '{':
+		ps->err = "nothing to repeat";
+		return -1;
+	case '^':
+	case '$':
+		ps->err = "anchors are supported only at the beginning and the end";
+		return -1;
+	default:
+		set_add(set, *ps->p++);
+		return frag_set(ps, f, set);
+	}
+}
+
+static
+int
+parse_count(struct parser * ps, int * m, int * n) {
+	char * end;
+
+	*m = strtol(ps->p + 1, &end, 10);
+	if (end == ps->p + 1)
+		goto err;
+
+	if (*end == '}') {
+		*n = *m;
+	} else if (end[0] == ',' && end[1] == '}') {
+		*n = -1;
+		end++;
+	} else if (*end == ',') {
+		ps->p = end;
+		*n = strtol(ps->p + 1, &end, 10);
+		if (end == ps->p + 1 || *end != '}' || *n < *m)
+			goto err;
+	} else {
+		goto err;
+	}
+
+	if (*m > MAX_REPEAT || *n > MAX_REPEAT)
+		goto err;
+
+	ps->p = end + 1;
+	return 0;
+err:
+	ps->err = "invalid {m,n} quantifier";
+	return -1;
+}
+
+static
+int
+make_star(struct parser * ps, struct frag * f) {
+	int s, e;
+
+	if ((e = nfa_new(ps, NFA_EPS, -1, -1)) == -1)
+		return -1;
+	if ((s = nfa_new(ps, NFA_SPLIT, f->start, e)) == -1)
+		return -1;
+	patch(ps, f->end, s);
+	f->start = s;
+	f->end = e;
+	return 0;
+}
+
+static
+int
+make_optional(struct parser * ps, struct frag * f) {
+	int s, e;
+
+	if ((e = nfa_new(ps, NFA_EPS, -1, -1)) == -1)
+		return -1;
+	if ((s = nfa_new(ps, NFA_SPLIT, f->start, e)) == -1)
+		return -1;
+	patch(ps, f->end, e);
+	f->start = s;
+	f->end = e;
+	return 0;
+}
+
+/* Counted repetition is expanded into copies of the atom, every copy is
+ * created by parsing the atom again. */
+static
+int
+make_count(struct parser * ps, struct frag * f, const char * atom) {
+	const char * after;
+	struct frag res, copy;
+	int m, n, i;
+
+	if (parse_count(ps, &m, &n) == -1)
+		return -1;
+	after = ps->p;
+
+	if (frag_eps(ps, &res) == -1)
+		return -1;
+
+	for (i = 0; n == -1 ? i <= m : i < n; i++) {
+		if (i == 0) {
+			copy = *f;
+		} else {
+			ps->p = atom;
+			if (parse_atom(ps, &copy) == -1)
+				return -1;
+		}
+
+		if (i >= m && (n == -1 ? make_star(ps, &copy) : make_optional(ps, &copy)) == -1)
+			return -1;
+
+		patch(ps, res.end, copy.start);
+		res.end = copy.end;
+	}
+
+	ps->p = after;
+	*f = res;
+	return 0;
+}
+
+static
+int
+parse_repeat(struct parser * ps, struct frag * f) {
+	const char * atom = ps->p;
+	int quantified = 0;
+	int s, e;
+
+	if (parse_atom(ps, f) == -1)
+		return -1;
+
+	for (;; quantified = 1) {
+		switch (*ps->p) {
+		case '*':
+			ps->p++;
+			if (make_star(ps, f) == -1)
+				return -1;
+			break;
+		case '+':
+			ps->p++;
+			if ((e = nfa_new(ps, NFA_EPS, -1, -1)) == -1
+			|| (s = nfa_new(ps, NFA_SPLIT, f->start, e)) == -1)
+				return -1;
+			patch(ps, f->end, s);
+			f->end = e;
+			break;
+		case '?':
+			ps->p++;
+			if (make_optional(ps, f) == -1)
+				return -1;
+			break;
+		case '{':
+			/* {m,n} may only follow the atom directly */
+			if (quantified) {
+				ps->err = "invalid quantifier";
+				return -1;
+			}
+			if (make_count(ps, f, atom) == -1)
+				return -1;
+			break;
+		default:
+			return 0;
+		}
+	}
+}
+
+static
+int
+parse_concat(struct parser * ps, struct frag * f) {
+	struct frag a;
+
+	if (frag_eps(ps, f) == -1)
+		return -1;
+
+	while (*ps->p && *ps->p != '|' && *ps->p != ')') {
+		if (parse_repeat(ps, &a) == -1)
+			return -1;
+		patch(ps, f->end, a.start);
+		f->end = a.end;
+	}
+
+	return 0;
+}
+
+static
+int
+parse_alt(struct parser * ps, struct frag * f) {
+	struct frag b;
+	int s, e;
+
+	if (parse_concat(ps, f) == -1)
+		return -1;
+
+	while (*ps->p == '|') {
+		ps->p++;
+		if (parse_concat(ps, &b) == -1)
+			return -1;
+		if ((e = nfa_new(ps, NFA_EPS, -1, -1)) == -1)
+			return -1;
+		if ((s = nfa_new(ps, NFA_SPLIT, f->start, b.start)) == -1)
+			return -1;
+		patch(ps, f->end, e);
+		patch(ps, b.end, e);
+		f->start = s;
+		f->end = e;
+	}
+
+	return 0;
+}
+
+/* Compiles one expression and returns its start state or -1 */
+static
+int
+compile_rule(struct nfa_vector * nfa, const char * re, const int rule) {
+	int anchor_start = 0, anchor_end = 0;
+	struct parser ps;
+	size_t len, slashes;
+	struct frag f;
+	char * copy;
+	int m, u, h;
+
+	len = strlen(re);
+	if (re[0] == '^') {
+		anchor_start = 1;
+		re++;
+		len--;
+	}
+	if (len && re[len - 1] == '$') {
+		/* Count backslashes before the dollar, \$ is a literal */
+		for (slashes = 0; slashes + 1 < len && re[len - 2 - slashes] == '\\'; slashes++)
+			;
+		if (slashes % 2 == 0) {
+			anchor_end = 1;
+			len--;
+		}
+	}
+
+	if (!(copy = strndup(re, len)))
+		return -1;
+
+	ps.re = ps.p = copy;
+	ps.err = NULL;
+	ps.rule = rule;
+	ps.nfa = nfa;
+
+	if (parse_alt(&ps, &f) == -1 || *ps.p) {
+		if (!ps.err)
+			ps.err = "unmatched )";
+		fprintf(stderr, "Cannot compile regex '%s': %s at offset %ld\n",
+			re - anchor_start, ps.err, (long)(ps.p - ps.re + anchor_start));
+		free(copy);
+		return -1;
+	}
+	free(copy);
+
+	if ((m = nfa_new(&ps, anchor_end ? NFA_MATCH_END : NFA_MATCH, -1, -1)) == -1)
+		return -1;
+	patch(&ps, f.end, m);
+
+	if (anchor_start)
+		return f.start;
+
+	/* Unanchored expression may start anywhere: h -> (u -> h | start) */
+	if ((u = nfa_new(&ps, NFA_SET, -1, -1)) == -1)
+		return -1;
+	if ((h = nfa_new(&ps, NFA_SPLIT, u, f.start)) == -1)
+		return -1;
+	patch(&ps, u, h);
+	memset(nfa_vector_item(nfa, u)->set, 0xff, 32);
+
+	return h;
+}
+
+/* Splits bytes into classes which no NFA_SET distinguishes */
+static
+void
+compute_classes(struct dfa * dfa, const struct nfa_vector * nfa) {
+	short remap[2][256];
+	struct nfa_state * st;
+	size_t i, classes;
+	int b, in;
+
+	memset(dfa->class, 0, sizeof dfa->class);
+	classes = 1;
+
+	for (i = 0; i < nfa->len; i++) {
+		st = nfa_vector_item(nfa, i);
+		if (st->type != NFA_SET)
+			continue;
+
+		memset(remap, 0xff, sizeof remap);
+		classes = 0;
+		for (b = 0; b < 256; b++) {
+			in = !!set_has(st->set, b);
+			if (remap[in][dfa->class[b]] == -1)
+				remap[in][dfa->class[b]] = classes++;
+			dfa->class[b] = remap[in][dfa->class[b]];
+		}
+	}
+
+	dfa->classes = classes;
+}
+
+struct builder {
+	const struct nfa_vector * nfa;
+	struct int_vector pool;  /* NFA states of all DFA states */
+	struct set_vector sets;
+	struct state_vector states;
+	struct int_vector trans;
+	struct int_vector stack;
+	struct int_vector tmp;
+	int * mark;
+	int generation;
+	int index[2 * DFA_MAX_STATES]; /* hash index of sets, position + 1 */
+};
+
+static
+int
+int_cmp(const void * a, const void * b) {
+	return *(const int *)a - *(const int *)b;
+}
+
+/* Epsilon closure of states in b->stack, result is in b->tmp */
+static
+enum nd_err
+closure(struct builder * b) {
+	const struct nfa_state * st;
+	int s;
+
+	b->generation++;
+	b->tmp.len = 0;
+
+	while (b->stack.len) {
+		s = *int_vector_item(&b->stack, --b->stack.len);
+		if (s == -1 || b->mark[s] == b->generation)
+			continue;
+		b->mark[s] = b->generation;
+
+		st = nfa_vector_item(b->nfa, s);
+		switch (st->type) {
+		case NFA_EPS:
+			if (int_vector_add(&b->stack, &st->out) != ND_SUCCESS)
+				return ND_ALLOC;
+			break;
+		case NFA_SPLIT:
+			if (int_vector_add(&b->stack, &st->out1) != ND_SUCCESS
+			|| int_vector_add(&b->stack, &st->out) != ND_SUCCESS)
+				return ND_ALLOC;
+			break;
+		default:
+			if (int_vector_add(&b->tmp, &s) != ND_SUCCESS)
+				return ND_ALLOC;
+		}
+	}
+
+	qsort(b->tmp.data, b->tmp.len, sizeof * b->tmp.data, int_cmp);
+
+	return ND_SUCCESS;
+}
+
+/* Once an expression has matched, states of it and of all later
+ * expressions cannot change the result any more. */
+static
+void
+prune(struct builder * b, struct dfa_state * ds) {
+	const struct nfa_state * st;
+	int matched = INT_MAX;
+	size_t i, j;
+	int s;
+
+	for (i = 0; i < b->tmp.len; i++) {
+		st = nfa_vector_item(b->nfa, *int_vector_item(&b->tmp, i));
+		if (st->type == NFA_MATCH && st->rule < matched)
+			matched = st->rule;
+	}
+
+	ds->accept = matched == INT_MAX ? -1 : matched;
+	ds->accept_end = -1;
+
+	for (i = 0, j = 0; i < b->tmp.len; i++) {
+		s = *int_vector_item(&b->tmp, i);
+		st = nfa_vector_item(b->nfa, s);
+		if (st->rule > matched || (st->rule == matched && st->type != NFA_MATCH))
+			continue;
+		if (st->type == NFA_MATCH_END && (ds->accept_end == -1 || st->rule < ds->accept_end))
+			ds->accept_end = st->rule;
+		*int_vector_item(&b->tmp, j++) = s;
+	}
+	b->tmp.len = j;
+
+	ds->terminal = b->tmp.len == 0 || (b->tmp.len == 1 && ds->accept != -1);
+}
+
+static
+unsigned int
+hash_set(const int * set, const size_t len) {
+	unsigned int h = 2166136261u;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		h ^= set[i];
+		h *= 16777619u;
+	}
+
+	return h;
+}
+
+/* Finds or adds the DFA state of the set in b->tmp, returns its index or -1 */
+static
+int
+intern_set(struct builder * b, const struct dfa_state * ds) {
+	const size_t mask = 2 * DFA_MAX_STATES - 1;
+	struct dfa_set set, * other;
+	size_t i;
+
+	set.hash = hash_set(b->tmp.data, b->tmp.len);
+	set.len = b->tmp.len;
+
+	for (i = set.hash & mask; b->index[i]; i = (i + 1) & mask) {
+		other = set_vector_item(&b->sets, b->index[i] - 1);
+		if (other->hash == set.hash && other->len == set.len
+		&& !memcmp(int_vector_item(&b->pool, other->off), b->tmp.data, set.len * sizeof * b->tmp.data))
+			return b->index[i] - 1;
+	}
+
+	if (b->sets.len == DFA_MAX_STATES) {
+		fprintf(stderr, "Regular expressions are too complex, more than %d states\n", DFA_MAX_STATES);
+		return -1;
+	}
+
+	set.off = b->pool.len;
+	if (int_vector_reserve(&b->pool, b->pool.len + set.len) != ND_SUCCESS)
+		return -1;
+	memcpy(b->pool.data + b->pool.len, b->tmp.data, set.len * sizeof * b->tmp.data);
+	b->pool.len += set.len;
+
+	if (set_vector_add(&b->sets, &set) != ND_SUCCESS || state_vector_add(&b->states, ds) != ND_SUCCESS)
+		return -1;
+
+	b->index[i] = b->sets.len;
+
+	return b->sets.len - 1;
+}
+
+static
+enum nd_err
+build(struct builder * b, struct dfa * dfa, const struct int_vector * starts) {
+	const struct nfa_state * st;
+	unsigned char repr[256];
+	struct dfa_state ds;
+	struct dfa_set set;
+	size_t i, k;
+	int c, s, t;
+
+	for (c = 255; c >= 0; c--)
+		repr[dfa->class[c]] = c;
+
+	for (i = 0; i < starts->len; i++)
+		if (int_vector_add(&b->stack, int_vector_item(starts, i)) != ND_SUCCESS)
+			return ND_ALLOC;
+
+	if (closure(b) != ND_SUCCESS)
+		return ND_ALLOC;
+	prune(b, &ds);
+	if ((dfa->start = intern_set(b, &ds)) == -1)
+		return ND_ERROR;
+
+	for (i = 0; i < b->sets.len; i++) {
+		set = *set_vector_item(&b->sets, i);
+		for (c = 0; c < dfa->classes; c++) {
+			for (k = 0; k < set.len; k++) {
+				s = *int_vector_item(&b->pool, set.off + k);
+				st = nfa_vector_item(b->nfa, s);
+				if (st->type == NFA_SET && set_has(st->set, repr[c])) {
+					if (int_vector_add(&b->stack, &st->out) != ND_SUCCESS)
+						return ND_ALLOC;
+				} else if (st->type == NFA_MATCH) {
+					if (int_vector_add(&b->stack, &s) != ND_SUCCESS)
+						return ND_ALLOC;
+				}
+			}
+
+			if (closure(b) != ND_SUCCESS)
+				return ND_ALLOC;
+			prune(b, &ds);
+			if ((t = intern_set(b, &ds)) == -1)
+				return ND_ERROR;
+			if (int_vector_add(&b->trans, &t) != ND_SUCCESS)
+				return ND_ALLOC;
+		}
+	}
+
+	return ND_SUCCESS;
+}
+
+enum nd_err
+dfa_compile(struct dfa * dfa, const char * const * patterns, const size_t len) {
+	struct nfa_vector nfa = VECTOR_EMPTY;
+	struct int_vector starts = VECTOR_EMPTY;
+	struct builder * b = NULL;
+	enum nd_err ret = ND_ALLOC;
+	size_t i;
+	int s;
+
+	memset(dfa, 0, sizeof * dfa);
+
+	if (nfa_vector_init(&nfa, 64) != ND_SUCCESS || int_vector_init(&starts, len) != ND_SUCCESS)
+		goto out;
+
+	for (i = 0; i < len; i++) {
+		if ((s = compile_rule(&nfa, patterns[i], i)) == -1) {
+			ret = ND_ERROR;
+			goto out;
+		}
+		if (int_vector_add(&starts, &s) != ND_SUCCESS)
+			goto out;
+	}
+
+	compute_classes(dfa, &nfa);
+
+	if (!(b = calloc(1, sizeof * b)) || !(b->mark = calloc(nfa.len, sizeof * b->mark)))
+		goto out;
+	b->nfa = &nfa;
+
+	if (int_vector_init(&b->pool, 256) != ND_SUCCESS
+	|| set_vector_init(&b->sets, 64) != ND_SUCCESS
+	|| state_vector_init(&b->states, 64) != ND_SUCCESS
+	|| int_vector_init(&b->trans, 64 * dfa->classes) != ND_SUCCESS
+	|| int_vector_init(&b->stack, 64) != ND_SUCCESS
+	|| int_vector_init(&b->tmp, 64) != ND_SUCCESS)
+		goto out;
+
+	if ((ret = build(b, dfa, &starts)) != ND_SUCCESS)
+		goto out;
+
+	int_vector_shrink(&b->trans);
+	state_vector_shrink(&b->states);
+	dfa->len = b->states.len;
+	dfa->states = b->states.data;
+	dfa->trans = b->trans.data;
+	b->states.data = NULL;
+	b->trans.data = NULL;
+out:
+	if (b) {
+		int_vector_free(&b->pool);
+		set_vector_free(&b->sets);
+		state_vector_free(&b->states);
+		int_vector_free(&b->trans);
+		int_vector_free(&b->stack);
+		int_vector_free(&b->tmp);
+		free(b->mark);
+		free(b);
+	}
+	int_vector_free(&starts);
+	nfa_vector_free(&nfa);
+
+	return ret;
+}
+
+void
+dfa_free(struct dfa * dfa) {
+	free(dfa->states);
+	free(dfa->trans);
+	dfa->states = NULL;
+	dfa->trans = NULL;
+}
@@ -0,0 +1,55 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+
+/* Several regular expressions compiled into one deterministic automaton.
+ * A line is classified by a single pass over its bytes, no matter how many
+ * expressions there are. If more expressions match, the first one wins.
+ *
+ * Supported syntax: literals, `.`, `[...]` and `[^...]` classes with ranges,
+ * escapes `\d \w \s \D \W \S \t \n \r \\` and `\` before any other character,
+ * groups `(...)`, alternation `|`, quantifiers `* + ? {m} {m,} {m,n}`, `^`
+ * at the beginning and `$` at the end of the expression. Expressions are not
+ * anchored unless `^` or `$` is given. There are no backreferences.
+ *
+ * err.h has to be included before this header. */
+
+/* Maximum number of states, compilation fails for more complex expressions */
+#define DFA_MAX_STATES 16384
+
+struct dfa_state {
+	int accept;     /* expression which has already matched, -1 if none */
+	int accept_end; /* expression which matches if the line ends here, -1 if none */
+	int terminal;   /* further input cannot change the result */
+};
+
+struct dfa {
+	unsigned char class[256];  /* byte to equivalence class */
+	size_t classes;            /* number of equivalence classes */
+	size_t len;                /* number of states */
+	int start;
+	struct dfa_state * states;
+	int * trans;               /* states * classes transitions */
+};
+
+enum nd_err
+dfa_compile(struct dfa *, const char * const *, const size_t);
+
+void
+dfa_free(struct dfa *);
+
+/* Returns index of the first expression matching the line or -1 */
+static inline
+int
+dfa_match(const struct dfa * dfa, const char * line) {
+	const unsigned char * p = (const unsigned char *)line;
+	const struct dfa_state * st;
+	int s = dfa->start;
+
+	for (; *p && !dfa->states[s].terminal; p++)
+		s = dfa->trans[s * dfa->classes + dfa->class[*p]];
+
+	st = dfa->states + s;
+	if (st->accept_end >= 0 && (st->accept < 0 || st->accept_end < st->accept))
+		return st->accept_end;
+
+	return st->accept;
+}
@@ -0,0 +1,221 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "err.h"
+#include "netdata.h"
+#include "vector.h"
+
+#include "dimension.h"
+
+size_t dim_max = DIM_MAX_DEFAULT;
+time_t dim_idle = DIM_IDLE_DEFAULT;
+
+static
+time_t
+monotonic_now() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+/* FNV-1a */
+static
+unsigned int
+hash_str(const char * str) {
+	unsigned int h = 2166136261u;
+
+	for (; *str; str++) {
+		h ^= (unsigned char)*str;
+		h *= 16777619u;
+	}
+
+	return h;
+}
+
+static
+void
+index_insert(struct dim_registry * r, const unsigned int hash, const size_t pos) {
+	size_t i;
+
+	for (i = hash & r->index_mask; r->index[i]; i = (i + 1) & r->index_mask)
+		;
+
+	r->index[i] = pos + 1;
+}
+
+static
+void
+index_rebuild(struct dim_registry * r) {
+	size_t i;
+
+	memset(r->index, 0, (r->index_mask + 1) * sizeof * r->index);
+	for (i = 0; i < r->dims.len; i++)
+		index_insert(r, dim_registry_item(r, i)->hash, i);
+}
+
+static
+struct dim *
+index_lookup(const struct dim_registry * r, const char * name, const unsigned int hash) {
+	struct dim * d;
+	size_t i;
+
+	for (i = hash & r->index_mask; r->index[i]; i = (i + 1) & r->index_mask) {
+		d = dim_registry_item(r, r->index[i] - 1);
+		if (d->hash == hash && !strcmp(d->name, name))
+			return d;
+	}
+
+	return NULL;
+}
+
+enum nd_err
+dim_registry_init(struct dim_registry * r) {
+	size_t cap;
+	enum nd_err ret;
+
+	memset(r, 0, sizeof * r);
+	r->max = dim_max;
+	r->idle = dim_idle;
+	r->now = monotonic_now();
+
+	/* The overflow dimension may exceed the maximum by one and the table
+	 * is kept at most half full */
+	for (cap = 16; cap < 2 * (r->max + 1); cap *= 2)
+		;
+
+	if (!(r->index = calloc(cap, sizeof * r->index)))
+		return ND_ALLOC;
+	r->index_mask = cap - 1;
+
+	if ((ret = dim_vector_init(&r->dims, 16)) != ND_SUCCESS) {
+		free(r->index);
+		r->index = NULL;
+	}
+
+	return ret;
+}
+
+static
+struct dim *
+dim_insert(struct dim_registry * r, const char * name, const unsigned int hash) {
+	struct dim d;
+
+	d.name = strdup(name);
+	if (d.name == NULL)
+		return NULL;
+	d.hash = hash;
+	d.count = 0;
+	d.last_seen = r->now;
+	d.state = DIM_NEW;
+
+	if (dim_vector_add(&r->dims, &d) != ND_SUCCESS) {
+		free(d.name);
+		return NULL;
+	}
+
+	index_insert(r, hash, r->dims.len - 1);
+	r->changed = 1;
+
+	return dim_registry_item(r, r->dims.len - 1);
+}
+
+enum nd_err
+dim_registry_add(struct dim_registry * r, const char * name, const long count) {
+	unsigned int hash;
+	struct dim * d;
+
+	hash = hash_str(name);
+	d = index_lookup(r, name, hash);
+
+	if (d == NULL && r->dims.len >= r->max) {
+		name = DIM_OVERFLOW_NAME;
+		hash = hash_str(name);
+		d = index_lookup(r, name, hash);
+	}
+
+	if (d == NULL && (d = dim_insert(r, name, hash)) == NULL)
+		return ND_ALLOC;
+
+	if (d->state == DIM_OBSOLETE)
+		d->state = DIM_ACTIVE;
+
+	d->count += count;
+	d->last_seen = r->now;
+
+	return ND_SUCCESS;
+}
+
+void
+dim_registry_clear(struct dim_registry * r) {
+	struct dim * d;
+	size_t i;
+
+	r->now = monotonic_now();
+
+	for (i = 0; i < r->dims.len; i++) {
+		d = dim_registry_item(r, i);
+		d->count = 0;
+		if (r->idle && d->state == DIM_ACTIVE && r->now - d->last_seen >= r->idle) {
+			d->state = DIM_OBSOLETE;
+			r->changed = 1;
+		}
+	}
+}
+
+void
+dim_registry_print_dimensions(struct dim_registry * r) {
+	struct dim * d;
+	size_t i, j;
+
+	for (i = 0, j = 0; i < r->dims.len; i++) {
+		d = dim_registry_item(r, i);
+		if (d->state == DIM_OBSOLETE) {
+			nd_dimension(d->name, d->name, ND_ALG_ABSOLUTE, 1, 1, ND_OBSOLETE);
+			free(d->name);
+			continue;
+		}
+
+		if (d->state == DIM_NEW) {
+			nd_dimension(d->name, d->name, ND_ALG_ABSOLUTE, 1, 1, ND_VISIBLE);
+			d->state = DIM_ACTIVE;
+		}
+
+		if (i != j)
+			*dim_registry_item(r, j) = *d;
+		j++;
+	}
+
+	if (j != r->dims.len) {
+		r->dims.len = j;
+		index_rebuild(r);
+	}
+
+	r->changed = 0;
+}
+
+void
+dim_registry_set(const struct dim_registry * r) {
+	struct dim * d;
+	size_t i;
+
+	for (i = 0; i < r->dims.len; i++) {
+		d = dim_registry_item(r, i);
+		nd_set(d->name, d->count);
+	}
+}
+
+void
+dim_registry_free(struct dim_registry * r) {
+	size_t i;
+
+	for (i = 0; i < r->dims.len; i++)
+		free(dim_registry_item(r, i)->name);
+
+	dim_vector_free(&r->dims);
+	free(r->index);
+	r->index = NULL;
+}
@@ -0,0 +1,68 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+
+/* Default maximum number of dynamic dimensions per registry */
+#define DIM_MAX_DEFAULT 100
+/* Default number of seconds after which an idle dimension is obsoleted */
+#define DIM_IDLE_DEFAULT (60 * 60)
+/* Name of the dimension which collects hits over the maximum */
+#define DIM_OVERFLOW_NAME "overflow"
+
+enum dim_state {
+	DIM_ACTIVE,
+	DIM_NEW,      /* DIMENSION line has not been printed yet */
+	DIM_OBSOLETE, /* idle for too long, it is removed once it is printed */
+};
+
+struct dim {
+	char * name;
+	unsigned int hash;
+	long count;
+	time_t last_seen;
+	enum dim_state state;
+};
+
+VECTOR(dim_vector, struct dim)
+
+struct dim_registry {
+	struct dim_vector dims; /* dimensions in order of appearance */
+	unsigned int * index;   /* open addressing table of positions in dims + 1 */
+	size_t index_mask;      /* index capacity - 1, capacity is a power of two */
+	size_t max;             /* maximum number of dimensions */
+	time_t idle;            /* seconds of inactivity before obsoleting */
+	time_t now;             /* time of the last clear */
+	int changed;            /* there are new or obsolete dimensions */
+};
+
+/* Values used by dim_registry_init, plugins set them from command line */
+extern size_t dim_max;
+extern time_t dim_idle;
+
+static inline
+int
+dim_registry_is_init(const struct dim_registry * r) {
+	return dim_vector_is_init(&r->dims);
+}
+
+static inline
+struct dim *
+dim_registry_item(const struct dim_registry * r, const size_t idx) {
+	return dim_vector_item(&r->dims, idx);
+}
+
+enum nd_err
+dim_registry_init(struct dim_registry *);
+
+enum nd_err
+dim_registry_add(struct dim_registry *, const char *, const long);
+
+void
+dim_registry_clear(struct dim_registry *);
+
+void
+dim_registry_print_dimensions(struct dim_registry *);
+
+void
+dim_registry_set(const struct dim_registry *);
+
+void
+dim_registry_free(struct dim_registry *);
@@ -10,6 +10,7 @@ nd_err_to_str(const enum nd_err err) {
 	case ND_INOTIFY: return "Inotify error";
 	case ND_ALLOC: return "Allocation error";
 	case ND_FILE: return "File error";
+	case ND_CONFIG: return "Configuration error";
 	default:
 		return "Unknown";
 	}
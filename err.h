@@ -7,6 +7,7 @@ enum nd_err {
 	ND_ALLOC,
 	ND_INOTIFY,
 	ND_FILE,
+	ND_CONFIG,
 };
 
 char *
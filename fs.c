@@ -1,5 +1,6 @@
 /* SPDX-License-Identifier: GPL-3.0-or-later */
 
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
@@ -10,9 +11,11 @@
 #include <time.h>
 #include <unistd.h>
 
-#include "callbacks.h"
 #include "err.h"
+#include "callbacks.h"
+#include "vector.h"
 #include "fs.h"
+#include "bucket.h"
 
 int
 is_directory(const char * name) {
@@ -41,17 +44,34 @@ prepare_fs_event_fd() {
 	return fd;
 }
 
+/* Lines of a watch with event buckets are counted in the statistics of the
+ * tick they were logged at */
+static inline
+void *
+line_data(struct fs_watch * watch, const char * line) {
+	return watch->buckets ? buckets_line_data(watch->buckets, line) : watch->data;
+}
+
 enum nd_err
 read_log_file(struct fs_watch * watch) {
 	ssize_t  max_line_length;
 	const char * line;
+	int drained;
 	ssize_t ret;
 	char * end;
 
 	if (watch->fd == -1)
 		return ND_FILE;
 
-	while ((ret = read(watch->fd, watch->buf + watch->buffered, sizeof watch->buf - watch->buffered)) > 0) {
+	for (drained = 0; !drained; ) {
+		ret = read(watch->fd, watch->buf + watch->buffered, sizeof watch->buf - watch->buffered);
+		if (ret <= 0)
+			break;
+		/* A short read reached the end of the file or emptied the
+		 * stream, a stream fed faster than it is read does not keep
+		 * the loop running */
+		drained = ret < sizeof watch->buf - watch->buffered;
+
 		line = watch->buf;
 		ret += watch->buffered;
 		watch->buffered = 0;
@@ -62,7 +82,7 @@ read_log_file(struct fs_watch * watch) {
 				*end = '\0';
 
 				if (watch->skip == DO_NOT_SKIP)
-					watch->func->process(line, watch->data);
+					watch->func->process(line, line_data(watch, line));
 				else
 					watch->skip = DO_NOT_SKIP;
 
@@ -75,7 +95,7 @@ read_log_file(struct fs_watch * watch) {
 					watch->buf[sizeof watch->buf - 1] = '\0';
 
 					if (watch->skip == DO_NOT_SKIP)
-						watch->func->process(line, watch->data);
+						watch->func->process(line, line_data(watch, line));
 
 					watch->skip = SKIP_THE_REST;
 				}
@@ -97,6 +117,88 @@ reopen_log_file(struct fs_watch * watch) {
 	watch->fd = open(file_name, O_RDONLY);
 }
 
+struct fs_watch *
+find_watch(const struct watch_vector * v, const char * dir_name, const char * file_name) {
+	struct fs_watch * watch;
+	size_t i;
+
+	for (i = 0; i < v->len; i++) {
+		watch = watch_vector_item(v, i);
+		if (watch->type == WATCH_LOG_FILE && !strcmp(watch->dir_name, dir_name)
+		&& !strcmp(watch->file_name, file_name))
+			return watch;
+	}
+
+	return NULL;
+}
+
+void
+detach_watch(const int fd, struct fs_watch * watch) {
+	/* Removing the watch of a deleted directory fails harmlessly */
+	if (watch->watch_dir != -1)
+		inotify_rm_watch(fd, watch->watch_dir);
+	if (watch->fd != -1)
+		close(watch->fd);
+
+	watch->watch_dir = -1;
+	watch->fd = -1;
+	watch->buffered = 0;
+	watch->skip = DO_NOT_SKIP;
+	watch->state = WATCH_REMOVED;
+}
+
+/* Directories are created, deleted or renamed in the base directory, log
+ * directories are often symbolic links */
+#define LOG_DIR_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR)
+
+enum nd_err
+watch_log_dirs(const int fd, struct fs_discovery * discovery) {
+	discovery->watch_dir = inotify_add_watch(fd, ".", LOG_DIR_EVENTS);
+	if (discovery->watch_dir == -1) {
+		perror("inotify_add_watch");
+		return ND_INOTIFY;
+	}
+
+	return ND_SUCCESS;
+}
+
+void
+rescan_log_dirs(const struct watch_vector * v, const struct fs_discovery * discovery) {
+	struct dirent * dir_entry;
+	struct fs_watch * watch;
+	DIR * dir;
+	size_t i;
+
+	if (!(dir = opendir("."))) {
+		perror("opendir");
+		return;
+	}
+
+	while ((dir_entry = readdir(dir)))
+		if (dir_entry->d_name[0] != '.' && is_directory(dir_entry->d_name) == 1)
+			discovery->attach(dir_entry->d_name, discovery->arg);
+	closedir(dir);
+
+	for (i = 0; i < v->len; i++) {
+		watch = watch_vector_item(v, i);
+		if (watch->type == WATCH_LOG_FILE && watch->state == WATCH_ACTIVE
+		&& is_directory(watch->dir_name) != 1)
+			discovery->detach(watch->dir_name, discovery->arg);
+	}
+}
+
+static
+void
+process_log_dir_event(const struct inotify_event * event, const struct fs_discovery * discovery) {
+	if (!event->len || event->name[0] == '.')
+		return;
+
+	if (!(event->mask & (IN_CREATE | IN_MOVED_TO)))
+		discovery->detach(event->name, discovery->arg);
+	else if (is_directory(event->name) == 1)
+		discovery->attach(event->name, discovery->arg);
+}
+
 static
 void
 process_fs_event(const struct inotify_event * event, struct fs_watch * watchers, size_t watchers_length) {
@@ -117,7 +219,7 @@ process_fs_event(const struct inotify_event * event, struct fs_watch * watchers,
 }
 
 void
-process_fs_event_queue(const int fd, struct fs_watch * watchers, size_t watchers_length) {
+process_fs_event_queue(const int fd, struct watch_vector * v, const struct fs_discovery * discovery) {
 	const struct inotify_event * event;
 	char buf[BUFSIZ];
 	ssize_t len;
@@ -135,7 +237,14 @@ process_fs_event_queue(const int fd, struct fs_watch * watchers, size_t watchers
 
 		for (ptr = buf; ptr < buf + len; ptr += sizeof * event + event->len) {
 			event = (const struct inotify_event *)ptr;
-			process_fs_event(event, watchers, watchers_length);
+
+			/* Attached watches may move the vector */
+			if (discovery && event->mask & IN_Q_OVERFLOW)
+				rescan_log_dirs(v, discovery);
+			else if (discovery && event->wd == discovery->watch_dir)
+				process_log_dir_event(event, discovery);
+			else
+				process_fs_event(event, v->data, v->len);
 		}
 	}
 }
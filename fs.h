@@ -3,6 +3,13 @@
 enum watch_type {
 	WATCH_LOG_FILE,
 	WATCH_QUEUE,
+	WATCH_STREAM, /* lines fed through a FIFO or a socket */
+};
+
+enum watch_state {
+	WATCH_ACTIVE = 0,
+	WATCH_REMOVED, /* the log directory is gone, charts are obsoleted on the next tick */
+	WATCH_GONE,    /* charts are obsolete, reused if the directory comes back */
 };
 
 enum skip {
@@ -20,12 +27,45 @@ struct fs_watch {
 	enum skip skip;
 	struct timespec time;
 	void * data;
+	void * last;                    /* gauges printed last, NULL unless func->carry */
+	struct event_buckets * buckets; /* lines by log time, NULL by read time */
+	struct fs_stream * stream;      /* NULL unless the watch is a stream */
 	const struct stat_func * func;
 	enum watch_type type;
+	long interval; /* milliseconds between measurements */
+	int due;       /* measured on this tick */
+	enum watch_state state;
+};
+
+VECTOR(watch_vector, struct fs_watch)
+
+/* Log directories appearing in and disappearing from the working directory,
+ * the callbacks get the directory name and arg. attach is called also for
+ * directories with an active watch. */
+struct fs_discovery {
+	int watch_dir;
+	void (*attach)(const char *, void *);
+	void (*detach)(const char *, void *);
+	void * arg;
 };
 
 int is_directory(const char *);
 
 enum nd_err read_log_file(struct fs_watch *);
 int prepare_fs_event_fd();
-void process_fs_event_queue(const int, struct fs_watch *, size_t);
+
+/* Returns the watch of the file of the directory, NULL if there is none */
+struct fs_watch * find_watch(const struct watch_vector *, const char *, const char *);
+
+/* Stops reading the log file, the statistics are kept until the charts are
+ * obsoleted */
+void detach_watch(const int, struct fs_watch *);
+
+enum nd_err watch_log_dirs(const int, struct fs_discovery *);
+
+/* Attaches all directories of the working directory and detaches watches
+ * of directories which are gone */
+void rescan_log_dirs(const struct watch_vector *, const struct fs_discovery *);
+
+/* discovery may be NULL if the set of log directories is fixed */
+void process_fs_event_queue(const int, struct watch_vector *, const struct fs_discovery *);
@@ -0,0 +1,423 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "err.h"
+#include "callbacks.h"
+#include "vector.h"
+#include "dimension.h"
+#include "fs.h"
+#include "bucket.h"
+
+#include "handoff.h"
+
+/* Written first, a state of another format is refused */
+static const char handoff_magic[] = "netdata plugin handoff 2";
+
+FILE *
+handoff_create(const char * name) {
+	FILE * state;
+	int fd;
+
+	if ((fd = memfd_create(name, MFD_CLOEXEC)) == -1) {
+		perror("memfd_create");
+		return NULL;
+	}
+
+	if (!(state = fdopen(fd, "w+"))) {
+		perror("fdopen");
+		close(fd);
+		return NULL;
+	}
+
+	if (handoff_write(state, handoff_magic, sizeof handoff_magic) != ND_SUCCESS) {
+		fclose(state);
+		return NULL;
+	}
+
+	return state;
+}
+
+FILE *
+handoff_resume(const char * name) {
+	char magic[sizeof handoff_magic];
+	const char * env;
+	FILE * state;
+	char * end;
+	long fd;
+
+	if (!(env = getenv(HANDOFF_ENV)))
+		return NULL;
+
+	/* Plugins started by this one do not get the state */
+	fd = strtol(env, &end, 10);
+	unsetenv(HANDOFF_ENV);
+	if (*end || fd < 0 || fd > INT32_MAX) {
+		fprintf(stderr, "%s: invalid handoff descriptor\n", name);
+		return NULL;
+	}
+
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	if (!(state = fdopen(fd, "r"))) {
+		fprintf(stderr, "%s: cannot open handoff state: %s\n", name, strerror(errno));
+		close(fd);
+		return NULL;
+	}
+
+	if (handoff_read(state, magic, sizeof magic) != ND_SUCCESS || memcmp(magic, handoff_magic, sizeof magic)) {
+		fprintf(stderr, "%s: handoff state of an unknown format\n", name);
+		fclose(state);
+		return NULL;
+	}
+
+	return state;
+}
+
+enum nd_err
+handoff_keep_fd(const int fd) {
+	int flags;
+
+	if (fd == -1)
+		return ND_SUCCESS;
+
+	if ((flags = fcntl(fd, F_GETFD)) == -1 || fcntl(fd, F_SETFD, flags & ~FD_CLOEXEC) == -1) {
+		perror("fcntl");
+		return ND_FILE;
+	}
+
+	return ND_SUCCESS;
+}
+
+enum nd_err
+handoff_exec(FILE * state, char * const argv[]) {
+	char env[32];
+	int fd;
+
+	if (fflush(state) == EOF || fseek(state, 0, SEEK_SET) == -1) {
+		perror("Cannot write handoff state");
+		return ND_FILE;
+	}
+
+	fd = fileno(state);
+	if (handoff_keep_fd(fd) != ND_SUCCESS)
+		return ND_FILE;
+
+	sprintf(env, "%d", fd);
+	if (setenv(HANDOFF_ENV, env, 1) == -1) {
+		perror("setenv");
+		return ND_ALLOC;
+	}
+
+	/* Lines printed to netdata must not be lost in the buffer */
+	fflush(stdout);
+	execv(argv[0], argv);
+
+	fprintf(stderr, "Cannot execute '%s': %s\n", argv[0], strerror(errno));
+	unsetenv(HANDOFF_ENV);
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+	return ND_ERROR;
+}
+
+enum nd_err
+handoff_write(FILE * state, const void * data, const size_t len) {
+	return fwrite(data, 1, len, state) == len ? ND_SUCCESS : ND_FILE;
+}
+
+enum nd_err
+handoff_read(FILE * state, void * data, const size_t len) {
+	return fread(data, 1, len, state) == len ? ND_SUCCESS : ND_FILE;
+}
+
+enum nd_err
+handoff_write_block(FILE * state, const void * data, const size_t len) {
+	uint64_t size = len;
+
+	if (handoff_write(state, &size, sizeof size) != ND_SUCCESS)
+		return ND_FILE;
+
+	return handoff_write(state, data, len);
+}
+
+enum nd_err
+handoff_read_block(FILE * state, void * data, const size_t len) {
+	uint64_t size;
+
+	if (handoff_read(state, &size, sizeof size) != ND_SUCCESS)
+		return ND_FILE;
+
+	if (size != len)
+		return ND_ERROR;
+
+	return handoff_read(state, data, len);
+}
+
+enum nd_err
+handoff_write_str(FILE * state, const char * str) {
+	return handoff_write_block(state, str, str ? strlen(str) + 1 : 0);
+}
+
+enum nd_err
+handoff_read_str(FILE * state, char ** str) {
+	uint64_t size;
+
+	*str = NULL;
+
+	if (handoff_read(state, &size, sizeof size) != ND_SUCCESS)
+		return ND_FILE;
+
+	if (!size)
+		return ND_SUCCESS;
+
+	if (size > BUFSIZ)
+		return ND_ERROR;
+
+	if (!(*str = malloc(size)))
+		return ND_ALLOC;
+
+	if (handoff_read(state, *str, size) != ND_SUCCESS || (*str)[size - 1]) {
+		free(*str);
+		*str = NULL;
+		return ND_FILE;
+	}
+
+	return ND_SUCCESS;
+}
+
+/* Fields of a watch kept by the new binary, the rest is set up again */
+struct handoff_watch {
+	int32_t watch_dir;
+	int32_t fd;
+	int64_t buffered;
+	int32_t skip;
+	int32_t state;
+	int64_t interval;
+	int64_t time_sec;
+	int64_t time_nsec;
+	uint64_t buckets;    /* number of ticks of event buckets, 0 without them */
+	uint64_t first;
+	uint64_t late;
+};
+
+static
+enum nd_err
+handoff_write_buckets(FILE * state, const struct event_buckets * buckets) {
+	size_t i;
+
+	for (i = 0; i < buckets->len; i++)
+		if (handoff_write_block(state, buckets->data[i], buckets->func->size) != ND_SUCCESS)
+			return ND_FILE;
+
+	return ND_SUCCESS;
+}
+
+enum nd_err
+handoff_write_watch(FILE * state, const struct fs_watch * watch) {
+	struct handoff_watch w;
+	enum nd_err ret;
+
+	if (!watch->func->size)
+		return ND_ERROR;
+
+	memset(&w, 0, sizeof w);
+	w.watch_dir = watch->watch_dir;
+	w.fd = watch->fd;
+	w.buffered = watch->buffered;
+	w.skip = watch->skip;
+	w.state = watch->state;
+	w.interval = watch->interval;
+	w.time_sec = watch->time.tv_sec;
+	w.time_nsec = watch->time.tv_nsec;
+	if (watch->buckets) {
+		w.buckets = watch->buckets->len;
+		w.first = watch->buckets->first;
+		w.late = watch->buckets->late;
+	}
+
+	if (handoff_write_str(state, watch->dir_name) != ND_SUCCESS
+	|| handoff_write_str(state, watch->file_name) != ND_SUCCESS
+	|| handoff_write_block(state, &w, sizeof w) != ND_SUCCESS
+	|| handoff_write(state, watch->buf, watch->buffered) != ND_SUCCESS)
+		return ND_FILE;
+
+	if (watch->buckets)
+		ret = handoff_write_buckets(state, watch->buckets);
+	else
+		ret = handoff_write_block(state, watch->data, watch->func->size);
+
+	if (ret != ND_SUCCESS || !watch->last)
+		return ret;
+
+	return handoff_write_block(state, watch->last, watch->func->size);
+}
+
+static
+enum nd_err
+handoff_read_buckets(FILE * state, struct fs_watch * watch, const struct handoff_watch * w) {
+	struct event_buckets * buckets;
+	enum nd_err ret;
+	size_t i;
+
+	if (w->buckets < 2 || w->interval <= 0)
+		return ND_ERROR;
+
+	if (!(buckets = malloc(sizeof * buckets)))
+		return ND_ALLOC;
+
+	if (buckets_init(buckets, watch->func, w->interval, w->buckets - 2) != ND_SUCCESS) {
+		free(buckets);
+		return ND_ALLOC;
+	}
+	buckets->first = w->first;
+	buckets->late = w->late;
+	watch->buckets = buckets;
+
+	for (i = 0; i < buckets->len; i++)
+		if ((ret = handoff_read_block(state, buckets->data[i], watch->func->size)) != ND_SUCCESS)
+			return ret;
+
+	return ND_SUCCESS;
+}
+
+enum nd_err
+handoff_read_watch(FILE * state, struct fs_watch * watch, const struct stat_func * func, const char * file_name) {
+	struct handoff_watch w;
+	enum nd_err ret;
+	char * name;
+
+	memset(watch, 0, sizeof * watch);
+	watch->type = WATCH_LOG_FILE;
+	watch->watch_dir = -1;
+	watch->fd = -1;
+	watch->func = func;
+
+	if ((ret = handoff_read_str(state, &name)) != ND_SUCCESS)
+		return ret;
+	watch->dir_name = name;
+	if ((ret = handoff_read_str(state, &name)) != ND_SUCCESS)
+		return ret;
+	/* The file name is kept by the plugin */
+	if (!name || strcmp(name, file_name)) {
+		free(name);
+		return ND_ERROR;
+	}
+	free(name);
+	watch->file_name = file_name;
+
+	if ((ret = handoff_read_block(state, &w, sizeof w)) != ND_SUCCESS)
+		return ret;
+	if (w.buffered < 0 || w.buffered > sizeof watch->buf)
+		return ND_ERROR;
+
+	watch->watch_dir = w.watch_dir;
+	watch->fd = w.fd;
+	watch->buffered = w.buffered;
+	watch->skip = w.skip;
+	watch->state = w.state;
+	watch->interval = w.interval;
+	watch->time.tv_sec = w.time_sec;
+	watch->time.tv_nsec = w.time_nsec;
+
+	if ((ret = handoff_read(state, watch->buf, watch->buffered)) != ND_SUCCESS)
+		return ret;
+
+	if (!func->size)
+		return ND_ERROR;
+
+	if (w.buckets)
+		ret = handoff_read_buckets(state, watch, &w);
+	else if (!(watch->data = func->init()))
+		return ND_ALLOC;
+	else
+		ret = handoff_read_block(state, watch->data, func->size);
+
+	if (ret != ND_SUCCESS || !func->carry)
+		return ret;
+
+	if (!(watch->last = func->init()))
+		return ND_ALLOC;
+
+	return handoff_read_block(state, watch->last, func->size);
+}
+
+/* Fields of a dynamic dimension besides its name */
+struct handoff_dim {
+	int64_t count;
+	int64_t last_seen;
+	int32_t state;
+};
+
+enum nd_err
+handoff_write_dims(FILE * state, const struct dim_registry * r) {
+	const struct dim * d;
+	struct handoff_dim hd;
+	uint64_t len;
+	size_t i;
+
+	len = dim_registry_is_init(r) ? r->dims.len : 0;
+	if (handoff_write(state, &len, sizeof len) != ND_SUCCESS)
+		return ND_FILE;
+
+	for (i = 0; i < len; i++) {
+		d = dim_registry_item(r, i);
+		memset(&hd, 0, sizeof hd);
+		hd.count = d->count;
+		hd.last_seen = d->last_seen;
+		hd.state = d->state;
+		if (handoff_write_str(state, d->name) != ND_SUCCESS
+		|| handoff_write_block(state, &hd, sizeof hd) != ND_SUCCESS)
+			return ND_FILE;
+	}
+
+	return ND_SUCCESS;
+}
+
+enum nd_err
+handoff_read_dims(FILE * state, struct dim_registry * r) {
+	struct handoff_dim hd;
+	enum nd_err ret;
+	struct dim * d;
+	uint64_t len;
+	char * name;
+	size_t i;
+
+	if (handoff_read(state, &len, sizeof len) != ND_SUCCESS)
+		return ND_FILE;
+
+	for (i = 0; i < len; i++) {
+		if ((ret = handoff_read_str(state, &name)) != ND_SUCCESS)
+			return ret;
+		if (!name)
+			return ND_ERROR;
+
+		if ((ret = handoff_read_block(state, &hd, sizeof hd)) != ND_SUCCESS
+		|| (ret = dim_registry_add(r, name, hd.count)) != ND_SUCCESS) {
+			free(name);
+			return ret;
+		}
+
+		/* Dimensions over the maximum of the new binary are counted in
+		 * the overflow one */
+		if (r->dims.len && !strcmp((d = dim_registry_item(r, r->dims.len - 1))->name, name)) {
+			d->last_seen = hd.last_seen;
+			d->state = hd.state;
+		}
+		free(name);
+	}
+
+	/* Dimensions netdata already knows have been printed */
+	r->changed = 0;
+	for (i = 0; i < r->dims.len; i++)
+		if (dim_registry_item(r, i)->state != DIM_ACTIVE)
+			r->changed = 1;
+
+	return ND_SUCCESS;
+}
@@ -0,0 +1,56 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+
+/* Hand over of a running plugin to a new binary. On SIGHUP the plugin
+ * writes its state to a memfd and executes itself again. The memfd, the
+ * open log files and streams and the inotify descriptor are inherited, the
+ * number of the memfd is passed in the environment. The new process reads the state
+ * back and goes on reading the logs at the same offsets.
+ *
+ * Values are written field by field, statistics as blocks prefixed by their
+ * size, so a state written by a binary with different statistics is
+ * refused rather than misread.
+ *
+ * err.h, stdio.h, callbacks.h, vector.h and fs.h have to be included
+ * before this header. */
+
+#define HANDOFF_ENV "NETDATA_PLUGIN_HANDOFF_FD"
+
+/* Creates the memfd to write the state to, NULL on error */
+FILE * handoff_create(const char *);
+
+/* Opens the state handed over by the previous binary, NULL if the plugin
+ * has not been re-executed */
+FILE * handoff_resume(const char *);
+
+/* Executes the binary again with the state, the descriptor has to be kept
+ * open across exec by handoff_keep_fd. Returns only on error. */
+enum nd_err handoff_exec(FILE *, char * const []);
+
+/* Clears close-on-exec of a descriptor passed to the new binary */
+enum nd_err handoff_keep_fd(const int);
+
+enum nd_err handoff_write(FILE *, const void *, const size_t);
+enum nd_err handoff_read(FILE *, void *, const size_t);
+
+/* A block of a known size, reading fails if the sizes differ */
+enum nd_err handoff_write_block(FILE *, const void *, const size_t);
+enum nd_err handoff_read_block(FILE *, void *, const size_t);
+
+enum nd_err handoff_write_str(FILE *, const char *);
+/* The string is allocated */
+enum nd_err handoff_read_str(FILE *, char **);
+
+/* Writes the descriptors, the partial line and the statistics of a log
+ * watch with its last gauges */
+enum nd_err handoff_write_watch(FILE *, const struct fs_watch *);
+
+/* Reads a log watch counted by func, which has to have the file name. The
+ * watch refers to the name given. */
+enum nd_err handoff_read_watch(FILE *, struct fs_watch *, const struct stat_func *, const char *);
+
+struct dim_registry;
+
+/* Dynamic dimensions with their counts, state and time they were last
+ * seen */
+enum nd_err handoff_write_dims(FILE *, const struct dim_registry *);
+enum nd_err handoff_read_dims(FILE *, struct dim_registry *);
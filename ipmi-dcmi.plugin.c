@@ -12,6 +12,9 @@
 #include "err.h"
 #include "netdata.h"
 #include "timer.h"
+#include "vector.h"
+
+#include "pool.h"
 
 struct ipmi_dcmi_stat {
 	uint16_t current_power;
@@ -101,25 +104,61 @@ read_data(ipmi_ctx_t ipmi_ctx, struct ipmi_dcmi_stat * data) {
 	return ND_SUCCESS;
 }
 
+/* The BMC is queried by a worker thread, a tick waits for it at most half of
+ * the interval. A BMC not answering in time does not delay the charts, the
+ * last reading is printed together with its age. */
+struct ipmi_job {
+	ipmi_ctx_t ipmi_ctx;
+	struct ipmi_dcmi_stat data;
+	int ret;
+	struct timespec read; /* CLOCK_MONOTONIC end of the reading */
+};
+
+static
+void
+run_job(void * arg) {
+	struct ipmi_job * job = arg;
+
+	job->ret = read_data(job->ipmi_ctx, &job->data);
+	init_timestamp(&job->read);
+}
+
+static
+void
+publish_job(const struct ipmi_job * job, struct ipmi_dcmi_stat * data, struct timespec * reported) {
+	if (job->ret != ND_SUCCESS)
+		return;
+
+	*data = job->data;
+	*reported = job->read;
+}
+
 int
 main(int argc, char **argv) {
 	int ret = 0;
-	int timeout = 1;
+	long interval = 1000;
+	int timer_fd;
 	struct timespec timestamp;
+	struct timespec deadline;
+	struct timespec reported;
 	struct ipmi_dcmi_stat data = {0};
+	struct ipmi_job job = {0};
+	struct pool worker;
+	int use_worker;
+	int reading = 0;
 
 	/* skip argv0 */
 	argv++; argc--;
 
 	if (argc == 1) {
-		timeout = atoi(*argv);
+		interval = parse_interval(*argv);
 	} else if (argc > 1) {
-		fprintf(stderr, "usage: ipmi-dcmi.plugin [timeout]\n");
+		fprintf(stderr, "usage: ipmi-dcmi.plugin [interval]\n");
 		return 1;
 	}
 
-	if (timeout < 1) {
-		fprintf(stderr, "ipmi-dcmi.plugin: timeout must be positive number, got: %s\n", *argv);
+	if (!interval) {
+		fprintf(stderr, "ipmi-dcmi.plugin: interval must be positive number of seconds or milliseconds, got: %s\n", *argv);
 		return 1;
 	}
 
@@ -181,12 +220,43 @@ main(int argc, char **argv) {
 	nd_dimension("state", "state", ND_ALG_ABSOLUTE, 1, 1, ND_VISIBLE);
 #endif
 
-	clock_gettime(CLOCK_REALTIME, &timestamp);
+	nd_chart("ipmi", "dcmi_stale", NULL, NULL, "IPMI DCMI Age of reported reading",
+		"seconds", "power", "ipmi.dcmi_stale", ND_CHART_TYPE_LINE);
+	nd_dimension("stale", "stale", ND_ALG_ABSOLUTE, 1, 1000, ND_VISIBLE);
+
+	job.ipmi_ctx = ipmi_ctx;
+	if (!(use_worker = pool_init(&worker, 1) == ND_SUCCESS))
+		fprintf(stderr, "ipmi-dcmi.plugin: cannot start reading thread, reading without deadline\n");
+
+	timer_fd = prepare_timer_fd(interval);
+	init_timestamp(&timestamp);
+	init_timestamp(&reported);
 
 	for (run = 1; run;) {
 		unsigned long last_update = update_timestamp(&timestamp);
 
-		read_data(ipmi_ctx, &data);
+		set_deadline(&deadline, interval / 2);
+
+		/* A reading late on the previous tick may have finished since */
+		if (reading && !pool_is_busy(&worker)) {
+			publish_job(&job, &data, &reported);
+			reading = 0;
+		}
+
+		if (!reading && use_worker) {
+			pool_clear(&worker);
+			pool_add(&worker, &run_job, &job);
+			pool_start(&worker);
+			reading = 1;
+		} else if (!reading) {
+			run_job(&job);
+			publish_job(&job, &data, &reported);
+		}
+
+		if (reading && pool_wait(&worker, &deadline)) {
+			publish_job(&job, &data, &reported);
+			reading = 0;
+		}
 
 		nd_begin_time("ipmi", "dcmi_power", NULL, last_update);
 		nd_set("current", data.current_power);
@@ -209,14 +279,31 @@ main(int argc, char **argv) {
 		nd_end();
 #endif
 
+		nd_begin_time("ipmi", "dcmi_stale", NULL, last_update);
+		nd_set("stale", timestamp_age(&reported));
+		nd_end();
+
 		if (fflush(stdout) == EOF) {
 			fprintf(stderr, "ipmi-dcmi.plugin: cannot write to stdout: %s\n", strerror(errno));
 			break;
 		}
 
-		sleep(timeout);
+		if (wait_timer_fd(timer_fd) == -1) {
+			fprintf(stderr, "ipmi-dcmi.plugin: cannot wait for timer: %s\n", strerror(errno));
+			break;
+		}
 	}
 
+	/* A reading stuck on the BMC still uses the context, it is left to the
+	 * exit */
+	if (use_worker) {
+		if (pool_is_busy(&worker))
+			return ret;
+		pool_free(&worker);
+	}
+
+	close(timer_fd);
+
 cleanup:
 	ipmi_ctx_close(ipmi_ctx);
 	ipmi_ctx_destroy(ipmi_ctx);
@@ -0,0 +1,435 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "err.h"
+#include "callbacks.h"
+#include "netdata.h"
+#include "vector.h"
+#include "dfa.h"
+#include "fs.h"
+#include "bucket.h"
+
+#include "logtail.h"
+
+#define DEFAULT_FILE "current"
+
+struct logtail_statistics {
+	const struct logtail_section * section; /* NULL until bound */
+	char * dir;
+	char * chart;        /* chart id, the directory path and the section name */
+	long * count;        /* one counter per dimension */
+};
+
+VECTOR(chart_vector, struct logtail_statistics *)
+
+static inline
+int
+chart_cmp(const char * chart, struct logtail_statistics * const * st) {
+	return strcmp(chart, (*st)->chart);
+}
+
+VECTOR_SEARCH(chart_vector, const char *, chart_cmp)
+
+/* Bound statistics sorted by chart id, print_hdr gets only the id */
+static
+struct chart_vector charts = VECTOR_EMPTY;
+
+static
+char *
+trim(char * str) {
+	char * end;
+
+	while (isspace((unsigned char)*str))
+		str++;
+
+	end = str + strlen(str);
+	while (end > str && isspace((unsigned char)end[-1]))
+		end--;
+	*end = '\0';
+
+	return str;
+}
+
+static
+int
+is_valid_id(const char * id) {
+	if (!*id)
+		return 0;
+
+	for (; *id; id++)
+		if (isspace((unsigned char)*id) || *id == '\'' || *id == '"')
+			return 0;
+
+	return 1;
+}
+
+static
+enum nd_err
+add_str(struct str_vector * v, const char * str) {
+	char * copy;
+
+	if (!(copy = strdup(str)))
+		return ND_ALLOC;
+
+	if (str_vector_add(v, &copy) != ND_SUCCESS) {
+		free(copy);
+		return ND_ALLOC;
+	}
+
+	return ND_SUCCESS;
+}
+
+static
+enum nd_err
+set_str(char ** dst, const char * str) {
+	free(*dst);
+	return (*dst = strdup(str)) ? ND_SUCCESS : ND_ALLOC;
+}
+
+static
+enum nd_err
+section_init(struct logtail_section * sec, const char * name) {
+	memset(sec, 0, sizeof * sec);
+
+	if (!(sec->name = strdup(name)) || !(sec->file = strdup(DEFAULT_FILE)))
+		return ND_ALLOC;
+
+	if (str_vector_init(&sec->dirs, 1) != ND_SUCCESS
+	|| str_vector_init(&sec->dims, 4) != ND_SUCCESS
+	|| str_vector_init(&sec->rules, 4) != ND_SUCCESS
+	|| int_vector_init(&sec->rule_dim, 4) != ND_SUCCESS)
+		return ND_ALLOC;
+
+	return ND_SUCCESS;
+}
+
+static
+enum nd_err
+section_add_rule(struct logtail_section * sec, const char * dim, const char * rule) {
+	size_t i;
+	int idx;
+
+	for (i = 0; i < sec->dims.len; i++)
+		if (!strcmp(*str_vector_item(&sec->dims, i), dim))
+			break;
+
+	if (i == sec->dims.len && add_str(&sec->dims, dim) != ND_SUCCESS)
+		return ND_ALLOC;
+
+	idx = i;
+	if (add_str(&sec->rules, rule) != ND_SUCCESS || int_vector_add(&sec->rule_dim, &idx) != ND_SUCCESS)
+		return ND_ALLOC;
+
+	return ND_SUCCESS;
+}
+
+static
+void
+section_free(struct logtail_section * sec) {
+	size_t i;
+
+	for (i = 0; i < sec->dirs.len; i++)
+		free(*str_vector_item(&sec->dirs, i));
+	for (i = 0; i < sec->dims.len; i++)
+		free(*str_vector_item(&sec->dims, i));
+	for (i = 0; i < sec->rules.len; i++)
+		free(*str_vector_item(&sec->rules, i));
+
+	str_vector_free(&sec->dirs);
+	str_vector_free(&sec->dims);
+	str_vector_free(&sec->rules);
+	int_vector_free(&sec->rule_dim);
+	dfa_free(&sec->dfa);
+	free(sec->name);
+	free(sec->title);
+	free(sec->units);
+	free(sec->file);
+}
+
+static
+enum nd_err
+parse_option(struct logtail_section * sec, char * key, char * value) {
+	size_t len;
+
+	if (!strncmp(key, "rule", 4) && isspace((unsigned char)key[4])) {
+		key = trim(key + 4);
+		if (!is_valid_id(key))
+			return ND_CONFIG;
+		return section_add_rule(sec, key, value);
+	} else if (!strcmp(key, "dir")) {
+		/* The path of the directory is a part of the chart id */
+		for (len = strlen(value); len > 1 && value[len - 1] == '/'; len--)
+			value[len - 1] = '\0';
+		return add_str(&sec->dirs, value);
+	} else if (!strcmp(key, "file")) {
+		return set_str(&sec->file, value);
+	} else if (!strcmp(key, "title")) {
+		return set_str(&sec->title, value);
+	} else if (!strcmp(key, "units")) {
+		return set_str(&sec->units, value);
+	}
+
+	return ND_CONFIG;
+}
+
+static
+enum nd_err
+section_check(struct logtail_section * sec) {
+	if (sec->dirs.len == 0) {
+		fprintf(stderr, "Section [%s] has no dir\n", sec->name);
+		return ND_CONFIG;
+	}
+
+	if (sec->rules.len == 0) {
+		fprintf(stderr, "Section [%s] has no rule\n", sec->name);
+		return ND_CONFIG;
+	}
+
+	if (dfa_compile(&sec->dfa, (const char * const *)sec->rules.data, sec->rules.len) != ND_SUCCESS) {
+		fprintf(stderr, "Cannot compile rules of section [%s]\n", sec->name);
+		return ND_CONFIG;
+	}
+
+	fprintf(stderr, "Section [%s]: %zu rules compiled into %zu states\n",
+		sec->name, sec->rules.len, sec->dfa.len);
+
+	return ND_SUCCESS;
+}
+
+/* The configuration consists of sections:
+ *
+ * [name]
+ * dir = /var/log/qmail/smtpd
+ * file = current
+ * title = Chart title
+ * units = events
+ * rule dimension = regular expression
+ */
+enum nd_err
+logtail_config_load(const char * path, struct section_vector * sections) {
+	struct logtail_section sec, * cur = NULL;
+	enum nd_err ret = ND_SUCCESS;
+	char * line = NULL;
+	size_t size = 0;
+	int lineno = 0;
+	char * s, * eq;
+	FILE * f;
+	size_t i;
+
+	if (section_vector_init(sections, 4) != ND_SUCCESS)
+		return ND_ALLOC;
+
+	if (!(f = fopen(path, "r"))) {
+		fprintf(stderr, "Cannot open '%s': %s\n", path, strerror(errno));
+		return ND_FILE;
+	}
+
+	while (ret == ND_SUCCESS && getline(&line, &size, f) != -1) {
+		lineno++;
+		s = trim(line);
+
+		if (!*s || *s == '#' || *s == ';')
+			continue;
+
+		if (*s == '[') {
+			eq = strchr(s, ']');
+			if (!eq || eq[1]) {
+				ret = ND_CONFIG;
+				continue;
+			}
+			*eq = '\0';
+			if (!is_valid_id(s + 1)) {
+				ret = ND_CONFIG;
+			} else if ((ret = section_init(&sec, s + 1)) != ND_SUCCESS
+			|| (ret = section_vector_add(sections, &sec)) != ND_SUCCESS) {
+				section_free(&sec);
+			} else {
+				cur = section_vector_item(sections, sections->len - 1);
+			}
+		} else if (!cur || !(eq = strchr(s, '='))) {
+			ret = ND_CONFIG;
+		} else {
+			*eq = '\0';
+			ret = parse_option(cur, trim(s), trim(eq + 1));
+		}
+	}
+
+	if (ret != ND_SUCCESS)
+		fprintf(stderr, "%s:%d: %s\n", path, lineno,
+			ret == ND_CONFIG ? "invalid line" : "cannot allocate memory");
+
+	for (i = 0; ret == ND_SUCCESS && i < sections->len; i++)
+		ret = section_check(section_vector_item(sections, i));
+
+	free(line);
+	fclose(f);
+
+	return ret;
+}
+
+void
+logtail_config_free(struct section_vector * sections) {
+	size_t i;
+
+	for (i = 0; i < sections->len; i++)
+		section_free(section_vector_item(sections, i));
+
+	section_vector_free(sections);
+}
+
+static
+void *
+logtail_data_init() {
+	return calloc(1, sizeof(struct logtail_statistics));
+}
+
+static
+void
+logtail_data_fini(struct logtail_statistics * data) {
+	ssize_t idx;
+
+	if (!data)
+		return;
+
+	if (data->chart && (idx = chart_vector_search(&charts, data->chart)) != -1
+	&& *chart_vector_item(&charts, idx) == data)
+		chart_vector_remove(&charts, idx);
+	if (chart_vector_is_empty(&charts))
+		chart_vector_free(&charts);
+
+	free(data->dir);
+	free(data->chart);
+	free(data->count);
+	free(data);
+}
+
+/* The whole path tells directories of the same name apart, characters
+ * netdata does not take in ids are replaced by _ */
+static
+char *
+chart_id(const char * dir, const char * section) {
+	char * ret, * p;
+
+	while (*dir == '/' || (dir[0] == '.' && dir[1] == '/'))
+		dir += *dir == '/' ? 1 : 2;
+
+	if (!(ret = malloc(strlen(dir) + strlen(section) + 2)))
+		return NULL;
+	sprintf(ret, "%s_%s", *dir ? dir : "root", section);
+
+	for (p = ret; *p; p++)
+		if (!isalnum((unsigned char)*p) && *p != '-')
+			*p = '_';
+
+	return ret;
+}
+
+enum nd_err
+logtail_data_bind(void * data, const struct logtail_section * sec, const char * dir) {
+	struct logtail_statistics * st = data;
+	size_t idx;
+
+	if (!(st->dir = strdup(dir)) || !(st->chart = chart_id(dir, sec->name))
+	|| !(st->count = calloc(sec->dims.len, sizeof * st->count)))
+		return ND_ALLOC;
+
+	if (!chart_vector_is_init(&charts) && chart_vector_init(&charts, 4) != ND_SUCCESS)
+		return ND_ALLOC;
+
+	idx = chart_vector_lower_bound(&charts, st->chart);
+	if (idx < charts.len && !strcmp((*chart_vector_item(&charts, idx))->chart, st->chart)) {
+		fprintf(stderr, "[%s] '%s' has the chart id of another directory\n", sec->name, dir);
+		return ND_CONFIG;
+	}
+	if (chart_vector_insert(&charts, idx, &st) != ND_SUCCESS)
+		return ND_ALLOC;
+	st->section = sec;
+
+	return ND_SUCCESS;
+}
+
+const char *
+logtail_chart(const void * data) {
+	return ((const struct logtail_statistics *)data)->chart;
+}
+
+static
+int
+logtail_print_hdr(const char * chart) {
+	const struct logtail_statistics * st;
+	const struct logtail_section * sec;
+	char context[BUFSIZ];
+	char title[BUFSIZ];
+	ssize_t idx;
+	size_t i;
+
+	if ((idx = chart_vector_search(&charts, chart)) == -1)
+		return 0;
+	st = *chart_vector_item(&charts, idx);
+	sec = st->section;
+
+	snprintf(title, sizeof title, "%s for %s", sec->title ? sec->title : sec->name, st->dir);
+	snprintf(context, sizeof context, "logtail.%s", sec->name);
+	nd_chart("logtail", st->chart, NULL, NULL, title,
+		sec->units ? sec->units : "events", sec->name, context, ND_CHART_TYPE_LINE);
+
+	for (i = 0; i < sec->dims.len; i++)
+		nd_dimension(*str_vector_item(&sec->dims, i), *str_vector_item(&sec->dims, i),
+			ND_ALG_ABSOLUTE, 1, 1, ND_VISIBLE);
+
+	return fflush(stdout);
+}
+
+static
+int
+logtail_print(const char * name, const struct logtail_statistics * data, const unsigned long time) {
+	const struct logtail_section * sec = data->section;
+	size_t i;
+
+	if (!sec)
+		return 0;
+
+	nd_begin_time("logtail", data->chart, NULL, time);
+	for (i = 0; i < sec->dims.len; i++)
+		nd_set(*str_vector_item(&sec->dims, i), data->count[i]);
+	nd_end();
+
+	return fflush(stdout);
+}
+
+static
+void
+logtail_process(const char * line, struct logtail_statistics * data) {
+	const struct logtail_section * sec = data->section;
+	int rule;
+
+	if (sec && (rule = dfa_match(&sec->dfa, line)) >= 0)
+		data->count[*int_vector_item(&sec->rule_dim, rule)]++;
+}
+
+static
+void
+logtail_clear(struct logtail_statistics * data) {
+	if (data->section)
+		memset(data->count, 0, data->section->dims.len * sizeof * data->count);
+}
+
+static
+struct stat_func logtail = {
+	.init = &logtail_data_init, /* bound to a section by logtail_data_bind */
+	.fini = (void (*)(void *))&logtail_data_fini,
+
+	.print_hdr   = &logtail_print_hdr,
+	.print       = (int (*)(const char *, const void *, unsigned long))&logtail_print,
+	.process     = (void (*)(const char *, void *))&logtail_process,
+	.postprocess = NULL,
+	.clear       = (void (*)(void *))&logtail_clear,
+};
+
+struct stat_func * logtail_func = &logtail;
@@ -0,0 +1,40 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+
+/* err.h, vector.h and dfa.h have to be included before this header. */
+
+VECTOR(str_vector, char *)
+VECTOR(int_vector, int)
+
+/* One section of the configuration: a log file name in several
+ * directories, classified by regular expressions into dimensions of
+ * a single chart. */
+struct logtail_section {
+	char * name;                /* chart id */
+	char * title;
+	char * units;
+	char * file;                /* log file name, "current" by default */
+	struct str_vector dirs;     /* log directories */
+	struct str_vector dims;     /* dimension names */
+	struct str_vector rules;    /* regular expressions */
+	struct int_vector rule_dim; /* dimension index of each rule */
+	struct dfa dfa;             /* all rules of the section */
+};
+
+VECTOR(section_vector, struct logtail_section)
+
+extern struct stat_func * logtail_func;
+
+enum nd_err
+logtail_config_load(const char *, struct section_vector *);
+
+void
+logtail_config_free(struct section_vector *);
+
+/* Binds statistics made by init to a section and a log directory, their
+ * chart id passed to print_hdr is the directory path and the section
+ * name */
+enum nd_err
+logtail_data_bind(void *, const struct logtail_section *, const char *);
+
+const char *
+logtail_chart(const void *);
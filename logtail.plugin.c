@@ -0,0 +1,211 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "err.h"
+#include "callbacks.h"
+#include "flush.h"
+#include "netdata.h"
+#include "signal.h"
+#include "timer.h"
+#include "vector.h"
+
+#include "dfa.h"
+#include "fs.h"
+#include "logtail.h"
+
+#define DEFAULT_CONFIG "/etc/netdata/logtail.conf"
+
+enum poll {
+	POLL_SIGNAL = 0,
+	POLL_TIMER,
+	POLL_FS_EVENT,
+	POLL_LENGTH
+};
+
+#define LEN(x) ( sizeof x / sizeof * x )
+
+static
+void
+usage(const char * name) {
+	fprintf(stderr, "usage: %s <interval> [config]\n", name);
+}
+
+static
+enum nd_err
+prepare_watcher(struct fs_watch * watch, const int fd, const struct logtail_section * sec) {
+	char file_name[PATH_MAX];
+
+	snprintf(file_name, sizeof file_name, "%s/%s", watch->dir_name, watch->file_name);
+	watch->watch_dir = inotify_add_watch(fd, watch->dir_name, IN_CREATE);
+	if (watch->watch_dir == -1) {
+		fprintf(stderr, "Cannot watch directory '%s': %s\n", watch->dir_name, strerror(errno));
+		return ND_INOTIFY;
+	}
+	watch->fd = open(file_name, O_RDONLY);
+	lseek(watch->fd, 0, SEEK_END);
+	watch->type = WATCH_LOG_FILE;
+	watch->func = logtail_func;
+	if (!(watch->data = logtail_func->init()))
+		return ND_ALLOC;
+
+	return logtail_data_bind(watch->data, sec, watch->dir_name);
+}
+
+static
+void
+prepare_watchers(const int fd, const struct section_vector * sections, struct watch_vector * v) {
+	const struct logtail_section * sec;
+	struct fs_watch watch;
+	size_t i, j;
+
+	for (i = 0; i < sections->len; i++) {
+		sec = section_vector_item(sections, i);
+		for (j = 0; j < sec->dirs.len; j++) {
+			memset(&watch, 0, sizeof watch);
+			watch.watch_dir = -1;
+			watch.fd = -1;
+			watch.dir_name = strdup(*str_vector_item(&sec->dirs, j));
+			watch.file_name = sec->file;
+
+			if (watch.dir_name && prepare_watcher(&watch, fd, sec) == ND_SUCCESS) {
+				fprintf(stderr, "[%s] tailing %s/%s\n", sec->name, watch.dir_name, watch.file_name);
+				watch_vector_add(v, &watch);
+			} else {
+				/* The directory may be watched for another
+				 * section */
+				logtail_func->fini(watch.data);
+				if (watch.fd != -1)
+					close(watch.fd);
+				free((void *)watch.dir_name);
+			}
+		}
+	}
+}
+
+int
+main(int argc, const char * argv[]) {
+	struct section_vector sections = VECTOR_EMPTY;
+	struct watch_vector vector = VECTOR_EMPTY;
+	struct pollfd pfd[POLL_LENGTH];
+	unsigned long last_update;
+	struct fs_watch * watch;
+	const char * argv0;
+	const char * config;
+	long interval = 1000;
+	int fs_event_fd;
+	int signal_fd;
+	int timer_fd;
+	int run;
+	int i;
+
+	config = DEFAULT_CONFIG;
+	argv0 = *argv; argv++; argc--;
+
+	if (argc > 0) {
+		if (!(interval = parse_interval(*argv))) {
+			usage(argv0);
+			exit(1);
+		}
+		argv++; argc--;
+	} else
+		usage(argv0);
+
+	if (argc > 0) {
+		config = *argv;
+		argv++; argc--;
+	}
+
+	if (logtail_config_load(config, &sections) != ND_SUCCESS) {
+		nd_disable();
+		exit(1);
+	}
+
+	watch_vector_init(&vector, sections.len);
+
+	timer_fd = prepare_timer_fd(interval);
+	pfd[POLL_TIMER].fd = timer_fd;
+	pfd[POLL_TIMER].events = POLLIN;
+
+	signal_fd = prepare_signal_fd();
+	pfd[POLL_SIGNAL].fd = signal_fd;
+	pfd[POLL_SIGNAL].events = POLLIN;
+
+	fs_event_fd = prepare_fs_event_fd();
+	pfd[POLL_FS_EVENT].fd = fs_event_fd;
+	pfd[POLL_FS_EVENT].events = POLLIN;
+
+	prepare_watchers(fs_event_fd, &sections, &vector);
+
+	if (watch_vector_is_empty(&vector)) {
+		fprintf(stderr, "No log directory to tail\n");
+		nd_disable();
+		exit(1);
+	}
+
+	for (i = 0; i < vector.len; i++) {
+		watch = watch_vector_item(&vector, i);
+		watch->func->print_hdr(logtail_chart(watch->data));
+		init_timestamp(&watch->time);
+	}
+
+	for (run = 1; run;) {
+		switch (poll(pfd, LEN(pfd), -1)) {
+		case -1:
+			perror("poll");
+			break;
+		case 0:
+			fputs("timeout\n", stderr);
+			continue;
+		default:
+			if (pfd[POLL_SIGNAL].revents & POLLIN) {
+				flush_read_fd(signal_fd);
+				run = 0;
+				continue;
+			}
+			if (pfd[POLL_FS_EVENT].revents & POLLIN) {
+				process_fs_event_queue(fs_event_fd, &vector, NULL);
+			}
+			if (pfd[POLL_TIMER].revents & POLLIN) {
+				read_timer_fd(timer_fd);
+				for (i = 0; i < vector.len; i++) {
+					watch = watch_vector_item(&vector, i);
+
+					read_log_file(watch);
+
+					last_update = update_timestamp(&watch->time);
+					if (watch->func->print(logtail_chart(watch->data), watch->data, last_update)) {
+						run = 0;
+						fprintf(stderr, "Cannot write to stdout: %s\n", strerror(errno));
+						break;
+					}
+					watch->func->clear(watch->data);
+				}
+			}
+		}
+	}
+
+	for (i = 0; i < vector.len; i++) {
+		watch = watch_vector_item(&vector, i);
+		free((void *)watch->dir_name);
+		watch->func->fini(watch->data);
+		close(watch->fd);
+	}
+	watch_vector_free(&vector);
+	logtail_config_free(&sections);
+	close(fs_event_fd);
+	close(timer_fd);
+	close(signal_fd);
+
+	return 0;
+}
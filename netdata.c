@@ -36,15 +36,34 @@ print_type_prefix_id(const char * type, const char * prefix, const char * id) {
 		printf("%s.%s", type, check_null(prefix));
 }
 
+int nd_update_every;
+
+int nd_chart_obsolete;
+
+const char * nd_report_time;
+
+/* Chart of the values being reported */
+static char report_chart[256];
+
 void
 nd_chart(const char * type, const char * prefix, const char * id, const char * name,
 		const char * title, const char * units, const char * family, const char * context,
 		enum nd_charttype chart_type) {
+	if (nd_report_time)
+		return;
+
 	fputs("\nCHART ", stdout);
 	print_type_prefix_id(type, prefix, id);
-	printf(" '%s' '%s' '%s' '%s' '%s' %s\n",
+	printf(" '%s' '%s' '%s' '%s' '%s' %s",
 		check_null(name), check_null(title), check_null(units), check_null(family),
 		check_null(context), nd_charttype_str[chart_type]);
+	/* The update interval follows the priority, netdata's default one
+	 * is kept, also by 0 of an obsolete chart */
+	if (nd_update_every > 0 || nd_chart_obsolete)
+		printf(" %d %d", ND_PRIORITY_DEFAULT, nd_update_every);
+	if (nd_chart_obsolete)
+		fputs(" obsolete", stdout);
+	putchar('\n');
 }
 
 void
@@ -55,10 +74,15 @@ nd_disable() {
 void
 nd_dimension(const char * id, const char * name, enum nd_algorithm alg,
 		int multiplier, int divisor, enum nd_visibility visibility) {
+	if (nd_report_time)
+		return;
+
 	printf("DIMENSION %s '%s' %s %d %d",
 		id, check_null(name), nd_algorithm_str[alg], multiplier, divisor);
 	if (visibility == ND_HIDDEN) {
 		fputs(" hidden", stdout);
+	} else if (visibility == ND_OBSOLETE) {
+		fputs(" obsolete", stdout);
 	}
 	putchar('\n');
 }
@@ -70,6 +94,14 @@ nd_begin(const char * type, const char * prefix, const char * id) {
 
 void
 nd_begin_time(const char * type, const char * prefix, const char * id, const unsigned long time) {
+	if (nd_report_time) {
+		if (id)
+			snprintf(report_chart, sizeof report_chart, "%s.%s_%s", type, check_null(prefix), id);
+		else
+			snprintf(report_chart, sizeof report_chart, "%s.%s", type, check_null(prefix));
+		return;
+	}
+
 	fputs("\nBEGIN ", stdout);
 	print_type_prefix_id(type, prefix, id);
 
@@ -85,10 +117,19 @@ nd_begin_time(const char * type, const char * prefix, const char * id, const uns
 
 void
 nd_end() {
+	if (nd_report_time)
+		return;
+
 	puts("END");
 }
 
 void
 nd_set(const char * name, const long value) {
+	if (nd_report_time) {
+		if (value)
+			printf("%s\t%s\t%s\t%ld\n", nd_report_time, report_chart, name, value);
+		return;
+	}
+
 	printf("SET %s = %ld\n", name, value);
 }
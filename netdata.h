@@ -3,6 +3,7 @@
 enum nd_visibility {
 	ND_VISIBLE = 0,
 	ND_HIDDEN,
+	ND_OBSOLETE,
 };
 
 enum nd_algorithm {
@@ -18,6 +19,20 @@ enum nd_charttype {
 	ND_CHART_TYPE_STACKED,
 };
 
+#define ND_PRIORITY_DEFAULT 1000
+
+/* Update interval in seconds put on CHART lines printed afterwards, 0 leaves
+ * it to the update interval of the plugin */
+extern int nd_update_every;
+
+/* Charts printed afterwards are marked obsolete, netdata removes them */
+extern int nd_chart_obsolete;
+
+/* Time of the values written as a report, one tab separated line of time,
+ * chart, dimension and value per value other than 0. NULL writes the plugin
+ * protocol. */
+extern const char * nd_report_time;
+
 void nd_disable();
 
 void nd_chart(
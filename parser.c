@@ -3,9 +3,15 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "netdata.h"
+#include "err.h"
 #include "callbacks.h"
+#include "vector.h"
+#include "fs.h"
+#include "bucket.h"
+#include "template.h"
 
 #include "parser.h"
 
@@ -64,6 +70,7 @@ parser_process(const char * line, struct parser_statistics * data) {
     }
   } else {
 		data->other++;
+		template_unknown_add(line);
 	}
 }
 
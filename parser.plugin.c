@@ -1,6 +1,5 @@
 /* SPDX-License-Identifier: GPL-3.0-or-later */
 
-#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
@@ -13,12 +12,14 @@
 #include <time.h>
 #include <unistd.h>
 
-#include "callbacks.h"
 #include "err.h"
+#include "callbacks.h"
 #include "flush.h"
 #include "signal.h"
 #include "timer.h"
 #include "vector.h"
+#include "netdata.h"
+#include "template.h"
 
 #include "fs.h"
 #include "parser.h"
@@ -36,10 +37,17 @@ enum poll {
 
 #define LEN(x) ( sizeof x / sizeof * x )
 
+/* Log directories attached and detached at runtime */
+struct log_dirs {
+	int fd;                  /* inotify */
+	struct watch_vector * v;
+	int running;             /* charts of attached watches are printed at once */
+};
+
 static
 void
 usage(const char * name) {
-	fprintf(stderr, "usage: %s <timout> [path]\n", name);
+	fprintf(stderr, "usage: %s [-t templates_file] <interval> [path]\n", name);
 }
 
 static
@@ -55,70 +63,129 @@ prepare_watcher(struct fs_watch * watch, const int fd, const struct stat_func *
 	watch->fd = open(file_name, O_RDONLY);
 	lseek(watch->fd, 0, SEEK_END);
 	watch->func = func;
-	watch->data = func->init();
+	/* Statistics of a removed watch are kept until its charts are
+	 * obsoleted */
+	if (!watch->data)
+		watch->data = func->init();
 	if (watch->data == NULL) {
 		return ND_ALLOC;
 	}
+	watch->state = WATCH_ACTIVE;
 
 	return ND_SUCCESS;
 }
 
 static
 void
-detect_log_dirs(const int fd, struct vector * v) {
-	struct dirent * dir_entry;
-	const char * dir_name;
-	struct fs_watch watch;
-	DIR * dir;
-
-	dir = opendir(".");
-	if (dir == NULL) {
-		perror("opendir");
-		exit(1);
+attach_log_dir(const char * dir_name, void * arg) {
+	struct log_dirs * dirs = arg;
+	struct fs_watch watch, * found;
+	enum watch_state state;
+
+	if (!strstr(dir_name, DIRNAME))
+		return;
+
+	if ((found = find_watch(dirs->v, dir_name, LOGFILE))) {
+		if ((state = found->state) == WATCH_ACTIVE)
+			return;
+
+		fprintf(stderr, "parser log directory attached again: %s\n", dir_name);
+		if (prepare_watcher(found, dirs->fd, parser_func) != ND_SUCCESS) {
+			detach_watch(dirs->fd, found);
+			found->state = state;
+		} else if (state == WATCH_GONE) {
+			found->func->print_hdr(found->dir_name);
+			init_timestamp(&found->time);
+		}
+		return;
 	}
 
-	while ((dir_entry = readdir(dir))) {
-		dir_name = dir_entry->d_name;
-
-		if (dir_name[0] == '.')
-			continue;
+	fprintf(stderr, "parser log directory detected: %s\n", dir_name);
+	memset(&watch, 0, sizeof watch);
+	watch.file_name = LOGFILE;
+	watch.dir_name = strdup(dir_name);
 
-		if (is_directory(dir_name) == 1) {
-			memset(&watch, 0, sizeof watch);
-			if (strstr(dir_name, DIRNAME)) {
-				fprintf(stderr, "parser log directory detected: %s\n", dir_name);
-				watch.file_name = LOGFILE;
-				watch.dir_name = strdup(dir_name);
+	if (prepare_watcher(&watch, dirs->fd, parser_func) != ND_SUCCESS
+	|| watch_vector_add(dirs->v, &watch) != ND_SUCCESS)
+		return;
 
-				if (prepare_watcher(&watch, fd, parser_func) == ND_SUCCESS)
-					vector_add(v, &watch);
-			}
-		}
+	if (dirs->running) {
+		watch.func->print_hdr(watch.dir_name);
+		init_timestamp(&watch_vector_item(dirs->v, dirs->v->len - 1)->time);
 	}
+}
+
+static
+void
+detach_log_dir(const char * dir_name, void * arg) {
+	struct log_dirs * dirs = arg;
+	struct fs_watch * watch;
 
-	closedir(dir);
+	if (!(watch = find_watch(dirs->v, dir_name, LOGFILE)) || watch->state != WATCH_ACTIVE)
+		return;
+
+	fprintf(stderr, "parser log directory removed: %s\n", dir_name);
+	/* Lines written before the removal are counted on the next tick */
+	read_log_file(watch);
+	detach_watch(dirs->fd, watch);
+}
+
+/* Charts of a removed directory are obsoleted after their last update */
+static
+void
+obsolete_watch(struct fs_watch * watch) {
+	nd_chart_obsolete = 1;
+	watch->func->print_hdr(watch->dir_name);
+	nd_chart_obsolete = 0;
+
+	watch->func->fini(watch->data);
+	watch->data = NULL;
+	watch->state = WATCH_GONE;
 }
 
 int
 main(int argc, const char * argv[]) {
 	struct pollfd pfd[POLL_LENGTH];
-	struct vector vector = VECTOR_EMPTY;
+	struct watch_vector vector = VECTOR_EMPTY;
 	unsigned long last_update;
 	struct fs_watch * watch;
+	struct log_dirs dirs;
+	struct fs_discovery discovery;
 	const char * argv0;
 	const char * path;
-	int timeout = 1;
+	long interval = 1000;
 	int fs_event_fd;
 	int signal_fd;
 	int timer_fd;
 	int run;
+	int opt;
 	int i;
 
 	path = DEFAULT_PATH;
-	argv0 = *argv; argv++; argc--;
+	argv0 = *argv;
+
+	while ((opt = getopt(argc, (char * const *)argv, "t:")) != -1) {
+		switch (opt) {
+		case 't':
+			template_dump = optarg;
+			break;
+		default:
+			usage(argv0);
+			exit(1);
+		}
+	}
+	argv += optind; argc -= optind;
+
+	if (template_dump && template_miner_init(&template_unknown) != ND_SUCCESS) {
+		fputs("Cannot allocate template miner\n", stderr);
+		exit(1);
+	}
 
 	if (argc > 0) {
-		timeout = atoi(*argv);
+		if (!(interval = parse_interval(*argv))) {
+			usage(argv0);
+			exit(1);
+		}
 		argv++; argc--;
 	} else
 		usage(argv0);
@@ -142,9 +209,9 @@ main(int argc, const char * argv[]) {
 		exit(1);
 	}
 
-	vector_init(&vector, sizeof * watch);
+	watch_vector_init(&vector, 4);
 
-	timer_fd = prepare_timer_fd(timeout);
+	timer_fd = prepare_timer_fd(interval);
 	pfd[POLL_TIMER].fd = timer_fd;
 	pfd[POLL_TIMER].events = POLLIN;
 
@@ -156,12 +223,22 @@ main(int argc, const char * argv[]) {
 	pfd[POLL_FS_EVENT].fd = fs_event_fd;
 	pfd[POLL_FS_EVENT].events = POLLIN;
 
-	detect_log_dirs(fs_event_fd, &vector);
+	dirs.fd = fs_event_fd;
+	dirs.v = &vector;
+	dirs.running = 0;
+	discovery.attach = &attach_log_dir;
+	discovery.detach = &detach_log_dir;
+	discovery.arg = &dirs;
+
+	if (watch_log_dirs(fs_event_fd, &discovery) != ND_SUCCESS)
+		exit(1);
+	rescan_log_dirs(&vector, &discovery);
+	dirs.running = 1;
 
 	for (i = 0; i < vector.len; i++) {
-		watch = vector_item(&vector, i);
+		watch = watch_vector_item(&vector, i);
 		watch->func->print_hdr(watch->dir_name);
-		clock_gettime(CLOCK_REALTIME, &watch->time);
+		init_timestamp(&watch->time);
 	}
 
 	for (run = 1; run;) {
@@ -179,12 +256,14 @@ main(int argc, const char * argv[]) {
 				continue;
 			}
 			if (pfd[POLL_FS_EVENT].revents & POLLIN) {
-				process_fs_event_queue(fs_event_fd, vector.data, vector.len);
+				process_fs_event_queue(fs_event_fd, &vector, &discovery);
 			}
 			if (pfd[POLL_TIMER].revents & POLLIN) {
-				flush_read_fd(timer_fd);
+				read_timer_fd(timer_fd);
 				for (i = 0; i < vector.len; i++) {
-					watch = vector_item(&vector, i);
+					watch = watch_vector_item(&vector, i);
+					if (watch->state == WATCH_GONE)
+						continue;
 
 					read_log_file(watch);
 
@@ -198,17 +277,25 @@ main(int argc, const char * argv[]) {
 						break;
 					}
 					watch->func->clear(watch->data);
+
+					if (watch->state == WATCH_REMOVED)
+						obsolete_watch(watch);
 				}
+
+				if (template_dump)
+					template_miner_dump(&template_unknown, template_dump);
 			}
 		}
 	}
 
 	for (i = 0; i < vector.len; i++) {
-		watch = vector_item(&vector, i);
+		watch = watch_vector_item(&vector, i);
 		free((void *)watch->dir_name);
 		watch->func->fini(watch->data);
 		close(watch->fd);
 	}
+	watch_vector_free(&vector);
+	template_miner_free(&template_unknown);
 	close(fs_event_fd);
 	close(timer_fd);
 	close(signal_fd);
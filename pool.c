@@ -0,0 +1,168 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "err.h"
+#include "vector.h"
+
+#include "pool.h"
+
+static
+void *
+pool_worker(void * arg) {
+	struct pool * pool = arg;
+	struct pool_task task;
+
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		while (!pool->stop && (!pool->running || pool->next >= pool->tasks.len))
+			pthread_cond_wait(&pool->work, &pool->lock);
+
+		if (pool->stop)
+			break;
+
+		task = *pool_task_vector_item(&pool->tasks, pool->next++);
+		pthread_mutex_unlock(&pool->lock);
+
+		task.func(task.arg);
+
+		pthread_mutex_lock(&pool->lock);
+		if (--pool->pending == 0) {
+			pool->running = 0;
+			pthread_cond_broadcast(&pool->done);
+		}
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+enum nd_err
+pool_init(struct pool * pool, const size_t len) {
+	pthread_condattr_t attr;
+	sigset_t mask, old;
+	size_t i;
+
+	memset(pool, 0, sizeof * pool);
+
+	if (pool_task_vector_init(&pool->tasks, 16) != ND_SUCCESS)
+		return ND_ALLOC;
+
+	if (!(pool->threads = calloc(len, sizeof * pool->threads))) {
+		pool_task_vector_free(&pool->tasks);
+		return ND_ALLOC;
+	}
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&pool->done, &attr);
+	pthread_condattr_destroy(&attr);
+
+	/* Signals are left to the thread which created the pool */
+	sigfillset(&mask);
+	pthread_sigmask(SIG_BLOCK, &mask, &old);
+	for (i = 0; i < len; i++) {
+		if ((errno = pthread_create(pool->threads + i, NULL, &pool_worker, pool))) {
+			perror("pthread_create");
+			break;
+		}
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	pool->len = i;
+
+	if (pool->len == 0) {
+		pool_free(pool);
+		return ND_ERROR;
+	}
+
+	return ND_SUCCESS;
+}
+
+void
+pool_clear(struct pool * pool) {
+	pthread_mutex_lock(&pool->lock);
+	pool->tasks.len = 0;
+	pool->next = 0;
+	pthread_mutex_unlock(&pool->lock);
+}
+
+enum nd_err
+pool_add(struct pool * pool, void (* func)(void *), void * arg) {
+	struct pool_task task = { .func = func, .arg = arg };
+	enum nd_err ret;
+
+	pthread_mutex_lock(&pool->lock);
+	ret = pool_task_vector_add(&pool->tasks, &task);
+	pthread_mutex_unlock(&pool->lock);
+
+	return ret;
+}
+
+void
+pool_start(struct pool * pool) {
+	pthread_mutex_lock(&pool->lock);
+	pool->next = 0;
+	pool->pending = pool->tasks.len;
+	pool->running = pool->pending != 0;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+int
+pool_wait(struct pool * pool, const struct timespec * deadline) {
+	int ret = 0;
+
+	pthread_mutex_lock(&pool->lock);
+	while (pool->pending && ret != ETIMEDOUT) {
+		if (deadline)
+			ret = pthread_cond_timedwait(&pool->done, &pool->lock, deadline);
+		else
+			pthread_cond_wait(&pool->done, &pool->lock);
+	}
+	ret = pool->pending == 0;
+	pthread_mutex_unlock(&pool->lock);
+
+	return ret;
+}
+
+int
+pool_is_busy(struct pool * pool) {
+	int ret;
+
+	pthread_mutex_lock(&pool->lock);
+	ret = pool->pending != 0;
+	pthread_mutex_unlock(&pool->lock);
+
+	return ret;
+}
+
+void
+pool_free(struct pool * pool) {
+	size_t i;
+
+	pool_wait(pool, NULL);
+
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = 1;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (i = 0; i < pool->len; i++)
+		pthread_join(pool->threads[i], NULL);
+
+	pthread_cond_destroy(&pool->done);
+	pthread_cond_destroy(&pool->work);
+	pthread_mutex_destroy(&pool->lock);
+	pool_task_vector_free(&pool->tasks);
+	free(pool->threads);
+	pool->threads = NULL;
+	pool->len = 0;
+}
@@ -0,0 +1,57 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+
+/* A fixed set of worker threads running batches of tasks. Tasks are added
+ * while the pool is idle, pool_start hands them to the workers and
+ * pool_wait waits for the batch until a deadline. A batch which misses the
+ * deadline keeps running, so the caller is never blocked longer than it
+ * asked for; a new batch can be started once it has finished.
+ *
+ * err.h and vector.h have to be included before this header. */
+
+#include <pthread.h>
+
+struct pool_task {
+	void (*func)(void *);
+	void * arg;
+};
+
+VECTOR(pool_task_vector, struct pool_task)
+
+struct pool {
+	pthread_t * threads;
+	size_t len;                    /* number of threads */
+	pthread_mutex_t lock;
+	pthread_cond_t work;           /* signalled when a batch starts */
+	pthread_cond_t done;           /* signalled when a batch finishes */
+	struct pool_task_vector tasks;
+	size_t next;                   /* next task to run */
+	size_t pending;                /* tasks of the batch not finished yet */
+	int running;                   /* a batch has been started and not finished */
+	int stop;
+};
+
+enum nd_err
+pool_init(struct pool *, const size_t);
+
+/* Removes tasks of the previous batch, the pool has to be idle */
+void
+pool_clear(struct pool *);
+
+/* Adds a task to the next batch, the pool has to be idle */
+enum nd_err
+pool_add(struct pool *, void (*)(void *), void *);
+
+void
+pool_start(struct pool *);
+
+/* Waits for the batch until the CLOCK_MONOTONIC deadline (NULL waits
+ * forever), returns 1 if the batch has finished */
+int
+pool_wait(struct pool *, const struct timespec *);
+
+int
+pool_is_busy(struct pool *);
+
+/* Waits for the running batch and stops the threads */
+void
+pool_free(struct pool *);
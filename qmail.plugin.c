@@ -1,10 +1,12 @@
 /* SPDX-License-Identifier: GPL-3.0-or-later */
 
-#include <dirent.h>
+#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
 #include <poll.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -13,17 +15,24 @@
 #include <time.h>
 #include <unistd.h>
 
-#include "callbacks.h"
 #include "err.h"
-#include "flush.h"
+#include "callbacks.h"
 #include "signal.h"
 #include "timer.h"
 #include "vector.h"
+#include "dimension.h"
+#include "netdata.h"
+#include "template.h"
+#include "wheel.h"
 
+#include "archive.h"
+#include "bucket.h"
 #include "fs.h"
+#include "handoff.h"
 #include "queue.h"
 #include "send.h"
 #include "smtp.h"
+#include "stream.h"
 
 #define DEFAULT_PATH "/var/log/qmail"
 
@@ -31,15 +40,252 @@ enum poll {
 	POLL_SIGNAL = 0,
 	POLL_TIMER,
 	POLL_FS_EVENT,
+	POLL_STREAM,
 	POLL_LENGTH
 };
 
 #define LEN(x) ( sizeof x / sizeof * x )
 
+VECTOR(root_vector, const char *)
+VECTOR(fd_vector, int32_t)
+
+/* Collectors with their own update interval */
+enum collector {
+	COLLECTOR_SMTP,   /* smtp logs, ratelimitspp and tcpserver limits */
+	COLLECTOR_SEND,   /* send logs */
+	COLLECTOR_QUEUE,  /* queue roots */
+	COLLECTOR_CENSUS, /* directories of queue roots other than mess and todo */
+	COLLECTORS
+};
+
+static const char * const collector_names[COLLECTORS] = {
+	[COLLECTOR_SMTP]   = "smtp",
+	[COLLECTOR_SEND]   = "send",
+	[COLLECTOR_QUEUE]  = "queue",
+	[COLLECTOR_CENSUS] = "census",
+};
+
+/* Milliseconds, 0 is the interval of the plugin */
+static long collector_interval[COLLECTORS];
+
+/* Milliseconds log lines may come late, 0 counts lines on the tick they are
+ * read */
+static long watermark;
+
 static
 void
 usage(const char * name) {
-	fprintf(stderr, "usage: %s <timout> [path]\n", name);
+	fprintf(stderr, "usage: %s [-m max_dimensions] [-i idle_minutes] [-t templates_file] [-q scan|inotify|estimate] [-s max_stats] [-j threads] [-d deadline_ms] [-r [name=]queue_root]... [-u smtp|send|queue|census=interval]... [-w watermark] [-f name=fifo_or_socket]... <interval> [path]\n", name);
+	fprintf(stderr, "       %s -a smtp|send [-o report|stream] [-j threads] <interval> <archived_log>...\n", name);
+}
+
+/* Charts of archived logs are named by their log directory as the charts of
+ * the plugin are */
+static
+char *
+archive_name(const char * file_name, const char * collector) {
+	const char * beg, * end;
+
+	if (!(end = strrchr(file_name, '/')))
+		return strdup(collector);
+
+	for (beg = end; beg > file_name && beg[-1] != '/'; beg--)
+		;
+
+	return end > beg ? strndup(beg, end - beg) : strdup(collector);
+}
+
+static
+int
+process_archive(const char * collector, const char * const * files, const size_t files_len,
+		const size_t threads, const long interval, const enum archive_format format) {
+	const struct stat_func * func;
+	enum nd_err ret;
+	char * name;
+
+	/* Limits are not counted per tick, archive reports leave them out */
+	smtp_limits = 0;
+
+	if (!strcmp(collector, collector_names[COLLECTOR_SMTP]))
+		func = smtp_func;
+	else if (!strcmp(collector, collector_names[COLLECTOR_SEND]))
+		func = send_func;
+	else
+		return 1;
+
+	if (!(name = archive_name(*files, collector))) {
+		fputs("Cannot allocate chart name\n", stderr);
+		return 1;
+	}
+
+	if ((ret = archive_process(func, name, files, files_len, threads, interval, format)) == ND_ALLOC)
+		fputs("Cannot allocate statistics of archived logs\n", stderr);
+
+	free(name);
+
+	return ret != ND_SUCCESS;
+}
+
+static
+enum nd_err
+set_collector_interval(const char * arg) {
+	const char * value;
+	size_t i;
+
+	if (!(value = strchr(arg, '=')))
+		return ND_CONFIG;
+
+	for (i = 0; i < COLLECTORS; i++) {
+		if (strlen(collector_names[i]) == value - arg && !strncmp(arg, collector_names[i], value - arg)) {
+			collector_interval[i] = parse_interval(value + 1);
+			return collector_interval[i] ? ND_SUCCESS : ND_CONFIG;
+		}
+	}
+
+	return ND_CONFIG;
+}
+
+static
+long
+gcd(long a, long b) {
+	long t;
+
+	while (b) {
+		t = a % b;
+		a = b;
+		b = t;
+	}
+
+	return a;
+}
+
+static
+enum collector
+watch_collector(const struct fs_watch * watch) {
+	if (watch->type == WATCH_QUEUE)
+		return COLLECTOR_QUEUE;
+
+	return watch->func == send_func ? COLLECTOR_SEND : COLLECTOR_SMTP;
+}
+
+/* The limits charts are the first entry of the wheel, every watch follows
+ * with its index. The wheel ticks at the greatest common divisor of all
+ * intervals, including those of log directories attached later. */
+static
+long
+prepare_wheel(struct wheel * wheel, struct watch_vector * v) {
+	struct fs_watch * watch;
+	long tick;
+	size_t i;
+
+	tick = gcd(collector_interval[COLLECTOR_SMTP], collector_interval[COLLECTOR_SEND]);
+	for (i = 0; i < v->len; i++) {
+		watch = watch_vector_item(v, i);
+		watch->interval = collector_interval[watch_collector(watch)];
+		tick = gcd(tick, watch->interval);
+	}
+
+	if (wheel_init(wheel, interval_ticks(tick)) != ND_SUCCESS)
+		return 0;
+
+	if (wheel_add(wheel, collector_interval[COLLECTOR_SMTP] / tick) != ND_SUCCESS)
+		return 0;
+	for (i = 0; i < v->len; i++)
+		if (wheel_add(wheel, watch_vector_item(v, i)->interval / tick) != ND_SUCCESS)
+			return 0;
+
+	return tick;
+}
+
+/* Marks watches fired by the wheel as due, returns whether the limits charts
+ * are due */
+static
+int
+mark_due(const struct wheel * wheel, struct watch_vector * v) {
+	size_t id;
+	size_t i;
+	int limits = 0;
+
+	for (i = 0; i < wheel->fired.len; i++) {
+		id = *wheel_id_vector_item(&wheel->fired, i);
+		if (id)
+			watch_vector_item(v, id - 1)->due = 1;
+		else
+			limits = 1;
+	}
+
+	return limits;
+}
+
+/* Lines of the log are counted by their log time, a tick is printed once
+ * the watermark has passed it */
+static
+enum nd_err
+prepare_buckets(struct fs_watch * watch) {
+	struct event_buckets * buckets;
+	unsigned long lag;
+
+	if (watch->type == WATCH_QUEUE || !watch->func->merge)
+		return ND_SUCCESS;
+
+	if (!(buckets = malloc(sizeof * buckets)))
+		return ND_ALLOC;
+
+	lag = (watermark + watch->interval - 1) / watch->interval;
+	if (buckets_init(buckets, watch->func, watch->interval, lag) != ND_SUCCESS) {
+		free(buckets);
+		return ND_ALLOC;
+	}
+
+	watch->func->fini(watch->data);
+	watch->data = NULL;
+	watch->buckets = buckets;
+
+	return ND_SUCCESS;
+}
+
+static
+int
+print_late_hdr(const char * name) {
+	char title[BUFSIZ];
+
+	sprintf(title, "Qmail log lines later than the watermark for %s", name);
+	nd_chart("qmail", name, "late", NULL, title, "# lines", NULL, "qmail.log_late", ND_CHART_TYPE_LINE);
+	nd_dimension("late", NULL, ND_ALG_ABSOLUTE, 1, 1, ND_VISIBLE);
+
+	return fflush(stdout);
+}
+
+static
+int
+print_late(const char * name, const struct event_buckets * buckets, const unsigned long time) {
+	nd_begin_time("qmail", name, "late", time);
+	nd_set("late", buckets->late);
+	nd_end();
+
+	return fflush(stdout);
+}
+
+static
+int
+print_dropped_hdr(const char * name) {
+	char title[BUFSIZ];
+
+	sprintf(title, "Qmail log bytes dropped from the full stream for %s", name);
+	nd_chart("qmail", name, "dropped", NULL, title, "bytes", NULL, "qmail.stream_dropped", ND_CHART_TYPE_LINE);
+	nd_dimension("dropped", NULL, ND_ALG_ABSOLUTE, 1, 1, ND_VISIBLE);
+
+	return fflush(stdout);
+}
+
+static
+int
+print_dropped(const char * name, const struct fs_stream * stream, const unsigned long time) {
+	nd_begin_time("qmail", name, "dropped", time);
+	nd_set("dropped", stream->dropped);
+	nd_end();
+
+	return fflush(stdout);
 }
 
 static
@@ -58,146 +304,793 @@ prepare_watcher(struct fs_watch * watch, const int fd, const struct stat_func *
 	watch->fd = open(file_name, O_RDONLY);
 	lseek(watch->fd, 0, SEEK_END);
 	watch->func = func;
-	watch->data = func->init();
-	if (watch->data == NULL) {
+	/* Statistics of a removed watch are kept until its charts are
+	 * obsoleted */
+	if (!watch->data && !watch->buckets)
+		watch->data = func->init();
+	if (watch->data == NULL && watch->buckets == NULL) {
 		return ND_ALLOC;
 	}
+	if (func->carry && !watch->last && !(watch->last = func->init()))
+		return ND_ALLOC;
+	watch->state = WATCH_ACTIVE;
 
 	return ND_SUCCESS;
 }
 
+/* A queue root is given as [name=]path. Without a name, the chart prefix is
+ * the base name of the path, or of its parent for paths ending with queue. */
+static
+char *
+queue_root_name(const char * root, const char ** path) {
+	const char * beg, * end;
+	char * name, * c;
+
+	if ((end = strchr(root, '='))) {
+		*path = end + 1;
+		name = strndup(root, end - root);
+	} else {
+		*path = root;
+		for (end = root + strlen(root); end > root + 1 && end[-1] == '/'; end--)
+			;
+		for (beg = end; beg > root && beg[-1] != '/'; beg--)
+			;
+		if (end - beg == 5 && !strncmp(beg, "queue", 5) && beg > root + 1) {
+			for (end = beg - 1; end > root + 1 && end[-1] == '/'; end--)
+				;
+			for (beg = end; beg > root && beg[-1] != '/'; beg--)
+				;
+		}
+		name = strndup(beg, end - beg);
+	}
+
+	for (c = name; c && *c; c++)
+		if (!isalnum((unsigned char)*c))
+			*c = '_';
+
+	return name;
+}
+
 static
 enum nd_err
-append_queue_watcher(struct vector * v) {
+append_queue_watcher(struct watch_vector * v, const char * root, const int named) {
 	struct fs_watch watch;
+	const char * path;
+	char * name;
+
+	if (!(name = queue_root_name(root, &path)))
+		return ND_ALLOC;
 
 	memset(&watch, 0, sizeof watch);
 	watch.type = WATCH_QUEUE;
 	watch.watch_dir = -1;
 	watch.fd = -1;
 	watch.func = queue_func;
-	watch.data = watch.func->init();
+	watch.data = queue_data_init(path);
 
 	if (watch.data == NULL) {
+		free(name);
 		return ND_ALLOC;
 	}
 
-	vector_add(v, &watch);
+	/* A single queue keeps the plain chart ids */
+	if (named) {
+		watch.dir_name = name;
+	} else {
+		free(name);
+	}
+
+	watch_vector_add(v, &watch);
 
 	return ND_SUCCESS;
 }
 
+/* Logs are told apart by the name of their directory, NULL if they are
+ * not qmail logs */
 static
-void
-detect_log_dirs(const int fd, struct vector * v) {
-	struct dirent * dir_entry;
-	const char * dir_name;
+const struct stat_func *
+log_func(const char * name, const char ** kind) {
+	if (strstr(name, "send")) {
+		*kind = "send";
+		return send_func;
+	} else if (strstr(name, "smtp")) {
+		*kind = "smtp";
+		return smtp_func;
+	}
+
+	return NULL;
+}
+
+/* A stream is given as name=path, the name tells the kind of its log as the
+ * name of a log directory does and names its charts */
+static
+enum nd_err
+append_stream_watcher(struct watch_vector * v, const int fd, const char * arg) {
+	const struct stat_func * func;
 	struct fs_watch watch;
-	DIR * dir;
+	const char * path;
+	const char * kind;
+	enum nd_err ret;
 
-	dir = opendir(".");
-	if (dir == NULL) {
-		perror("opendir");
-		exit(1);
+	if (!(path = strchr(arg, '=')) || path == arg)
+		return ND_CONFIG;
+
+	memset(&watch, 0, sizeof watch);
+	if (!(watch.dir_name = strndup(arg, path - arg)))
+		return ND_ALLOC;
+	path++;
+
+	if (!(func = log_func(watch.dir_name, &kind))) {
+		fprintf(stderr, "Stream name '%s' contains neither send nor smtp\n", watch.dir_name);
+		free((void *)watch.dir_name);
+		return ND_CONFIG;
+	}
+
+	watch.file_name = path;
+	watch.func = func;
+	if ((ret = stream_open(fd, &watch, v->len, path)) != ND_SUCCESS) {
+		free((void *)watch.dir_name);
+		return ret;
+	}
+
+	if (!(watch.data = func->init()) || (func->carry && !(watch.last = func->init()))
+	|| watch_vector_add(v, &watch) != ND_SUCCESS) {
+		func->fini(watch.data);
+		if (watch.last)
+			func->fini(watch.last);
+		stream_close(&watch);
+		free((void *)watch.dir_name);
+		return ND_ALLOC;
+	}
+	fprintf(stderr, "%s log stream: %s\n", kind, path);
+
+	return ND_SUCCESS;
+}
+
+/* Log directories attached and detached at runtime */
+struct log_dirs {
+	int fd;                  /* inotify */
+	struct watch_vector * v;
+	struct wheel * wheel;
+	long tick;               /* milliseconds of a tick of the wheel */
+	int running;             /* attached watches are scheduled and charted at once */
+};
+
+/* Prints the charts of a log watch, with a watermark its lines are counted
+ * by log time */
+static
+enum nd_err
+start_watch(struct fs_watch * watch) {
+	if (watermark && !watch->buckets && prepare_buckets(watch) != ND_SUCCESS) {
+		fputs("Cannot allocate event buckets\n", stderr);
+		return ND_ALLOC;
+	}
+
+	nd_update_every = interval_update_every(watch->interval);
+	watch->func->print_hdr(watch->dir_name);
+	if (watch->buckets)
+		print_late_hdr(watch->dir_name);
+	if (watch->stream)
+		print_dropped_hdr(watch->dir_name);
+	/* A watch handed over by the previous binary keeps its last update */
+	if (!watch->time.tv_sec && !watch->time.tv_nsec)
+		init_timestamp(&watch->time);
+
+	return ND_SUCCESS;
+}
+
+static
+void
+attach_log_dir(const char * dir_name, void * arg) {
+	struct log_dirs * dirs = arg;
+	const struct stat_func * func;
+	struct fs_watch watch, * found;
+	enum watch_state state;
+	const char * kind;
+
+	if (!(func = log_func(dir_name, &kind)))
+		return;
+
+	/* A directory which comes back keeps its place in the wheel */
+	if ((found = find_watch(dirs->v, dir_name, "current"))) {
+		if ((state = found->state) == WATCH_ACTIVE)
+			return;
+
+		fprintf(stderr, "%s log directory attached again: %s\n", kind, dir_name);
+		if (prepare_watcher(found, dirs->fd, func) != ND_SUCCESS) {
+			detach_watch(dirs->fd, found);
+			found->state = state;
+		} else if (state == WATCH_GONE)
+			start_watch(found);
+		return;
+	}
+
+	fprintf(stderr, "%s log directory detected: %s\n", kind, dir_name);
+	memset(&watch, 0, sizeof watch);
+	watch.dir_name = strdup(dir_name);
+
+	if (prepare_watcher(&watch, dirs->fd, func) != ND_SUCCESS
+	|| watch_vector_add(dirs->v, &watch) != ND_SUCCESS) {
+		free((void *)watch.dir_name);
+		return;
+	}
+
+	if (!dirs->running)
+		return;
+
+	found = watch_vector_item(dirs->v, dirs->v->len - 1);
+	found->interval = collector_interval[watch_collector(found)];
+	if (wheel_add(dirs->wheel, found->interval / dirs->tick) != ND_SUCCESS) {
+		fputs("Cannot schedule log directory\n", stderr);
+		found->func->fini(found->data);
+		if (found->last)
+			found->func->fini(found->last);
+		close(found->fd);
+		inotify_rm_watch(dirs->fd, found->watch_dir);
+		free((void *)found->dir_name);
+		watch_vector_remove(dirs->v, dirs->v->len - 1);
+		return;
 	}
 
-	while ((dir_entry = readdir(dir))) {
-		dir_name = dir_entry->d_name;
+	start_watch(found);
+}
+
+static
+void
+detach_log_dir(const char * dir_name, void * arg) {
+	struct log_dirs * dirs = arg;
+	struct fs_watch * watch;
+
+	if (!(watch = find_watch(dirs->v, dir_name, "current")) || watch->state != WATCH_ACTIVE)
+		return;
+
+	fprintf(stderr, "log directory removed: %s\n", dir_name);
+	/* Lines written before the removal are counted when the watch is
+	 * due */
+	read_log_file(watch);
+	detach_watch(dirs->fd, watch);
+}
+
+/* Charts of a removed directory are obsoleted after their last update */
+static
+void
+obsolete_watch(struct fs_watch * watch) {
+	nd_chart_obsolete = 1;
+	nd_update_every = interval_update_every(watch->interval);
+	watch->func->print_hdr(watch->dir_name);
+	if (watch->buckets)
+		print_late_hdr(watch->dir_name);
+	nd_chart_obsolete = 0;
+
+	if (watch->buckets) {
+		buckets_free(watch->buckets);
+		free(watch->buckets);
+		watch->buckets = NULL;
+	} else
+		watch->func->fini(watch->data);
+	watch->data = NULL;
+	/* A directory attached again starts its gauges anew */
+	if (watch->last)
+		watch->func->fini(watch->last);
+	watch->last = NULL;
+	watch->state = WATCH_GONE;
+}
 
-		if (dir_name[0] == '.')
+static
+void
+free_watch(struct fs_watch * watch) {
+	free((void *)watch->dir_name);
+	if (watch->buckets) {
+		buckets_free(watch->buckets);
+		free(watch->buckets);
+	} else if (watch->data)
+		watch->func->fini(watch->data);
+	if (watch->last)
+		watch->func->fini(watch->last);
+	if (watch->stream)
+		stream_close(watch);
+	else if (watch->fd != -1)
+		close(watch->fd);
+}
+
+/* Drops a watch taken over from the previous binary, its descriptors are
+ * among the inherited ones */
+static
+void
+forget_watch(struct fs_watch * watch) {
+	watch->fd = -1;
+	if (watch->stream)
+		watch->stream->listen_fd = -1;
+	free_watch(watch);
+}
+
+/* Removed watches are obsoleted by the new binary, the charts of gone ones
+ * are not known to it */
+static inline
+int
+handed_over(const struct fs_watch * watch) {
+	return (watch->type == WATCH_LOG_FILE && watch->state != WATCH_GONE) || watch->type == WATCH_STREAM;
+}
+
+/* All descriptors the new binary inherits are written before the watches,
+ * so it can close them if it cannot take the watches over */
+static
+enum nd_err
+write_inherited_fds(FILE * state, const struct watch_vector * v, const int fs_event_fd) {
+	struct fd_vector fds = VECTOR_EMPTY;
+	const struct fs_watch * watch;
+	int32_t fd = fs_event_fd;
+	enum nd_err ret;
+	uint64_t len;
+	size_t i;
+
+	if ((ret = fd_vector_init(&fds, v->len + 1)) != ND_SUCCESS
+	|| (ret = fd_vector_add(&fds, &fd)) != ND_SUCCESS)
+		goto end;
+
+	for (i = 0; i < v->len; i++) {
+		watch = watch_vector_item(v, i);
+		if (!handed_over(watch))
 			continue;
+		if ((fd = watch->fd) != -1 && (ret = fd_vector_add(&fds, &fd)) != ND_SUCCESS)
+			goto end;
+		if (watch->stream && (fd = watch->stream->listen_fd) != -1
+		&& (ret = fd_vector_add(&fds, &fd)) != ND_SUCCESS)
+			goto end;
+	}
 
-		if (is_directory(dir_name) == 1) {
-			memset(&watch, 0, sizeof watch);
-			if (strstr(dir_name, "send")) {
-				fprintf(stderr, "send log directory detected: %s\n", dir_name);
-				watch.dir_name = strdup(dir_name);
+	len = fds.len;
+	if ((ret = handoff_write(state, &len, sizeof len)) == ND_SUCCESS)
+		ret = handoff_write(state, fds.data, len * sizeof * fds.data);
+end:
+	fd_vector_free(&fds);
 
-				if (prepare_watcher(&watch, fd, send_func) == ND_SUCCESS)
-					vector_add(v, &watch);
+	return ret;
+}
 
-			} else if (strstr(dir_name, "smtp")) {
-				fprintf(stderr, "smtp log directory detected: %s\n", dir_name);
-				watch.dir_name = strdup(dir_name);
+/* Reads the inherited descriptors into the vector */
+static
+enum nd_err
+read_inherited_fds(FILE * state, struct fd_vector * fds) {
+	enum nd_err ret;
+	uint64_t len;
 
-				if (prepare_watcher(&watch, fd, smtp_func) == ND_SUCCESS)
-					vector_add(v, &watch);
+	if ((ret = handoff_read(state, &len, sizeof len)) != ND_SUCCESS)
+		return ret;
+	if (!len || len > INT32_MAX / sizeof * fds->data)
+		return ND_ERROR;
 
-			}
+	if ((ret = fd_vector_init(fds, len)) != ND_SUCCESS)
+		return ret;
+	if ((ret = handoff_read(state, fds->data, len * sizeof * fds->data)) != ND_SUCCESS)
+		return ret;
+	fds->len = len;
+
+	return ND_SUCCESS;
+}
+
+/* Streams are opened close-on-exec, their descriptors are kept open only
+ * for the new binary */
+static
+enum nd_err
+keep_stream_fds(const struct watch_vector * v, const int keep) {
+	const struct fs_watch * watch;
+	size_t i;
+
+	for (i = 0; i < v->len; i++) {
+		watch = watch_vector_item(v, i);
+		if (watch->type != WATCH_STREAM)
+			continue;
+
+		if (!keep) {
+			if (watch->fd != -1)
+				fcntl(watch->fd, F_SETFD, FD_CLOEXEC);
+			if (watch->stream->listen_fd != -1)
+				fcntl(watch->stream->listen_fd, F_SETFD, FD_CLOEXEC);
+		} else if (handoff_keep_fd(watch->fd) != ND_SUCCESS
+		|| handoff_keep_fd(watch->stream->listen_fd) != ND_SUCCESS)
+			return ND_FILE;
+	}
+
+	return ND_SUCCESS;
+}
+
+/* Executes the binary again with the log watches and streams, the inotify
+ * descriptor and the aggregated smtp statistics. Queue roots are scanned
+ * again by the new binary. Returns only if the binary cannot be
+ * executed. */
+static
+enum nd_err
+hand_over(char * const argv[], const struct watch_vector * v, const int fs_event_fd,
+		const struct fs_discovery * discovery, const struct timespec * limits_time) {
+	const struct fs_watch * watch;
+	int32_t fds[2] = { fs_event_fd, discovery->watch_dir };
+	uint64_t len = 0;
+	enum nd_err ret;
+	FILE * state;
+	size_t i;
+
+	if (!(state = handoff_create("qmail.plugin")))
+		return ND_FILE;
+
+	for (i = 0; i < v->len; i++)
+		if (handed_over(watch_vector_item(v, i)))
+			len++;
+
+	if ((ret = handoff_write(state, fds, sizeof fds)) != ND_SUCCESS
+	|| (ret = write_inherited_fds(state, v, fs_event_fd)) != ND_SUCCESS
+	|| (ret = handoff_write_block(state, limits_time, sizeof * limits_time)) != ND_SUCCESS
+	|| (ret = smtp_handoff_write(state)) != ND_SUCCESS
+	|| (ret = handoff_write(state, &len, sizeof len)) != ND_SUCCESS
+	|| (ret = handoff_keep_fd(fs_event_fd)) != ND_SUCCESS
+	|| (ret = keep_stream_fds(v, 1)) != ND_SUCCESS)
+		goto end;
+
+	/* A stream is written with its path, which the new binary looks up in
+	 * its options */
+	for (i = 0; i < v->len; i++) {
+		watch = watch_vector_item(v, i);
+		if (!handed_over(watch))
+			continue;
+		if ((ret = handoff_write_str(state, collector_names[watch_collector(watch)])) != ND_SUCCESS
+		|| (ret = handoff_write_str(state, watch->stream ? watch->stream->path : NULL)) != ND_SUCCESS
+		|| (ret = handoff_write_watch(state, watch)) != ND_SUCCESS
+		|| (watch->stream && (ret = stream_handoff_write(state, watch)) != ND_SUCCESS))
+			goto end;
+	}
+
+	ret = handoff_exec(state, argv);
+end:
+	if (ret != ND_SUCCESS)
+		fputs("Cannot hand over to the new binary\n", stderr);
+	fcntl(fs_event_fd, F_SETFD, FD_CLOEXEC);
+	keep_stream_fds(v, 0);
+	fclose(state);
+
+	return ret;
+}
+
+/* The option of a stream given as name=path, -1 if there is none. The name
+ * is not compared if NULL. */
+static
+ssize_t
+find_stream_arg(const struct root_vector * streams, const char * name, const char * path) {
+	const char * arg;
+	const char * sep;
+	size_t i;
+
+	for (i = 0; i < streams->len; i++) {
+		arg = *root_vector_item(streams, i);
+		if (!(sep = strchr(arg, '=')) || strcmp(sep + 1, path))
+			continue;
+		if (!name || (strlen(name) == sep - arg && !strncmp(arg, name, sep - arg)))
+			return i;
+	}
+
+	return -1;
+}
+
+/* Takes over the log watches and streams of the previous binary, returns
+ * the inotify descriptor or -1 if the plugin starts anew. A stream is taken
+ * over only if it is still given by the options. */
+static
+int
+resume(struct watch_vector * v, struct fs_discovery * discovery, struct timespec * limits_time,
+		const struct root_vector * streams) {
+	struct fd_vector inherited = VECTOR_EMPTY;
+	const struct stat_func * func;
+	int32_t fds[2] = { -1, -1 };
+	const char * file_name;
+	struct fs_watch watch;
+	uint64_t len, i;
+	ssize_t idx;
+	FILE * state;
+	char * name;
+	char * path;
+
+	if (!(state = handoff_resume("qmail.plugin")))
+		return -1;
+
+	if (handoff_read(state, fds, sizeof fds) != ND_SUCCESS
+	|| read_inherited_fds(state, &inherited) != ND_SUCCESS
+	|| handoff_read_block(state, limits_time, sizeof * limits_time) != ND_SUCCESS
+	|| smtp_handoff_read(state) != ND_SUCCESS
+	|| handoff_read(state, &len, sizeof len) != ND_SUCCESS)
+		goto fail;
+
+	for (i = 0; i < len; i++) {
+		if (handoff_read_str(state, &name) != ND_SUCCESS || !name)
+			goto fail;
+		func = strcmp(name, collector_names[COLLECTOR_SEND]) ? smtp_func : send_func;
+		free(name);
+
+		/* The watch refers to the path in the options */
+		if (handoff_read_str(state, &path) != ND_SUCCESS)
+			goto fail;
+		idx = path ? find_stream_arg(streams, NULL, path) : -1;
+		free(path);
+		if (path && idx == -1)
+			goto fail;
+		file_name = idx == -1 ? "current" : strchr(*root_vector_item(streams, idx), '=') + 1;
+
+		if (handoff_read_watch(state, &watch, func, file_name) != ND_SUCCESS
+		|| (idx != -1 && (!watch.dir_name || find_stream_arg(streams, watch.dir_name, file_name) == -1
+			|| stream_handoff_read(state, &watch, file_name) != ND_SUCCESS))
+		|| watch_vector_add(v, &watch) != ND_SUCCESS) {
+			forget_watch(&watch);
+			goto fail;
 		}
 	}
 
-	closedir(dir);
+	fd_vector_free(&inherited);
+	fclose(state);
+	fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+	discovery->watch_dir = fds[1];
+	fprintf(stderr, "%zu log directories and streams handed over\n", v->len);
+
+	return fds[0];
+fail:
+	fputs("Cannot take over the state of the previous binary, starting anew\n", stderr);
+	for (i = 0; i < v->len; i++)
+		forget_watch(watch_vector_item(v, i));
+	v->len = 0;
+	/* Also descriptors of watches not read yet are closed */
+	if (inherited.len) {
+		for (i = 0; i < inherited.len; i++)
+			close(*fd_vector_item(&inherited, i));
+	} else if (fds[0] != -1)
+		close(fds[0]);
+	fd_vector_free(&inherited);
+	fclose(state);
+
+	return -1;
 }
 
 int
 main(int argc, const char * argv[]) {
 	struct pollfd pfd[POLL_LENGTH];
-	struct vector vector = VECTOR_EMPTY;
+	struct watch_vector vector = VECTOR_EMPTY;
+	struct root_vector roots = VECTOR_EMPTY;
+	struct root_vector streams = VECTOR_EMPTY;
 	struct timespec ratelimitspp_time;
 	unsigned long last_update;
 	struct fs_watch * watch;
+	struct wheel wheel;
+	struct log_dirs dirs;
+	struct fs_discovery discovery;
+	enum archive_format archive_format = ARCHIVE_REPORT;
+	const char * archive = NULL;
+	long threads = 0;
+	int stat_max = -1;
+	long interval = 1000;
+	long tick;
+	long ticks;
+	int limits;
 	const char * argv0;
 	const char * path;
-	int timeout = 1;
+	char ** exec_argv;
+	char * exec_path = NULL;
 	int fs_event_fd;
+	int stream_fd = -1;
+	ssize_t idx;
+	int resumed;
 	int signal_fd;
 	int timer_fd;
 	int run;
+	int opt;
 	int i;
 
 	path = DEFAULT_PATH;
-	argv0 = *argv; argv++; argc--;
+	argv0 = *argv;
+	exec_argv = (char **)argv;
+
+	while ((opt = getopt(argc, (char * const *)argv, "m:i:t:q:s:j:d:r:u:w:a:o:f:")) != -1) {
+		switch (opt) {
+		case 'm':
+			dim_max = strtoul(optarg, NULL, 10);
+			break;
+		case 'i':
+			dim_idle = strtoul(optarg, NULL, 10) * 60;
+			break;
+		case 't':
+			template_dump = optarg;
+			break;
+		case 'q':
+			if (queue_set_mode(optarg) != ND_SUCCESS) {
+				usage(argv0);
+				exit(1);
+			}
+			break;
+		case 's':
+			stat_max = strtoul(optarg, NULL, 10);
+			break;
+		case 'j':
+			queue_threads = threads = strtoul(optarg, NULL, 10);
+			break;
+		case 'd':
+			queue_deadline = strtoul(optarg, NULL, 10);
+			break;
+		case 'r':
+			if (root_vector_add(&roots, (const char **)&optarg) != ND_SUCCESS) {
+				fputs("Cannot allocate queue roots\n", stderr);
+				exit(1);
+			}
+			break;
+		case 'f':
+			if (root_vector_add(&streams, (const char **)&optarg) != ND_SUCCESS) {
+				fputs("Cannot allocate streams\n", stderr);
+				exit(1);
+			}
+			break;
+		case 'u':
+			if (set_collector_interval(optarg) != ND_SUCCESS) {
+				usage(argv0);
+				exit(1);
+			}
+			break;
+		case 'w':
+			if (!(watermark = parse_interval(optarg))) {
+				usage(argv0);
+				exit(1);
+			}
+			break;
+		case 'a':
+			archive = optarg;
+			break;
+		case 'o':
+			if (archive_set_format(&archive_format, optarg) != ND_SUCCESS) {
+				usage(argv0);
+				exit(1);
+			}
+			break;
+		default:
+			usage(argv0);
+			exit(1);
+		}
+	}
+	argv += optind; argc -= optind;
+
+	/* Templates are mined by the live collectors only */
+	if (template_dump && archive) {
+		usage(argv0);
+		exit(1);
+	}
+
+	/* Counts maintained from inotify events are cheap, sampling ages would
+	 * still list mess on every tick, so they are charted only if asked
+	 * for */
+	if (stat_max >= 0)
+		queue_stat_max = stat_max;
+	else if (queue_mode == QUEUE_MODE_INOTIFY)
+		queue_stat_max = 0;
+
+	if (template_dump && template_miner_init(&template_unknown) != ND_SUCCESS) {
+		fputs("Cannot allocate template miner\n", stderr);
+		exit(1);
+	}
 
 	if (argc > 0) {
-		timeout = atoi(*argv);
+		if (!(interval = parse_interval(*argv))) {
+			usage(argv0);
+			exit(1);
+		}
 		argv++; argc--;
 	} else
 		usage(argv0);
 
+	if (archive) {
+		if (argc < 1) {
+			usage(argv0);
+			exit(1);
+		}
+		if (threads < 1)
+			threads = sysconf(_SC_NPROCESSORS_ONLN);
+		if (threads < 1)
+			threads = 1;
+		return process_archive(archive, argv, argc, threads, interval, archive_format);
+	}
+
 	if (argc > 0) {
 		path = *argv;
 		argv++; argc--;
 	}
 
+	/* The binary is executed again on SIGHUP from the log directory */
+	if (strchr(argv0, '/') && (exec_path = realpath(argv0, NULL)))
+		exec_argv[0] = exec_path;
+
 	if (chdir(path) == -1) {
 		fprintf(stderr, "Cannot change directory to '%s': %s\n", path, strerror(errno));
 		exit(1);
 	}
 
-	vector_init(&vector, sizeof * watch);
+	for (i = 0; i < COLLECTORS; i++)
+		if (!collector_interval[i])
+			collector_interval[i] = interval;
+	if (collector_interval[COLLECTOR_CENSUS] > collector_interval[COLLECTOR_QUEUE])
+		queue_census_interval = collector_interval[COLLECTOR_CENSUS];
 
-	timer_fd = prepare_timer_fd(timeout);
-	pfd[POLL_TIMER].fd = timer_fd;
-	pfd[POLL_TIMER].events = POLLIN;
+	watch_vector_init(&vector, 4);
 
 	signal_fd = prepare_signal_fd();
 	pfd[POLL_SIGNAL].fd = signal_fd;
 	pfd[POLL_SIGNAL].events = POLLIN;
 
-	fs_event_fd = prepare_fs_event_fd();
+	resumed = (fs_event_fd = resume(&vector, &discovery, &ratelimitspp_time, &streams)) != -1;
+	if (!resumed)
+		fs_event_fd = prepare_fs_event_fd();
 	pfd[POLL_FS_EVENT].fd = fs_event_fd;
 	pfd[POLL_FS_EVENT].events = POLLIN;
 
-	detect_log_dirs(fs_event_fd, &vector);
-	append_queue_watcher(&vector);
+	dirs.fd = fs_event_fd;
+	dirs.v = &vector;
+	dirs.wheel = &wheel;
+	dirs.running = 0;
+	discovery.attach = &attach_log_dir;
+	discovery.detach = &detach_log_dir;
+	discovery.arg = &dirs;
+
+	if (!resumed && watch_log_dirs(fs_event_fd, &discovery) != ND_SUCCESS)
+		exit(1);
+	/* Directories changed while the binary was executed again are
+	 * attached or detached */
+	rescan_log_dirs(&vector, &discovery);
+	if (root_vector_is_empty(&roots))
+		append_queue_watcher(&vector, QUEUE_DEFAULT_ROOT, 0);
+	for (i = 0; i < roots.len; i++)
+		append_queue_watcher(&vector, *root_vector_item(&roots, i), roots.len > 1);
+	root_vector_free(&roots);
 
-	if (vector_is_empty(&vector)) {
+	if (!root_vector_is_empty(&streams))
+		stream_fd = prepare_stream_fd();
+	pfd[POLL_STREAM].fd = stream_fd;
+	pfd[POLL_STREAM].events = POLLIN;
+	/* Streams taken over from the previous binary are polled again, the
+	 * others are opened */
+	for (i = 0; i < vector.len; i++) {
+		watch = watch_vector_item(&vector, i);
+		if (watch->type != WATCH_STREAM)
+			continue;
+		if (stream_resume(stream_fd, watch, i) != ND_SUCCESS)
+			exit(1);
+		if ((idx = find_stream_arg(&streams, watch->dir_name, watch->stream->path)) != -1)
+			root_vector_remove(&streams, idx);
+	}
+	for (i = 0; i < streams.len; i++) {
+		if (append_stream_watcher(&vector, stream_fd, *root_vector_item(&streams, i)) != ND_SUCCESS) {
+			usage(argv0);
+			exit(1);
+		}
+	}
+	root_vector_free(&streams);
+
+	if (watch_vector_is_empty(&vector)) {
 		fprintf(stderr, "Nothing to log for qmail\n");
 		exit(1);
 	}
 
-	for (i = 0; i < vector.len; i++) {
-		watch = vector_item(&vector, i);
-		watch->func->print_hdr(watch->dir_name);
-		clock_gettime(CLOCK_REALTIME, &watch->time);
+	if (!(tick = prepare_wheel(&wheel, &vector))) {
+		fputs("Cannot allocate scheduler\n", stderr);
+		exit(1);
 	}
 
-	ratelimitspp_clear();
-	ratelimitspp_print_hdr();
-	clock_gettime(CLOCK_REALTIME, &ratelimitspp_time);
+	timer_fd = prepare_timer_fd(tick);
+	pfd[POLL_TIMER].fd = timer_fd;
+	pfd[POLL_TIMER].events = POLLIN;
 
-	tcpserverlimits_clear();
+	for (i = 0; i < vector.len; i++)
+		if (start_watch(watch_vector_item(&vector, i)) != ND_SUCCESS)
+			exit(1);
+	dirs.tick = tick;
+	dirs.running = 1;
+
+	nd_update_every = interval_update_every(collector_interval[COLLECTOR_SMTP]);
+	ratelimitspp_print_hdr();
+	if (!resumed) {
+		ratelimitspp_clear();
+		init_timestamp(&ratelimitspp_time);
+		tcpserverlimits_clear();
+	}
 
 	for (run = 1; run;) {
 		switch (poll(pfd, LEN(pfd), -1)) {
@@ -209,62 +1102,101 @@ main(int argc, const char * argv[]) {
 			continue;
 		default:
 			if (pfd[POLL_SIGNAL].revents & POLLIN) {
-				flush_read_fd(signal_fd);
+				if (read_signal_fd(signal_fd) == SIGHUP) {
+					fputs("Executing the plugin binary again\n", stderr);
+					hand_over(exec_argv, &vector, fs_event_fd, &discovery, &ratelimitspp_time);
+					continue;
+				}
 				run = 0;
 				continue;
 			}
 			if (pfd[POLL_FS_EVENT].revents & POLLIN) {
-				process_fs_event_queue(fs_event_fd, vector.data, vector.len);
+				process_fs_event_queue(fs_event_fd, &vector, &discovery);
+			}
+			if (pfd[POLL_STREAM].revents & POLLIN) {
+				process_stream_events(stream_fd, &vector);
 			}
 			if (pfd[POLL_TIMER].revents & POLLIN) {
-				flush_read_fd(timer_fd);
+				if ((ticks = read_timer_fd(timer_fd)) <= 0)
+					continue;
+				wheel_advance(&wheel, ticks);
+				limits = mark_due(&wheel, &vector);
+
+				queue_process(vector.data, vector.len);
 				for (i = 0; i < vector.len; i++) {
-					watch = vector_item(&vector, i);
+					watch = watch_vector_item(&vector, i);
+					if (!watch->due)
+						continue;
+					watch->due = 0;
+					if (watch->state == WATCH_GONE)
+						continue;
 
 					if (watch->type == WATCH_LOG_FILE)
 						read_log_file(watch);
-					else if (watch->type == WATCH_QUEUE)
-						watch->func->process(NULL, watch->data);
+					else if (watch->type == WATCH_STREAM)
+						stream_read(watch);
+					if (watch->buckets)
+						watch->data = buckets_close(watch->buckets);
+					if (watch->last)
+						watch->func->carry(watch->data, watch->last);
 
 					if (watch->func->postprocess)
 						watch->func->postprocess(watch->data);
 
+					nd_update_every = interval_update_every(watch->interval);
 					last_update = update_timestamp(&watch->time);
-					if (watch->func->print(watch->dir_name, watch->data, last_update)) {
+					if (watch->func->print(watch->dir_name, watch->data, last_update)
+					|| (watch->buckets && print_late(watch->dir_name, watch->buckets, last_update))
+					|| (watch->stream && print_dropped(watch->dir_name, watch->stream, last_update))) {
 						run = 0;
 						fprintf(stderr, "Cannot write to stdout: %s\n", strerror(errno));
 						break;
 					}
 					watch->func->clear(watch->data);
-				}
+					if (watch->buckets)
+						watch->buckets->late = 0;
+					if (watch->stream)
+						watch->stream->dropped = 0;
 
-				last_update = update_timestamp(&ratelimitspp_time);
-				if (ratelimitspp_print(last_update)) {
-					run = 0;
-					fprintf(stderr, "Cannot write to stdout: %s\n", strerror(errno));
-					break;
+					if (watch->state == WATCH_REMOVED)
+						obsolete_watch(watch);
 				}
-				ratelimitspp_clear();
 
-				if (tcpserverlimits_print(last_update)) {
-					run = 0;
-					fprintf(stderr, "Cannot write to stdout: %s\n", strerror(errno));
-					break;
+				if (limits) {
+					nd_update_every = interval_update_every(collector_interval[COLLECTOR_SMTP]);
+					last_update = update_timestamp(&ratelimitspp_time);
+					if (ratelimitspp_print(last_update)) {
+						run = 0;
+						fprintf(stderr, "Cannot write to stdout: %s\n", strerror(errno));
+						break;
+					}
+					ratelimitspp_clear();
+
+					if (tcpserverlimits_print(last_update)) {
+						run = 0;
+						fprintf(stderr, "Cannot write to stdout: %s\n", strerror(errno));
+						break;
+					}
+					tcpserverlimits_clear();
 				}
-				tcpserverlimits_clear();
+
+				if (template_dump)
+					template_miner_dump(&template_unknown, template_dump);
 			}
 		}
 	}
 
-	for (i = 0; i < vector.len; i++) {
-		watch = vector_item(&vector, i);
-		free((void *)watch->dir_name);
-		watch->func->fini(watch->data);
-		close(watch->fd);
-	}
+	for (i = 0; i < vector.len; i++)
+		free_watch(watch_vector_item(&vector, i));
+	watch_vector_free(&vector);
+	wheel_free(&wheel);
+	template_miner_free(&template_unknown);
 	close(fs_event_fd);
+	if (stream_fd != -1)
+		close(stream_fd);
 	close(timer_fd);
 	close(signal_fd);
+	free(exec_path);
 
 	return 0;
 }
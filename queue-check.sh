@@ -0,0 +1,69 @@
+#!/bin/sh
+# SPDX-License-Identifier: GPL-3.0-or-later
+
+# Compares ages and sizes of queued messages measured serially and by the
+# threads counting hash buckets. mess and todo hold files directly in them
+# and in buckets, no file is sampled out.
+
+set -e
+
+plugin=${1:-./qmail.plugin}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+mkdir -p "$dir/log" "$dir/queue"
+for d in mess todo intd info local remote bounce; do
+	mkdir "$dir/queue/$d"
+done
+
+# file directory name age_seconds bytes
+file() {
+	head -c "$4" /dev/zero > "$dir/queue/$1/$2"
+	touch -d "@$(( $(date +%s) - $3 ))" "$dir/queue/$1/$2"
+}
+
+for i in 1 2 3 4 5; do
+	file mess "m$i" $(( i * 400 )) $(( i * 100 ))
+done
+file todo t 30 10
+for b in 0 1 2 3; do
+	mkdir "$dir/queue/mess/$b" "$dir/queue/todo/$b"
+	for i in 1 2 3; do
+		file mess "$b/$b$i" $(( b * 3600 + i * 60 )) $(( b * 1000 + i ))
+	done
+	file todo "$b/1" $(( b * 60 )) 1
+done
+
+# Ages are sampled from the second measurement on, the values of the last
+# report are kept
+measure() {
+	"$plugin" -q scan -s 1000 -j "$1" -r "$dir/queue" -u queue=1 1 "$dir/log" > "$dir/out.$1" &
+	pid=$!
+	sleep 4
+	kill "$pid"
+	wait "$pid" || true
+	awk '
+		/^BEGIN .*\.queue_(age|oldest|bytes|lag) / { chart = $2; next }
+		/^END/ { chart = "" }
+		chart && /^SET/ { value[chart " " $2] = $4 }
+		END { for (v in value) print v, value[v] }
+	' "$dir/out.$1" | sort
+}
+
+measure 1 > "$dir/serial"
+measure 4 > "$dir/parallel"
+
+if [ ! -s "$dir/serial" ]; then
+	echo "queue-check: no ages reported" >&2
+	exit 1
+fi
+
+# The oldest message ages by a second between the runs
+if ! diff "$dir/serial" "$dir/parallel" | grep -v 'oldest\|lag' | grep -q '^[<>]'; then
+	echo "queue-check: ok"
+	exit 0
+fi
+
+echo "queue-check: serial and parallel measurements differ" >&2
+diff "$dir/serial" "$dir/parallel" >&2
+exit 1
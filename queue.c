@@ -1,118 +1,1124 @@
 /* SPDX-License-Identifier: GPL-3.0-or-later */
 
 #include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
 #include <time.h>
+#include <unistd.h>
 
-#include "callbacks.h"
 #include "err.h"
+#include "callbacks.h"
+#include "vector.h"
 #include "fs.h"
 #include "netdata.h"
+#include "pool.h"
 #include "queue.h"
+#include "timer.h"
+
+/* Size of the buffer for directory entries of one directory level. A split
+ * directory of the queue holds thousands of entries during an outage. */
+#define DIRENT_BUF_SIZE (64 * 1024)
+/* The queue is two levels deep, anything deeper is not traversed */
+#define QUEUE_MAX_DEPTH 4
+/* Number of ticks between full scans correcting the incremental counts */
+#define QUEUE_RESCAN_TICKS 600
+/* Number of hash buckets counted per tick when estimating */
+#define QUEUE_SAMPLE_BUCKETS 4
+/* Number of ticks between exact counts when estimating */
+#define QUEUE_EXACT_TICKS 300
+/* Quantile of the normal distribution for the 95% confidence interval */
+#define Z_95 1.96
+
+#define QUEUE_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR)
+
+enum queue_mode queue_mode = QUEUE_MODE_SCAN;
+int queue_stat_max = QUEUE_STAT_MAX_DEFAULT;
+int queue_threads = 1;
+long queue_deadline = QUEUE_DEADLINE_DEFAULT;
+long queue_census_interval = 0;
+
+/* Directories of the queue. mess holds every message, todo and intd hold
+ * messages not yet preprocessed by qmail-send, info, local and remote hold
+ * messages with undelivered recipients and bounce pending bounces. */
+enum queue_dir {
+	QUEUE_MESS,
+	QUEUE_TODO,
+	QUEUE_INTD,
+	QUEUE_INFO,
+	QUEUE_LOCAL,
+	QUEUE_REMOTE,
+	QUEUE_BOUNCE,
+	QUEUE_DIRS
+};
+
+static const char * const queue_dirs[QUEUE_DIRS] = {
+	"mess", "todo", "intd", "info", "local", "remote", "bounce",
+};
+
+/* Messages are stat'ed in the first directories only: mess for the age and
+ * size charts, todo for the preprocessing lag */
+#define AGE_DIRS (QUEUE_TODO + 1)
+
+/* Message age buckets, a bucket holds messages younger than its limit */
+static const struct {
+	const char * id;
+	const char * name;
+	long limit;
+} age_buckets[] = {
+	{ "age_1m",    "< 1m",  60 },
+	{ "age_15m",   "< 15m", 15 * 60 },
+	{ "age_1h",    "< 1h",  60 * 60 },
+	{ "age_1d",    "< 1d",  24 * 60 * 60 },
+	{ "age_older", ">= 1d", LONG_MAX },
+};
 
-#define QMAIL_QUEUE_PATH "/var/qmail/queue/"
+#define AGE_BUCKETS (sizeof age_buckets / sizeof * age_buckets)
+
+/* Age and size of messages in a directory. If there are more messages than
+ * queue_stat_max, only every stride-th one is stat'ed and the sums are
+ * extrapolated. */
+struct queue_age {
+	long bucket[AGE_BUCKETS];
+	long long bytes;
+	long oldest;  /* seconds, the oldest sampled message if sampling */
+	time_t now;
+	int max;      /* maximum number of files stat'ed */
+	int stride;
+	int skip;     /* files to skip before the next stat */
+	int files;    /* files seen */
+	int stats;    /* files stat'ed */
+};
+
+/* Inotify watch of a queue directory and the counter it updates */
+struct queue_watch {
+	int wd;
+	int * count;
+};
+
+VECTOR(queue_watch_vector, struct queue_watch)
+
+static inline
+int
+queue_watch_cmp(const int wd, const struct queue_watch * w) {
+	return (wd > w->wd) - (wd < w->wd);
+}
+
+VECTOR_SEARCH(queue_watch_vector, int, queue_watch_cmp)
+
+VECTOR(name_vector, char *)
+
+/* qmail spreads messages evenly into conf-split hash buckets, so the total
+ * is estimated from a rotating sample of buckets */
+struct queue_estimate {
+	struct name_vector buckets; /* subdirectories of the queue directory */
+	size_t next;                /* first bucket counted on the next tick */
+	int files;                  /* files directly in the queue directory */
+	int error;                  /* half-width of the 95% confidence interval */
+};
+
+/* A hash bucket counted by a worker thread */
+struct queue_task {
+	enum queue_dir dir;
+	int fd;               /* queue directory */
+	const char * name;    /* bucket */
+	int count;
+	struct queue_age age;
+};
+
+VECTOR(queue_task_vector, struct queue_task)
+
+/* Values of the last finished measurement, the only ones printed */
+struct queue_report {
+	int count[QUEUE_DIRS];
+	int error[QUEUE_DIRS];
+	struct queue_age age[AGE_DIRS];
+	int corrections;
+	int drift;
+	int census;                 /* the measurement was a census */
+	int sampled;                /* ages were sampled */
+	struct timespec measured;
+};
 
 struct queue_statistics {
-	int mess;
-	int todo;
+	char * root;
+	int count[QUEUE_DIRS];
+	int fd[QUEUE_DIRS]; /* kept open and rewound on every measurement, -1 if missing */
+	enum queue_mode mode; /* queue_mode, QUEUE_MODE_SCAN if inotify cannot be set up */
+	int charted;          /* the charts of the mode have been printed */
+
+	/* QUEUE_MODE_INOTIFY */
+	int inotify_fd;                     /* -1 in QUEUE_MODE_SCAN */
+	struct queue_watch_vector watches;  /* sorted by wd */
+	int dirty;                          /* events were lost, rescan on next tick */
+	int scanned;                        /* the first full scan is done */
+	unsigned long ticks;                /* ticks since the last full scan */
+	int corrections;                    /* full scans which corrected counts */
+	int drift;                          /* files the counts were corrected by */
+
+	/* QUEUE_MODE_ESTIMATE */
+	struct queue_estimate est[QUEUE_DIRS];
+
+	/* QUEUE_MODE_SCAN with queue_threads > 1, buckets are listed in est */
+	struct pool * pool;
+	struct queue_task_vector tasks;
+	struct queue_age job_age[AGE_DIRS]; /* files directly in the directory */
+
+	/* Directories from QUEUE_INTD on are counted only by a census */
+	long census_left;                   /* milliseconds to the next census */
+	int census;                         /* the next measurement is a census */
+	int census_done;                    /* a census finished since the last publish */
+
+	struct queue_age age[AGE_DIRS];     /* unless queue_stat_max is 0 */
+	int counted;                        /* a measurement finished, its counts set the sampling stride */
+	int sampled;                        /* ages are sampled by the measurement */
+	struct timespec measured;           /* CLOCK_MONOTONIC end of the measurement */
+
+	/* A measurement runs on the worker thread and owns the fields above
+	 * until it is published into the report */
+	struct pool * worker;               /* NULL measures on the main thread */
+	int running;                        /* started and not published yet */
+	int late;                           /* missed the deadline on this tick */
+	struct queue_report report;
 };
 
+/* All directories are opened relative to the queue root */
 static
+enum nd_err
+open_queue_dirs(struct queue_statistics * data) {
+	int root;
+	size_t i;
+
+	root = open(data->root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (root == -1) {
+		fprintf(stderr, "Cannot open dir '%s': %s\n", data->root, strerror(errno));
+		return ND_FILE;
+	}
+
+	for (i = 0; i < QUEUE_DIRS; i++) {
+		data->fd[i] = openat(root, queue_dirs[i], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (data->fd[i] == -1)
+			fprintf(stderr, "Cannot open dir '%s/%s': %s\n", data->root, queue_dirs[i], strerror(errno));
+	}
+	close(root);
+
+	return data->fd[QUEUE_MESS] == -1 || data->fd[QUEUE_TODO] == -1 ? ND_FILE : ND_SUCCESS;
+}
+
+static
+void
+close_queue_dirs(struct queue_statistics * data) {
+	size_t i;
+
+	for (i = 0; i < QUEUE_DIRS; i++)
+		if (data->fd[i] != -1)
+			close(data->fd[i]);
+}
+
+static
+enum nd_err
+add_queue_watch(struct queue_statistics * data, const char * path, int * count) {
+	struct queue_watch w;
+	size_t idx;
+
+	w.wd = inotify_add_watch(data->inotify_fd, path, QUEUE_EVENTS);
+	if (w.wd == -1) {
+		fprintf(stderr, "Cannot watch directory '%s': %s\n", path, strerror(errno));
+		return ND_INOTIFY;
+	}
+	w.count = count;
+
+	/* A directory already watched gets the same watch descriptor */
+	idx = queue_watch_vector_lower_bound(&data->watches, w.wd);
+	if (idx < data->watches.len && queue_watch_vector_item(&data->watches, idx)->wd == w.wd)
+		return ND_SUCCESS;
+
+	return queue_watch_vector_insert(&data->watches, idx, &w);
+}
+
+/* Watches the queue directory and its subdirectories, the hash buckets */
+static
+enum nd_err
+add_queue_watches(struct queue_statistics * data, const char * name, const int fd, int * count) {
+	char buf[DIRENT_BUF_SIZE] __attribute__((aligned(8)));
+	const struct dirent64 * de;
+	char path[PATH_MAX];
+	enum nd_err ret;
+	struct stat st;
+	ssize_t len;
+	ssize_t pos;
+
+	if ((ret = add_queue_watch(data, name, count)) != ND_SUCCESS)
+		return ret;
+
+	if (lseek(fd, 0, SEEK_SET) == -1)
+		return ND_FILE;
+
+	while ((len = getdents64(fd, buf, sizeof buf)) > 0) {
+		for (pos = 0; pos < len; pos += de->d_reclen) {
+			de = (const struct dirent64 *)(buf + pos);
+
+			if (de->d_name[0] == '.')
+				continue;
+
+			if (de->d_type == DT_DIR || (de->d_type == DT_UNKNOWN
+			&& fstatat(fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode))) {
+				snprintf(path, sizeof path, "%s/%s", name, de->d_name);
+				if ((ret = add_queue_watch(data, path, count)) != ND_SUCCESS)
+					return ret;
+			}
+		}
+	}
+
+	return len == -1 ? ND_FILE : ND_SUCCESS;
+}
+
+static
+enum nd_err
+add_all_watches(struct queue_statistics * data) {
+	char path[PATH_MAX];
+	enum nd_err ret;
+	size_t i;
+
+	for (i = 0; i < QUEUE_DIRS; i++) {
+		if (data->fd[i] == -1)
+			continue;
+		snprintf(path, sizeof path, "%s/%s", data->root, queue_dirs[i]);
+		if ((ret = add_queue_watches(data, path, data->fd[i], &data->count[i])) != ND_SUCCESS)
+			return ret;
+	}
+
+	return ND_SUCCESS;
+}
+
+static
+enum nd_err
+prepare_inotify(struct queue_statistics * data) {
+	enum nd_err ret;
+
+	data->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (data->inotify_fd == -1) {
+		perror("inotify_init1");
+		return ND_INOTIFY;
+	}
+
+	if ((ret = queue_watch_vector_init(&data->watches, 64)) != ND_SUCCESS
+	|| (ret = add_all_watches(data)) != ND_SUCCESS) {
+		queue_watch_vector_free(&data->watches);
+		close(data->inotify_fd);
+		data->inotify_fd = -1;
+		return ret;
+	}
+
+	return ND_SUCCESS;
+}
+
 void *
-queue_data_init() {
+queue_data_init(const char * root) {
 	struct queue_statistics * ret;
+	size_t i;
 
-	if (is_directory(QMAIL_QUEUE_PATH "mess") != 1) {
+	ret = calloc(1, sizeof * ret);
+	if (ret == NULL)
 		return NULL;
-	}
 
-	if (is_directory(QMAIL_QUEUE_PATH "todo") != 1) {
+	ret->inotify_fd = -1;
+	for (i = 0; i < QUEUE_DIRS; i++)
+		ret->fd[i] = -1;
+
+	if (!(ret->root = strdup(root)) || open_queue_dirs(ret) != ND_SUCCESS) {
+		close_queue_dirs(ret);
+		free(ret->root);
+		free(ret);
 		return NULL;
 	}
 
-	ret = calloc(1, sizeof * ret);
+	/* Other roots keep their mode */
+	ret->mode = queue_mode;
+	if (ret->mode == QUEUE_MODE_INOTIFY && prepare_inotify(ret) != ND_SUCCESS) {
+		fprintf(stderr, "Falling back to full scans of queue '%s'\n", root);
+		ret->mode = QUEUE_MODE_SCAN;
+	}
+
+	if (ret->mode == QUEUE_MODE_SCAN && queue_threads > 1) {
+		if (!(ret->pool = malloc(sizeof * ret->pool)) || pool_init(ret->pool, queue_threads) != ND_SUCCESS) {
+			fputs("Cannot start queue scanning threads, scanning sequentially\n", stderr);
+			free(ret->pool);
+			ret->pool = NULL;
+		}
+	}
+
+	if (!(ret->worker = malloc(sizeof * ret->worker)) || pool_init(ret->worker, 1) != ND_SUCCESS) {
+		fputs("Cannot start queue measuring thread, measuring without deadline\n", stderr);
+		free(ret->worker);
+		ret->worker = NULL;
+	}
+
+	init_timestamp(&ret->measured);
+	ret->report.measured = ret->measured;
+
 	return ret;
 }
 
+static
+void
+free_buckets(struct queue_estimate * est) {
+	size_t i;
+
+	for (i = 0; i < est->buckets.len; i++)
+		free(*name_vector_item(&est->buckets, i));
+	est->buckets.len = 0;
+}
+
+static
+void
+queue_data_fini(struct queue_statistics * data) {
+	size_t i;
+
+	/* A measurement stuck on a hung disk still uses the data, it is left
+	 * to the exit of the plugin */
+	if (data->worker) {
+		if (pool_is_busy(data->worker))
+			return;
+		pool_free(data->worker);
+		free(data->worker);
+	}
+
+	if (data->pool) {
+		pool_free(data->pool);
+		free(data->pool);
+		queue_task_vector_free(&data->tasks);
+	}
+
+	for (i = 0; i < QUEUE_DIRS; i++) {
+		free_buckets(&data->est[i]);
+		name_vector_free(&data->est[i].buckets);
+	}
+
+	if (data->inotify_fd != -1) {
+		queue_watch_vector_free(&data->watches);
+		close(data->inotify_fd);
+	}
+	close_queue_dirs(data);
+	free(data->root);
+	free(data);
+}
+
+/* A single queue keeps the plain chart ids (qmail.queue, qmail.queue_age...),
+ * with several queues they are prefixed by the queue name (qmail.name_queue,
+ * qmail.name_queue_age...) and grouped into a family of the name */
+static
+void
+queue_chart(const char * name, const char * id, const char * title, const char * units, const char * context, const enum nd_charttype type) {
+	nd_chart("qmail", name ? name : id, name ? id : NULL, NULL, title, units, name ? name : "queue", context, type);
+}
+
+static
+void
+queue_begin(const char * name, const char * id, const unsigned long time) {
+	nd_begin_time("qmail", name ? name : id, name ? id : NULL, time);
+}
+
 static
 int
 print_queue_hdr(const char * name) {
-	nd_chart("qmail", "queue", NULL, NULL, NULL, NULL, NULL, "qmail.queue", ND_CHART_TYPE_AREA);
+	int every;
+	size_t i;
+
+	queue_chart(name, "queue", NULL, NULL, "qmail.queue", ND_CHART_TYPE_AREA);
 	nd_dimension("mess", NULL, ND_ALG_ABSOLUTE, 1, 1, ND_VISIBLE);
 	nd_dimension("todo", NULL, ND_ALG_ABSOLUTE, 1, 1, ND_VISIBLE);
 
+	every = nd_update_every;
+	if (queue_census_interval)
+		nd_update_every = interval_update_every(queue_census_interval);
+	queue_chart(name, "queue_state", "Queued messages by state", "messages", "qmail.queue_state", ND_CHART_TYPE_LINE);
+	for (i = QUEUE_INTD; i < QUEUE_DIRS; i++)
+		nd_dimension(queue_dirs[i], NULL, ND_ALG_ABSOLUTE, 1, 1, ND_VISIBLE);
+	nd_update_every = every;
+
+	queue_chart(name, "queue_late", "Queue measurements exceeding the deadline", "ticks", "qmail.queue_late", ND_CHART_TYPE_LINE);
+	nd_dimension("late", NULL, ND_ALG_ABSOLUTE, 1, 1, ND_VISIBLE);
+
+	queue_chart(name, "queue_stale", "Age of reported queue values", "seconds", "qmail.queue_stale", ND_CHART_TYPE_LINE);
+	nd_dimension("stale", NULL, ND_ALG_ABSOLUTE, 1, 1000, ND_VISIBLE);
+
+	if (queue_stat_max > 0) {
+		queue_chart(name, "queue_age", "Age of messages in queue", "messages", "qmail.queue_age", ND_CHART_TYPE_STACKED);
+		for (i = 0; i < AGE_BUCKETS; i++)
+			nd_dimension(age_buckets[i].id, age_buckets[i].name, ND_ALG_ABSOLUTE, 1, 1, ND_VISIBLE);
+
+		queue_chart(name, "queue_oldest", "Age of the oldest message in queue", "seconds", "qmail.queue_oldest", ND_CHART_TYPE_LINE);
+		nd_dimension("oldest", NULL, ND_ALG_ABSOLUTE, 1, 1, ND_VISIBLE);
+
+		queue_chart(name, "queue_bytes", "Size of messages in queue", "bytes", "qmail.queue_bytes", ND_CHART_TYPE_AREA);
+		nd_dimension("mess", NULL, ND_ALG_ABSOLUTE, 1, 1, ND_VISIBLE);
+
+		queue_chart(name, "queue_lag", "Age of the oldest message waiting for preprocessing", "seconds", "qmail.queue_lag", ND_CHART_TYPE_LINE);
+		nd_dimension("todo", NULL, ND_ALG_ABSOLUTE, 1, 1, ND_VISIBLE);
+	}
+
 	return fflush(stdout);
 }
 
+/* Charts of the mode of a root, print_queue_hdr gets only its name. They are
+ * printed before the first values. */
+static
+void
+print_mode_hdr(const char * name, const struct queue_statistics * data) {
+	size_t i;
+
+	if (data->mode == QUEUE_MODE_INOTIFY) {
+		queue_chart(name, "queue_drift", "Corrections of incremental queue counts", "corrections", "qmail.queue_drift", ND_CHART_TYPE_LINE);
+		nd_dimension("corrections", NULL, ND_ALG_ABSOLUTE, 1, 1, ND_VISIBLE);
+		nd_dimension("drift", "files", ND_ALG_ABSOLUTE, 1, 1, ND_VISIBLE);
+	}
+
+	if (data->mode == QUEUE_MODE_ESTIMATE) {
+		queue_chart(name, "queue_error", "Error bound of estimated queue counts (95% confidence)", "files", "qmail.queue_error", ND_CHART_TYPE_LINE);
+		for (i = 0; i < QUEUE_DIRS; i++)
+			nd_dimension(queue_dirs[i], NULL, ND_ALG_ABSOLUTE, 1, 1, ND_VISIBLE);
+	}
+}
+
 static
 int
-print_queue_data(const char * name, const struct queue_statistics * data, const unsigned long time) {
-	nd_begin_time("qmail", "queue", NULL, time);
-	nd_set("mess", data->mess);
-	nd_set("todo", data->todo);
+print_queue_data(const char * name, struct queue_statistics * data, const unsigned long time) {
+	size_t i;
+
+	const struct queue_report * report = &data->report;
+
+	if (!data->charted) {
+		print_mode_hdr(name, data);
+		data->charted = 1;
+	}
+
+	queue_begin(name, "queue", time);
+	nd_set("mess", report->count[QUEUE_MESS]);
+	nd_set("todo", report->count[QUEUE_TODO]);
+	nd_end();
+
+	if (report->census) {
+		queue_begin(name, "queue_state", time);
+		for (i = QUEUE_INTD; i < QUEUE_DIRS; i++)
+			nd_set(queue_dirs[i], report->count[i]);
+		nd_end();
+	}
+
+	if (data->mode == QUEUE_MODE_INOTIFY) {
+		queue_begin(name, "queue_drift", time);
+		nd_set("corrections", report->corrections);
+		nd_set("drift", report->drift);
+		nd_end();
+	}
+
+	queue_begin(name, "queue_late", time);
+	nd_set("late", data->late);
+	nd_end();
+
+	queue_begin(name, "queue_stale", time);
+	nd_set("stale", timestamp_age(&report->measured));
 	nd_end();
 
+	if (data->mode == QUEUE_MODE_ESTIMATE) {
+		queue_begin(name, "queue_error", time);
+		for (i = 0; i < QUEUE_DIRS; i++)
+			nd_set(queue_dirs[i], report->error[i]);
+		nd_end();
+	}
+
+	if (queue_stat_max > 0 && report->sampled) {
+		queue_begin(name, "queue_age", time);
+		for (i = 0; i < AGE_BUCKETS; i++)
+			nd_set(age_buckets[i].id, report->age[QUEUE_MESS].bucket[i]);
+		nd_end();
+
+		queue_begin(name, "queue_oldest", time);
+		nd_set("oldest", report->age[QUEUE_MESS].oldest);
+		nd_end();
+
+		queue_begin(name, "queue_bytes", time);
+		nd_set("mess", report->age[QUEUE_MESS].bytes);
+		nd_end();
+
+		queue_begin(name, "queue_lag", time);
+		nd_set("todo", report->age[QUEUE_TODO].oldest);
+		nd_end();
+	}
+
 	return fflush(stdout);
 }
 
+static
+void
+begin_age(struct queue_age * age, const int expected) {
+	struct timespec now;
+
+	memset(age, 0, sizeof * age);
+	clock_gettime(CLOCK_REALTIME, &now);
+	age->now = now.tv_sec;
+	age->max = queue_stat_max;
+
+	/* Uniform sampling with a random offset, the expected number of files
+	 * comes from the previous measurement, see measure_queue */
+	age->stride = expected > queue_stat_max ? (expected + queue_stat_max - 1) / queue_stat_max : 1;
+	age->skip = age->stride > 1 ? rand() % age->stride : 0;
+}
+
+static
+void
+age_file(const int fd, const char * name, struct queue_age * age) {
+	struct statx stx;
+	long seconds;
+	size_t i;
+
+	age->files++;
+
+	if (age->skip > 0) {
+		age->skip--;
+		return;
+	}
+	if (age->stats >= age->max)
+		return;
+	age->skip = age->stride - 1;
+
+	/* The message may have been delivered in the meantime */
+	if (statx(fd, name, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC, STATX_SIZE | STATX_MTIME, &stx) == -1)
+		return;
+	age->stats++;
+
+	seconds = age->now - stx.stx_mtime.tv_sec;
+	if (seconds < 0)
+		seconds = 0;
+
+	for (i = 0; seconds >= age_buckets[i].limit; i++)
+		;
+
+	age->bucket[i]++;
+	age->bytes += stx.stx_size;
+	if (seconds > age->oldest)
+		age->oldest = seconds;
+}
+
+/* Extrapolates the sampled messages to the total number of messages */
+static
+void
+end_age(struct queue_age * age, const int total) {
+	double scale;
+	size_t i;
+
+	if (age->stats == 0 || age->stats == total)
+		return;
+
+	scale = (double)total / age->stats;
+	for (i = 0; i < AGE_BUCKETS; i++)
+		age->bucket[i] = age->bucket[i] * scale + 0.5;
+	age->bytes = age->bytes * scale + 0.5;
+}
+
+static
+void
+merge_age(struct queue_age * dst, const struct queue_age * src) {
+	size_t i;
+
+	for (i = 0; i < AGE_BUCKETS; i++)
+		dst->bucket[i] += src->bucket[i];
+	dst->bytes += src->bytes;
+	dst->files += src->files;
+	dst->stats += src->stats;
+	if (src->oldest > dst->oldest)
+		dst->oldest = src->oldest;
+}
+
 static
 int
-measure_dir(const char * name) {
-	char path[PATH_MAX];
-	struct dirent * de;
-	int res = 0;
-	DIR * dir;
+measure_dir(const int, const int, struct queue_age *);
 
-	dir = opendir(name);
-	if (dir == NULL) {
-		fprintf(stderr, "Cannot open dir: %s\n", name);
+static
+int
+measure_subdir(const int fd, const char * name, const int depth, struct queue_age * age) {
+	int sub;
+	int res;
+
+	if (depth >= QUEUE_MAX_DEPTH)
+		return 0;
+
+	sub = openat(fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (sub == -1) {
+		fprintf(stderr, "Cannot open dir '%s': %s\n", name, strerror(errno));
 		return 0;
 	}
 
-	while ((de = readdir(dir))) {
-		if (de->d_name[0] == '.')
-			continue;
+	res = measure_dir(sub, depth, age);
+	close(sub);
 
-		if (de->d_type == DT_DIR) {
-			sprintf(path, "%s/%s", name, de->d_name);
-			res += measure_dir(path);
-		} else if (de->d_type == DT_REG) {
-			res += 1;
-		} else if (de->d_type == DT_UNKNOWN) {
-			sprintf(path, "%s/%s", name, de->d_name);
-			if (is_directory(path)) {
-				res += measure_dir(path);
-			} else {
+	return res;
+}
+
+/* Counts regular files in the directory and its subdirectories. Entries are
+ * read in large chunks by getdents64, no path is formatted and an entry is
+ * only stat'ed if the filesystem does not report its type or its age is
+ * measured. */
+static
+int
+measure_dir(const int fd, const int depth, struct queue_age * age) {
+	char buf[DIRENT_BUF_SIZE] __attribute__((aligned(8)));
+	const struct dirent64 * de;
+	struct stat st;
+	ssize_t len;
+	ssize_t pos;
+	int res = 0;
+
+	while ((len = getdents64(fd, buf, sizeof buf)) > 0) {
+		for (pos = 0; pos < len; pos += de->d_reclen) {
+			de = (const struct dirent64 *)(buf + pos);
+
+			if (de->d_name[0] == '.')
+				continue;
+
+			if (de->d_type == DT_REG) {
 				res += 1;
+			} else if (de->d_type == DT_DIR) {
+				res += measure_subdir(fd, de->d_name, depth + 1, age);
+				continue;
+			} else if (de->d_type == DT_UNKNOWN) {
+				if (fstatat(fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode)) {
+					res += measure_subdir(fd, de->d_name, depth + 1, age);
+					continue;
+				} else {
+					res += 1;
+				}
+			} else {
+				continue;
 			}
+
+			if (age)
+				age_file(fd, de->d_name, age);
 		}
 	}
 
-	closedir(dir);
+	if (len == -1)
+		perror("getdents64");
 
 	return res;
 }
 
+static
+int
+measure_queue_dir(const int fd, struct queue_age * age) {
+	if (lseek(fd, 0, SEEK_SET) == -1) {
+		perror("lseek");
+		return 0;
+	}
+
+	return measure_dir(fd, 0, age);
+}
+
+/* Number of directories a measurement counts, mess and todo only between
+ * censuses */
+static inline
+size_t
+census_dirs(const int census) {
+	return census ? QUEUE_DIRS : QUEUE_INTD;
+}
+
+/* Counts the first dirs directories of the queue in one pass over the open
+ * fds */
+static
+void
+census_queue(const struct queue_statistics * data, int * count, struct queue_age * const * age, const size_t dirs) {
+	size_t i;
+
+	for (i = 0; i < dirs; i++)
+		count[i] = data->fd[i] == -1 ? 0 : measure_queue_dir(data->fd[i], i < AGE_DIRS ? age[i] : NULL);
+}
+
+/* Applies events queued since the last tick, the cost is proportional to the
+ * number of changes, not to the size of the queue */
+static
+void
+process_queue_events(struct queue_statistics * data) {
+	char buf[16 * BUFSIZ] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event * event;
+	const struct queue_watch * w;
+	ssize_t len;
+	ssize_t idx;
+	char * ptr;
+
+	while ((len = read(data->inotify_fd, buf, sizeof buf)) > 0) {
+		for (ptr = buf; ptr < buf + len; ptr += sizeof * event + event->len) {
+			event = (const struct inotify_event *)ptr;
+
+			/* Lost events, removed watches and new hash buckets are
+			 * resolved by a full scan */
+			if (event->mask & (IN_Q_OVERFLOW | IN_IGNORED | IN_ISDIR)) {
+				data->dirty = 1;
+				continue;
+			}
+
+			if ((idx = queue_watch_vector_search(&data->watches, event->wd)) == -1)
+				continue;
+			w = queue_watch_vector_item(&data->watches, idx);
+
+			if (event->mask & (IN_CREATE | IN_MOVED_TO))
+				(*w->count)++;
+			else if (event->mask & (IN_DELETE | IN_MOVED_FROM))
+				(*w->count)--;
+		}
+	}
+
+	if (len == -1 && errno != EAGAIN)
+		perror("read");
+}
+
+static
+void
+rescan_queue(struct queue_statistics * data, struct queue_age * const * age) {
+	int count[QUEUE_DIRS];
+	int drift = 0;
+	size_t i;
+
+	if (data->dirty) {
+		add_all_watches(data);
+		data->dirty = 0;
+	}
+
+	census_queue(data, count, age, QUEUE_DIRS);
+
+	for (i = 0; i < QUEUE_DIRS; i++) {
+		drift += abs(count[i] - data->count[i]);
+		data->count[i] = count[i];
+	}
+
+	if (data->scanned && drift) {
+		data->corrections++;
+		data->drift += drift;
+	}
+
+	data->scanned = 1;
+	data->ticks = 0;
+}
+
+/* Lists buckets of the queue directory and counts files directly in it */
+static
+void
+list_buckets(struct queue_estimate * est, const int fd, struct queue_age * age) {
+	char buf[DIRENT_BUF_SIZE] __attribute__((aligned(8)));
+	const struct dirent64 * de;
+	struct stat st;
+	ssize_t len;
+	ssize_t pos;
+	char * name;
+
+	free_buckets(est);
+	est->files = 0;
+	est->error = 0;
+
+	if (lseek(fd, 0, SEEK_SET) == -1) {
+		perror("lseek");
+		return;
+	}
+
+	while ((len = getdents64(fd, buf, sizeof buf)) > 0) {
+		for (pos = 0; pos < len; pos += de->d_reclen) {
+			de = (const struct dirent64 *)(buf + pos);
+
+			if (de->d_name[0] == '.')
+				continue;
+
+			if (de->d_type == DT_DIR || (de->d_type == DT_UNKNOWN
+			&& fstatat(fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode))) {
+				if ((name = strdup(de->d_name)) && name_vector_add(&est->buckets, &name) != ND_SUCCESS)
+					free(name);
+			} else if (de->d_type == DT_REG || de->d_type == DT_UNKNOWN) {
+				est->files++;
+				if (age)
+					age_file(fd, de->d_name, age);
+			}
+		}
+	}
+
+	if (len == -1)
+		perror("getdents64");
+
+	if (est->next >= est->buckets.len)
+		est->next = 0;
+}
+
+/* Counts files directly in the queue directory and in all its buckets,
+ * the list of buckets is refreshed */
+static
+int
+count_exact(struct queue_estimate * est, const int fd, struct queue_age * age) {
+	size_t i;
+	int res;
+
+	list_buckets(est, fd, age);
+
+	for (i = 0, res = est->files; i < est->buckets.len; i++)
+		res += measure_subdir(fd, *name_vector_item(&est->buckets, i), 1, age);
+
+	return res;
+}
+
+/* Counts QUEUE_SAMPLE_BUCKETS buckets and extrapolates them to all buckets.
+ * The error bound comes from the sample variance with the finite population
+ * correction. A directory without buckets is counted exactly. */
+static
+int
+count_estimate(struct queue_estimate * est, const int fd, struct queue_age * age) {
+	const size_t n = est->buckets.len;
+	const size_t k = QUEUE_SAMPLE_BUCKETS;
+	double sum = 0;
+	double sum2 = 0;
+	double mean;
+	double var;
+	size_t i;
+	int c;
+
+	if (n <= k)
+		return count_exact(est, fd, age);
+
+	for (i = 0; i < k; i++) {
+		c = measure_subdir(fd, *name_vector_item(&est->buckets, (est->next + i) % n), 1, age);
+		sum += c;
+		sum2 += (double)c * c;
+	}
+	est->next = (est->next + k) % n;
+
+	mean = sum / k;
+	var = (sum2 - sum * mean) / (k - 1);
+	if (var < 0)
+		var = 0;
+
+	est->error = Z_95 * n * sqrt((1.0 - (double)k / n) * var / k) + 0.5;
+
+	return est->files + n * mean + 0.5;
+}
+
+static
+void
+estimate_queue(struct queue_statistics * data, struct queue_age * const * age) {
+	const int exact = !data->scanned || ++data->ticks >= QUEUE_EXACT_TICKS;
+	struct queue_age * a;
+	size_t i;
+
+	for (i = 0; i < census_dirs(data->census); i++) {
+		if (data->fd[i] == -1)
+			continue;
+		a = i < AGE_DIRS ? age[i] : NULL;
+		data->count[i] = exact
+			? count_exact(&data->est[i], data->fd[i], a)
+			: count_estimate(&data->est[i], data->fd[i], a);
+	}
+
+	if (exact) {
+		data->scanned = 1;
+		data->ticks = 0;
+	}
+}
+
+static
+void
+run_queue_task(void * arg) {
+	struct queue_task * task = arg;
+
+	task->count = measure_subdir(task->fd, task->name, 1, task->age.max ? &task->age : NULL);
+}
+
+static
+enum nd_err
+add_queue_tasks(struct queue_statistics * data, const enum queue_dir dir, const int age) {
+	const struct queue_estimate * est = &data->est[dir];
+	struct queue_task task;
+	size_t i;
+
+	memset(&task, 0, sizeof task);
+	task.dir = dir;
+	task.fd = data->fd[dir];
+
+	for (i = 0; i < est->buckets.len; i++) {
+		task.name = *name_vector_item(&est->buckets, i);
+		if (age) {
+			/* Every bucket samples its share of the stat calls. Files
+			 * directly in the directory are in job_age, which the
+			 * buckets are merged into. */
+			memset(&task.age, 0, sizeof task.age);
+			task.age.now = data->job_age[dir].now;
+			task.age.stride = data->job_age[dir].stride;
+			task.age.max = queue_stat_max / est->buckets.len + 1;
+			task.age.skip = task.age.stride > 1 ? rand() % task.age.stride : 0;
+		}
+		if (queue_task_vector_add(&data->tasks, &task) != ND_SUCCESS)
+			return ND_ALLOC;
+	}
+
+	return ND_SUCCESS;
+}
+
+/* Buckets are listed by the measuring thread and counted by the pool */
+static
+void
+start_parallel_scan(struct queue_statistics * data) {
+	int age;
+	size_t i;
+
+	data->tasks.len = 0;
+
+	for (i = 0; i < census_dirs(data->census); i++) {
+		if (data->fd[i] == -1)
+			continue;
+		age = i < AGE_DIRS && data->sampled;
+		if (age)
+			begin_age(&data->job_age[i], data->count[i]);
+		list_buckets(&data->est[i], data->fd[i], age ? &data->job_age[i] : NULL);
+		add_queue_tasks(data, i, age);
+	}
+
+	/* Pointers to tasks are taken after the vector stopped growing */
+	pool_clear(data->pool);
+	for (i = 0; i < data->tasks.len; i++)
+		pool_add(data->pool, &run_queue_task, queue_task_vector_item(&data->tasks, i));
+	pool_start(data->pool);
+}
+
+static
+void
+finish_parallel_scan(struct queue_statistics * data) {
+	const struct queue_task * task;
+	size_t i;
+
+	for (i = 0; i < census_dirs(data->census); i++)
+		data->count[i] = data->est[i].files;
+	for (i = 0; i < AGE_DIRS; i++)
+		data->age[i] = data->job_age[i];
+
+	for (i = 0; i < data->tasks.len; i++) {
+		task = queue_task_vector_item(&data->tasks, i);
+		data->count[task->dir] += task->count;
+		if (task->dir < AGE_DIRS)
+			merge_age(&data->age[task->dir], &task->age);
+	}
+
+	for (i = 0; data->sampled && i < AGE_DIRS; i++)
+		end_age(&data->age[i], data->count[i]);
+}
+
+/* The deadline is kept by the worker thread running the whole measurement */
+static
+void
+measure_parallel(struct queue_statistics * data) {
+	start_parallel_scan(data);
+	pool_wait(data->pool, NULL);
+	finish_parallel_scan(data);
+}
+
+static
+void
+measure_serial(struct queue_statistics * data) {
+	struct queue_age * age[AGE_DIRS] = { NULL };
+	int expected;
+	size_t i;
+
+	for (i = 0; data->sampled && i < AGE_DIRS; i++) {
+		/* Only the sampled buckets are walked when estimating */
+		expected = data->count[i];
+		if (data->mode == QUEUE_MODE_ESTIMATE && data->est[i].buckets.len > QUEUE_SAMPLE_BUCKETS)
+			expected = (long)expected * QUEUE_SAMPLE_BUCKETS / data->est[i].buckets.len;
+
+		age[i] = &data->age[i];
+		begin_age(age[i], expected);
+	}
+
+	if (data->mode == QUEUE_MODE_SCAN) {
+		census_queue(data, data->count, age, census_dirs(data->census));
+	} else if (data->mode == QUEUE_MODE_ESTIMATE) {
+		estimate_queue(data, age);
+	} else {
+		process_queue_events(data);
+
+		if (!data->scanned || data->dirty || ++data->ticks >= QUEUE_RESCAN_TICKS)
+			rescan_queue(data, age);
+		else
+			/* Ages cannot be maintained from events, only names are
+			 * read and the number of stat calls is still capped */
+			for (i = 0; i < AGE_DIRS; i++)
+				if (age[i])
+					measure_queue_dir(data->fd[i], age[i]);
+	}
+
+	for (i = 0; i < AGE_DIRS; i++)
+		if (age[i])
+			end_age(age[i], data->count[i]);
+}
+
 static
 void
 measure_queue(const char * unused, struct queue_statistics * data) {
-	data->mess = measure_dir(QMAIL_QUEUE_PATH "mess");
-	data->todo = measure_dir(QMAIL_QUEUE_PATH "todo");
+	/* The stride comes from the previous counts, sampling the first files
+	 * listed would bias the ages to a few hash buckets. The first
+	 * measurement only counts. */
+	data->sampled = queue_stat_max > 0 && data->counted;
+
+	if (data->pool)
+		measure_parallel(data);
+	else
+		measure_serial(data);
+	init_timestamp(&data->measured);
+	data->counted = 1;
+
+	/* Incremental counts are always complete, they are only reported at
+	 * the pace of the census */
+	data->census_done |= data->census;
+	data->census = 0;
+}
+
+/* Copies values of a finished measurement into the report, on the main
+ * thread while the worker is idle */
+static
+void
+publish_report(struct queue_statistics * data) {
+	struct queue_report * report = &data->report;
+	size_t i;
+
+	memcpy(report->count, data->count, sizeof report->count);
+	memcpy(report->age, data->age, sizeof report->age);
+	report->sampled = data->sampled;
+	for (i = 0; i < QUEUE_DIRS; i++)
+		report->error[i] = data->est[i].error;
+
+	report->corrections += data->corrections;
+	report->drift += data->drift;
+	report->census |= data->census_done;
+
+	/* Counts are kept, they are updated incrementally in QUEUE_MODE_INOTIFY */
+	data->corrections = 0;
+	data->drift = 0;
+	data->census_done = 0;
+
+	report->measured = data->measured;
+	data->running = 0;
 }
 
 static
 void
 clear_data(struct queue_statistics * data) {
-	memset(data, 0, sizeof * data);
+	data->report.corrections = 0;
+	data->report.drift = 0;
+	data->report.census = 0;
+	data->late = 0;
 }
 
 static
 struct stat_func queue = {
-	.init = &queue_data_init,
-	.fini = &free,
+	.init = NULL, /* see queue_data_init */
+	.fini = (void (*)(void *))&queue_data_fini,
 
 	.print_hdr   = &print_queue_hdr,
 	.print       = (int (*)(const char *, const void *, unsigned long))&print_queue_data,
@@ -122,3 +1128,91 @@ struct stat_func queue = {
 };
 
 struct stat_func * queue_func = &queue;
+
+/* The census is due on the first measurement and then every
+ * queue_census_interval. A parallel scan still running keeps it pending. */
+static
+void
+plan_census(struct fs_watch * watch) {
+	struct queue_statistics * data = watch->data;
+
+	if (data->census_left <= 0) {
+		data->census = 1;
+		data->census_left = queue_census_interval;
+	}
+	data->census_left -= watch->interval;
+}
+
+/* The job gets the statistics, which stay in place, not the watch: log
+ * directories attached meanwhile may move the watch vector */
+static
+void
+run_queue_root(void * arg) {
+	measure_queue(NULL, arg);
+}
+
+/* Every due queue root is measured by its own worker thread, the tick waits
+ * for them at most queue_deadline milliseconds. A late measurement, e.g. on a
+ * hung disk, keeps running and is not started again until it finishes; the
+ * previous report is printed meanwhile together with its age. */
+void
+queue_process(struct fs_watch * watches, const size_t len) {
+	struct queue_statistics * data;
+	struct timespec deadline;
+	size_t i;
+
+	set_deadline(&deadline, queue_deadline);
+
+	for (i = 0; i < len; i++) {
+		if (watches[i].type != WATCH_QUEUE || !watches[i].due)
+			continue;
+		data = watches[i].data;
+
+		if (data->running) {
+			if (pool_is_busy(data->worker))
+				continue;
+			publish_report(data);
+		}
+
+		plan_census(&watches[i]);
+
+		if (!data->worker) {
+			run_queue_root(data);
+			publish_report(data);
+			continue;
+		}
+
+		pool_clear(data->worker);
+		pool_add(data->worker, &run_queue_root, data);
+		pool_start(data->worker);
+		data->running = 1;
+	}
+
+	for (i = 0; i < len; i++) {
+		if (watches[i].type != WATCH_QUEUE || !watches[i].due)
+			continue;
+		data = watches[i].data;
+
+		if (!data->running)
+			continue;
+
+		if (pool_wait(data->worker, &deadline))
+			publish_report(data);
+		else
+			data->late = 1;
+	}
+}
+
+enum nd_err
+queue_set_mode(const char * mode) {
+	if (!strcmp(mode, "scan"))
+		queue_mode = QUEUE_MODE_SCAN;
+	else if (!strcmp(mode, "inotify"))
+		queue_mode = QUEUE_MODE_INOTIFY;
+	else if (!strcmp(mode, "estimate"))
+		queue_mode = QUEUE_MODE_ESTIMATE;
+	else
+		return ND_CONFIG;
+
+	return ND_SUCCESS;
+}
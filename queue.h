@@ -1,3 +1,39 @@
 /* SPDX-License-Identifier: GPL-3.0-or-later */
 
+/* fs.h has to be included before this header. */
+
+#define QUEUE_DEFAULT_ROOT "/var/qmail/queue"
+
+enum queue_mode {
+	QUEUE_MODE_SCAN,    /* full scan on every tick */
+	QUEUE_MODE_INOTIFY, /* full scan at start, then counts updated from inotify events */
+	QUEUE_MODE_ESTIMATE, /* counts extrapolated from a few buckets, exact count once in a while */
+};
+
+/* Default maximum number of messages stat'ed per tick for age charts */
+#define QUEUE_STAT_MAX_DEFAULT 10000
+/* Default number of milliseconds a tick waits for queue measurements */
+#define QUEUE_DEADLINE_DEFAULT 500
+
+extern enum queue_mode queue_mode;
+/* Maximum number of messages stat'ed per tick, 0 disables age charts */
+extern int queue_stat_max;
+/* Number of threads scanning hash buckets in QUEUE_MODE_SCAN */
+extern int queue_threads;
+/* Milliseconds a tick waits for queue measurements */
+extern long queue_deadline;
+/* Milliseconds between counts of directories other than mess and todo, 0
+ * counts them on every measurement */
+extern long queue_census_interval;
+
 extern struct stat_func * queue_func;
+
+void *
+queue_data_init(const char *);
+
+/* Measures queues of all due WATCH_QUEUE watches */
+void
+queue_process(struct fs_watch *, size_t);
+
+enum nd_err
+queue_set_mode(const char *);
@@ -3,11 +3,16 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "netdata.h"
-#include "callbacks.h"
 #include "err.h"
+#include "callbacks.h"
 #include "vector.h"
+#include "dimension.h"
+#include "fs.h"
+#include "bucket.h"
+#include "template.h"
 
 #include "scanner.h"
 
@@ -69,13 +74,6 @@ struct details_statistics {
 	unsigned int incorrect_num_clmns;
 };
 
-#define SIZE_OF_WARN_NAME 16
-struct warn_t {
-	int count;
-	char name[SIZE_OF_WARN_NAME];
-	int new;
-};
-
 struct scannerd_statistics_scalar {
 // Errors
 	unsigned int ex_attempts;
@@ -113,8 +111,8 @@ struct scannerd_statistics_scalar {
 };
 
 struct scannerd_statistics {
-	// Warnings vector dimensions
-	struct vector swv;
+	// Warnings dynamic dimensions
+	struct dim_registry swv;
 	struct scannerd_statistics_scalar sss;
 };
 
@@ -131,25 +129,25 @@ void *
 scannerd_data_init() {
 	struct scannerd_statistics * ret;
 	ret = calloc(1, sizeof * ret);
-	vector_init(&ret->swv, sizeof(struct warn_t));
+	if (ret != NULL && dim_registry_init(&ret->swv) != ND_SUCCESS) {
+		free(ret);
+		ret = NULL;
+	}
 	return ret;
 }
 
 static
 void
-warn_clear(struct vector * warn) {
-	struct warn_t * l = 0;
-	for (int i = 0; i < warn->len; i++) {
-		l = vector_item(warn, i);
-		l->count = 0;
-	}
+scannerd_fini(struct scannerd_statistics * data) {
+	dim_registry_free(&data->swv);
+	free(data);
 }
 
 static
 void
 scannerd_clear(struct scannerd_statistics * data) {
 	memset(&data->sss, 0, sizeof data->sss);
-	warn_clear(&data->swv);
+	dim_registry_clear(&data->swv);
 }
 
 static
@@ -321,51 +319,14 @@ get_ip(const char * line, char * ip_lastpart, const char * startstring, const in
 	return 1;
 }
 
-#define SCANNERNAME_LEN 2
-#define WARNT_LEN 4
 static
 void
-add_warn(const char * scanner, const char * warnt, const char * ip, struct vector * warn) {
-	char name [SIZE_OF_WARN_NAME];
-	int name_len = SCANNERNAME_LEN;
-	int ip_len = strlen(ip);
-
-	memcpy(name, scanner, name_len);
-	name[name_len] = '_';
-	name_len++;
-	memcpy(name + name_len, warnt, WARNT_LEN);
-	name_len += WARNT_LEN;
-	name[name_len] = '_';
-	name_len++;
-	if (ip_len) {
-		memcpy(name + name_len, ip, ip_len);
-		name_len += ip_len;
-	} else {
-		name[name_len] = '?';
-		name_len++;
-	}
+add_warn(const char * scanner, const char * warnt, const char * ip, struct dim_registry * warn) {
+	char name[64];
 
-	name[name_len] = '\0';
-
-	int found = 0;
-
-	for (int i = 0; i < warn->len; i++) {
-		struct warn_t * w;
-		w = vector_item(warn, i);
-		if (!strcmp(name, w->name)) {
-			w->count++;
-			found = 1;
-			break;
-		}
-	}
-
-	if (!found) {
-		struct warn_t w;
-		w.new = 1;
-		w.count = 1;
-		memcpy(w.name, name, name_len + 1);
-		vector_add(warn, &w);
-	}
+	snprintf(name, sizeof name, "%s_%s_%s", scanner, warnt, *ip ? ip : "?");
+	if (dim_registry_add(warn, name, 1) != ND_SUCCESS)
+		fprintf(stderr, "scanner.plugin: cannot add warning: %s\n", name);
 }
 
 #define UNTOCONN "unable to connect to "
@@ -375,7 +336,7 @@ static
 void
 scannerd_process(const char * line, struct scannerd_statistics * data) {
 	char buf[1];
-	char ip[4];
+	char ip[8];
 	const char * severity;
 	const char * module;
 	const char * log;
@@ -404,33 +365,47 @@ scannerd_process(const char * line, struct scannerd_statistics * data) {
 				add_warn("ex", "conn", ip, &data->swv);
 			} else if (get_ip(log, ip, SCANWITH, sizeof(SCANWITH) - 1)) {
 				add_warn("ex", "scan", ip, &data->swv);
+			} else {
+				goto unknown;
 			}
 		} else if (STARTSWITH(module, "rspamd(")) {
 			if (get_ip(log, ip, UNTOCONN, sizeof(UNTOCONN) - 1)) {
 				add_warn("rs", "conn", ip, &data->swv);
 			} else if (get_ip(log, ip, SCANWITH, sizeof(SCANWITH) - 1)) {
 				add_warn("rs", "scan", ip, &data->swv);
+			} else {
+				goto unknown;
 			}
 		} else if (STARTSWITH(module, "spamassassin")) {
 			if (get_ip(log, ip, UNTOCONN, sizeof(UNTOCONN) - 1)) {
 				add_warn("sa", "conn", ip, &data->swv);
 			} else if (get_ip(log, ip, SCANWITH, sizeof(SCANWITH) - 1)) {
 				add_warn("sa", "scan", ip, &data->swv);
+			} else {
+				goto unknown;
 			}
 		} else if (STARTSWITH(module, "clamav(")) {
 			if (get_ip(log, ip, UNTOCONN, sizeof(UNTOCONN) - 1)) {
 				add_warn("av", "conn", ip, &data->swv);
 			} else if (get_ip(log, ip, SCANWITH, sizeof(SCANWITH) - 1)) {
 				add_warn("av", "scan", ip, &data->swv);
+			} else {
+				goto unknown;
 			}
 		} else if (STARTSWITH(module, "daemon(")) {
 			if (strstr(log, "connection closed")) {
 				data->sss.daemon_conn_closed++;
+			} else {
+				goto unknown;
 			}
 		} else if (STARTSWITH(module, "scanner(")) {
 			if (strstr(log, "unknown whitelist reply for result ")) {
 				data->sss.scan_unknown_wl_reply++;
+			} else {
+				goto unknown;
 			}
+		} else {
+			goto unknown;
 		}
 	} else if (STARTSWITH(severity, "error:")) {
 		if (STARTSWITH(module, "extractor(")) {
@@ -446,10 +421,14 @@ scannerd_process(const char * line, struct scannerd_statistics * data) {
 				data->sss.ex_mime_err++;
 			} else if (STARTSWITH(log, "archive error ")) {
 				data->sss.ex_archive_err++;
+			} else {
+				goto unknown;
 			}
 		} else if (STARTSWITH(module, "rspamd(")) {
 			if (STARTSWITH(log, "unable to parse rspamd response: ")) {
 				data->sss.rs_badresponse++;
+			} else {
+				goto unknown;
 			}
 		} else if (STARTSWITH(module, "daemon")) {
 			if (STARTSWITH(log, "invalid scanner reply: ")) {
@@ -458,6 +437,8 @@ scannerd_process(const char * line, struct scannerd_statistics * data) {
 				data->sss.daemon_conn++;
 			} else if (STARTSWITH(log, "unable to handle connection: ")) {
 				data->sss.daemon_connhandle++;
+			} else {
+				goto unknown;
 			}
 		} else if (STARTSWITH(module, "unpacker(")) {
 			if (STARTSWITH(log, "invalid file output: ")) {
@@ -470,6 +451,8 @@ scannerd_process(const char * line, struct scannerd_statistics * data) {
 				data->sss.unpack_delfile++;
 			} else if (STARTSWITH(log, "unable to delete: ")) {
 				data->sss.unpack_del++;
+			} else {
+				goto unknown;
 			}
 		} else if (STARTSWITH(module, "scanner(")) {
 			if (STARTSWITH(log, "DNS query to whitelist zone ")) {
@@ -484,9 +467,19 @@ scannerd_process(const char * line, struct scannerd_statistics * data) {
 				data->sss.scan_clean++;
 			} else if (strstr(log, " result: ")) {
 				data->sss.scan_res++;
+			} else {
+				goto unknown;
 			}
+		} else {
+			goto unknown;
 		}
 	}
+
+	return;
+
+unknown:
+	/* A warning or an error no rule knows */
+	template_unknown_add(severity);
 }
 
 static
@@ -624,41 +617,19 @@ details_print(const char * name, const struct details_statistics * data,
 }
 
 static
-void
-print_new_header_warn(const char * name, const struct vector * warn,
+int
+scannerd_print(const char * name, struct scannerd_statistics * data,
 		const unsigned long time) {
-	struct warn_t * w;
-	for (int i = warn->len - 1; i >= 0; i--) {
-		w = vector_item(warn, i);
-		if (!w->new)
-			break;
-
-		w->new = 0;
+	if (data->swv.changed) {
 		nd_chart("scannerd", name, "warnings", "", "Warnings", "# warnings", "scannerd", "scannerd.current_warnings", ND_CHART_TYPE_LINE);
-		nd_dimension(w->name, w->name, ND_ALG_ABSOLUTE, 1, 1, ND_VISIBLE);
-	}
-}
-
-static
-void
-nd_set_warn(const struct vector * warn) {
-	struct warn_t * w;
-	for (int i = 0; i < warn->len; i++) {
-		w = vector_item(warn, i);
-		nd_set(w->name, w->count);
+		dim_registry_print_dimensions(&data->swv);
 	}
-}
 
-static
-int
-scannerd_print(const char * name, const struct scannerd_statistics * data,
-		const unsigned long time) {
-	print_new_header_warn(name, &data->swv, time);
 	nd_begin_time("scannerd", name, "warnings", time);
 	nd_set("ex_maxsize", data->sss.ex_maxsize);
 	nd_set("scan_unknown_wl_reply", data->sss.scan_unknown_wl_reply);
 	nd_set("daemon_conn_closed", data->sss.daemon_conn_closed);
-	nd_set_warn(&data->swv);
+	dim_registry_set(&data->swv);
 	nd_end();
 
 	nd_begin_time("scannerd", name, "errors", time);
@@ -735,7 +706,7 @@ struct stat_func details = {
 static
 struct stat_func scannerd = {
 	.init = &scannerd_data_init,
-	.fini = &free,
+	.fini = (void (*)(void *))&scannerd_fini,
 
 	.print_hdr   = scannerd_print_hdr,
 	.print       = (int (*)(const char *, const void *, unsigned long))scannerd_print,
@@ -3,9 +3,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
+#include "err.h"
 #include "callbacks.h"
 #include "netdata.h"
+#include "vector.h"
+#include "fs.h"
+#include "bucket.h"
 #include "send.h"
 
 struct send_statistics {
@@ -32,6 +37,17 @@ clear_send_statistics(struct send_statistics * data) {
 	memset(data, 0, sizeof * data);
 }
 
+static
+void
+merge_send_statistics(struct send_statistics * data, const struct send_statistics * from) {
+	data->start_delivery += from->start_delivery;
+	data->end_msg += from->end_msg;
+
+	data->delivery_success += from->delivery_success;
+	data->delivery_failure += from->delivery_failure;
+	data->delivery_deferral += from->delivery_deferral;
+}
+
 static
 int
 print_send_hdr(const char * name) {
@@ -99,6 +115,8 @@ struct stat_func send = {
 	.process     = (void (*)(const char *, void *))&process_send_log_line,
 	.postprocess = NULL,
 	.clear       = (void (*)(void *))&clear_send_statistics,
+	.merge       = (void (*)(void *, const void *))&merge_send_statistics,
+	.size        = sizeof (struct send_statistics),
 };
 
 struct stat_func * send_func = &send;
@@ -4,6 +4,7 @@
 #include <stdlib.h>
 #include <signal.h>
 #include <sys/signalfd.h>
+#include <unistd.h>
 
 #include "signal.h"
 
@@ -17,6 +18,7 @@ prepare_signal_fd() {
 	sigaddset(&mask, SIGQUIT);
 	sigaddset(&mask, SIGTERM);
 	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGHUP);
 
 	ret = sigprocmask(SIG_BLOCK, &mask, NULL);
 	if (ret == -1) {
@@ -32,3 +34,15 @@ prepare_signal_fd() {
 
 	return fd;
 }
+
+int
+read_signal_fd(const int fd) {
+	struct signalfd_siginfo info;
+	int signo = 0;
+
+	while (read(fd, &info, sizeof info) == sizeof info)
+		if (!signo || signo == SIGHUP)
+			signo = info.ssi_signo;
+
+	return signo;
+}
@@ -1,3 +1,9 @@
 /* SPDX-License-Identifier: GPL-3.0-or-later */
 
+/* QUIT, TERM and INT stop the plugin, HUP asks it to execute its binary
+ * again */
 int prepare_signal_fd();
+
+/* Consumes the pending signals, returns SIGHUP if all of them are HUP,
+ * another received signal otherwise and 0 if there is none */
+int read_signal_fd(const int);
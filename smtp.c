@@ -3,11 +3,17 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
+#include "err.h"
 #include "callbacks.h"
 #include "netdata.h"
-#include "err.h"
 #include "vector.h"
+#include "dimension.h"
+#include "fs.h"
+#include "bucket.h"
+#include "template.h"
+#include "handoff.h"
 
 #include "smtp.h"
 
@@ -22,12 +28,6 @@ struct ratelimitspp_statistics {
 	int ratelimited;
 };
 
-struct limit_t {
-	int count;
-	char rulename[256];
-	int new;
-};
-
 struct smtp_statistics_scalar {
 	int tcp_ok;
 	int tcp_deny;
@@ -74,15 +74,14 @@ struct smtp_statistics_scalar {
 	struct ratelimitspp_statistics ratelimitspp;
 };
 
-struct smtp_statistics_vector {
-	struct vector maxconnnet;
-	struct vector maxconnip;
-	struct vector maxconnrule;
-	struct vector maxload;
+struct smtp_limits {
+	struct dim_registry maxconnnet;
+	struct dim_registry maxconnip;
+	struct dim_registry maxconnrule;
+	struct dim_registry maxload;
 };
 
 struct smtp_statistics {
-	struct smtp_statistics_vector ssv;
 	struct smtp_statistics_scalar sss;
 };
 
@@ -90,25 +89,35 @@ static
 struct
 ratelimitspp_statistics aggregated_ratelimtspp;
 
+/* tcpserver limits are aggregated over all smtp log directories */
 static
 struct
-smtp_statistics_vector aggregated_limits;
+smtp_limits aggregated_limits;
+
+int smtp_limits = 1;
+
+static
+enum nd_err
+limits_init(struct smtp_limits * limits) {
+	if (dim_registry_init(&limits->maxload) != ND_SUCCESS
+	|| dim_registry_init(&limits->maxconnnet) != ND_SUCCESS
+	|| dim_registry_init(&limits->maxconnip) != ND_SUCCESS
+	|| dim_registry_init(&limits->maxconnrule) != ND_SUCCESS)
+		return ND_ALLOC;
+
+	return ND_SUCCESS;
+}
 
 static
 void *
 smtp_data_init() {
 	struct smtp_statistics * ret;
+
+	if (!dim_registry_is_init(&aggregated_limits.maxconnrule)
+	&& limits_init(&aggregated_limits) != ND_SUCCESS)
+		return NULL;
+
 	ret = calloc(1, sizeof * ret);
-	if (ret != NULL) {
-		vector_init(&ret->ssv.maxload, sizeof(struct limit_t));
-		vector_init(&ret->ssv.maxconnnet, sizeof(struct limit_t));
-		vector_init(&ret->ssv.maxconnip, sizeof(struct limit_t));
-		vector_init(&ret->ssv.maxconnrule, sizeof(struct limit_t));
-	}
-	vector_init(&aggregated_limits.maxload, sizeof(struct limit_t));
-	vector_init(&aggregated_limits.maxconnnet, sizeof(struct limit_t));
-	vector_init(&aggregated_limits.maxconnip, sizeof(struct limit_t));
-	vector_init(&aggregated_limits.maxconnrule, sizeof(struct limit_t));
 	return ret;
 }
 
@@ -130,30 +139,21 @@ set_rulename(char * name_d, const char * name_s, const size_t size) {
 
 static
 void
-update_limit(struct vector * limits, const char * rulename_p) {
-	struct limit_t * _limit = 0;
-	struct limit_t limit;
+update_limit(struct dim_registry * limits, const char * rulename_p) {
+	char rulename[256];
 
-	set_rulename(limit.rulename, rulename_p, sizeof limit.rulename);
+	if (!smtp_limits)
+		return;
 
-	if (*limit.rulename == '\0') {
-		fprintf(stderr, "Empty rule name in tcpserver deny log line detected. Changing it to \"all\".\n");
-		strcat(limit.rulename, "all");
-	}
+	set_rulename(rulename, rulename_p, sizeof rulename);
 
-	for (int i = 0; i < limits->len; i++) {
-		_limit = vector_item(limits, i);
-		if (strcmp(_limit->rulename, limit.rulename))
-			_limit = 0;
+	if (*rulename == '\0') {
+		fprintf(stderr, "Empty rule name in tcpserver deny log line detected. Changing it to \"all\".\n");
+		strcat(rulename, "all");
 	}
 
-	if (_limit) {
-		_limit->count++;
-	}
-	else {
-		limit.count = 1;
-		vector_add(limits, &limit);
-	}
+	if (dim_registry_add(limits, rulename, 1) != ND_SUCCESS)
+		fprintf(stderr, "Cannot add tcpserver limit rule: %s\n", rulename);
 }
 
 static
@@ -172,13 +172,13 @@ process_smtp(const char * line, struct smtp_statistics * data) {
 			if (!rulename) {
 				fprintf(stderr, "Can't extract rule name on line: %s\n", line);
 			} else if (strstr(rulename, "MAXLOAD:")) {
-				update_limit(&data->ssv.maxload, rulename);
+				update_limit(&aggregated_limits.maxload, rulename);
 			} else if (strstr(rulename, "MAXCONNIP:")) {
-				update_limit(&data->ssv.maxconnip, rulename);
+				update_limit(&aggregated_limits.maxconnip, rulename);
 			} else if (strstr(rulename, "MAXCONNNET:")) {
-				update_limit(&data->ssv.maxconnnet, rulename);
+				update_limit(&aggregated_limits.maxconnnet, rulename);
 			} else if (strstr(rulename, "MAXCONNRULE:")) {
-				update_limit(&data->ssv.maxconnrule, rulename);
+				update_limit(&aggregated_limits.maxconnrule, rulename);
 			}
 		}
 	} else if ((ptr = strstr(line, "tcpserver: status: "))) {
@@ -262,6 +262,7 @@ process_smtp(const char * line, struct smtp_statistics * data) {
 			data->sss.queue_err_temp_problem++;
 		} else {
 			data->sss.queue_err_unknown++;
+			template_unknown_add(line);
 		}
 	} else if ((ptr = strstr(line, "ratelimitspp:"))) {
 		if (strstr(ptr, ";Result:NOK")) {
@@ -273,6 +274,8 @@ process_smtp(const char * line, struct smtp_statistics * data) {
 				data->sss.ratelimitspp.error++;
 			}
 		}
+	} else {
+		template_unknown_add(line);
 	}
 }
 
@@ -401,87 +404,95 @@ print_smtp_data(const char * name, const struct smtp_statistics * data, const un
 
 static
 void
-clear_limits(struct vector * limit) {
-	struct limit_t * l = 0;
-	for (int i = 0; i < limit->len; i++) {
-		l = vector_item(limit, i);
-		l->count = 0;
-	}
+clear_smtp_data(struct smtp_statistics * data) {
+	memset(&data->sss, 0, sizeof data->sss);
 }
 
 static
 void
-clear_smtp_data(struct smtp_statistics * data) {
-	int tmp = data->sss.tcp_status;
-	memset(&data->sss, 0, sizeof data->sss);
-	data->sss.tcp_status = tmp;
-	clear_limits(&data->ssv.maxload);
-	clear_limits(&data->ssv.maxconnip);
-	clear_limits(&data->ssv.maxconnnet);
-	clear_limits(&data->ssv.maxconnrule);
+merge_smtp_data(struct smtp_statistics * data, const struct smtp_statistics * from) {
+	struct smtp_statistics_scalar * to = &data->sss;
+	const struct smtp_statistics_scalar * sss = &from->sss;
+
+	/* tcp_status is derived from the sum and count in carry */
+	to->tcp_ok += sss->tcp_ok;
+	to->tcp_deny += sss->tcp_deny;
+	to->tcp_status_sum += sss->tcp_status_sum;
+	to->tcp_status_count += sss->tcp_status_count;
+
+	to->tcp_end_status_0 += sss->tcp_end_status_0;
+	to->tcp_end_status_256 += sss->tcp_end_status_256;
+	to->tcp_end_status_25600 += sss->tcp_end_status_25600;
+	to->tcp_end_status_others += sss->tcp_end_status_others;
+
+	to->smtp += sss->smtp;
+	to->esmtps += sss->esmtps;
+
+	to->esmtps_tls_1 += sss->esmtps_tls_1;
+	to->esmtps_tls_1_1 += sss->esmtps_tls_1_1;
+	to->esmtps_tls_1_2 += sss->esmtps_tls_1_2;
+	to->esmtps_tls_1_3 += sss->esmtps_tls_1_3;
+	to->esmtps_unknown += sss->esmtps_unknown;
+
+	to->queue_err_conn_timeout += sss->queue_err_conn_timeout;
+	to->queue_err_comm_failed += sss->queue_err_comm_failed;
+	to->queue_err_perm_reject += sss->queue_err_perm_reject;
+	to->queue_err_refused += sss->queue_err_refused;
+	to->queue_err_unprocess += sss->queue_err_unprocess;
+	to->queue_err_unknown += sss->queue_err_unknown;
+	to->queue_err_conn_reject += sss->queue_err_conn_reject;
+	to->queue_err_oom += sss->queue_err_oom;
+	to->queue_err_read += sss->queue_err_read;
+	to->queue_err_make_conn += sss->queue_err_make_conn;
+	to->queue_err_home += sss->queue_err_home;
+	to->queue_err_create_files += sss->queue_err_create_files;
+	to->queue_err_temp_reject += sss->queue_err_temp_reject;
+	to->queue_err_internal_bug += sss->queue_err_internal_bug;
+	to->queue_err_unable_exec_qq += sss->queue_err_unable_exec_qq;
+	to->queue_err_timeout += sss->queue_err_timeout;
+	to->queue_err_fulldiks += sss->queue_err_fulldiks;
+	to->queue_err_read_config += sss->queue_err_read_config;
+	to->queue_err_long_addr += sss->queue_err_long_addr;
+	to->queue_err_perm_problem += sss->queue_err_perm_problem;
+	to->queue_err_temp_problem += sss->queue_err_temp_problem;
+
+	to->ratelimitspp.conn_timeout += sss->ratelimitspp.conn_timeout;
+	to->ratelimitspp.error += sss->ratelimitspp.error;
+	to->ratelimitspp.ratelimited += sss->ratelimitspp.ratelimited;
 }
 
+/* The tcpserver status is a gauge, a tick without status lines reports the
+ * one printed last */
 static
 void
-postprocess_limits(struct vector * limit_aggregated, struct vector * limit) {
-	struct limit_t * l = 0;
-	struct limit_t * l_a = 0;
-
-	for (int i = 0; i < limit->len; i++) {
-		l = vector_item(limit, i);
-		int found = 0;
-		for (int i_a = 0; i_a < limit_aggregated->len; i_a++) {
-			l_a = vector_item(limit_aggregated, i_a);
-			if (!strcmp(l->rulename, l_a->rulename)) {
-				l_a->count += l->count;
-				found = 1;
-				break;
-			}
-		}
-		if (!found) {
-			l->new = 1;
-			vector_add(limit_aggregated, l);
-		}
-	}
+carry_smtp_data(struct smtp_statistics * data, struct smtp_statistics * last) {
+	if (data->sss.tcp_status_count)
+		last->sss.tcp_status = data->sss.tcp_status_sum * FRACTIONAL_CONVERSION / data->sss.tcp_status_count;
+	data->sss.tcp_status = last->sss.tcp_status;
 }
 
 static
 void
 postprocess_data(struct smtp_statistics * data) {
-	if (data->sss.tcp_status_count)
-		data->sss.tcp_status = data->sss.tcp_status_sum * FRACTIONAL_CONVERSION / data->sss.tcp_status_count;
-
 	aggregated_ratelimtspp.conn_timeout += data->sss.ratelimitspp.conn_timeout;
 	aggregated_ratelimtspp.error += data->sss.ratelimitspp.error;
 	if (data->sss.ratelimitspp.ratelimited)
 		aggregated_ratelimtspp.ratelimited = 1;
-
-	postprocess_limits(&aggregated_limits.maxload, &data->ssv.maxload);
-	postprocess_limits(&aggregated_limits.maxconnip, &data->ssv.maxconnip);
-	postprocess_limits(&aggregated_limits.maxconnnet, &data->ssv.maxconnnet);
-	postprocess_limits(&aggregated_limits.maxconnrule, &data->ssv.maxconnrule);
-}
-
-static
-void
-finish (struct smtp_statistics * data) {
-	vector_free(&data->ssv.maxconnnet);
-	vector_free(&data->ssv.maxconnip);
-	vector_free(&data->ssv.maxconnrule);
-	vector_free(&data->ssv.maxload);
-	free(data);
 }
 
 static
 struct stat_func smtp = {
 	.init = &smtp_data_init,
-	.fini = (void (*)(void *))&finish,
+	.fini = &free,
 
 	.print_hdr   = &print_smtp_header,
 	.print       = (int (*)(const char *, const void *, unsigned long))&print_smtp_data,
 	.process     = (void (*)(const char *, void *))&process_smtp,
 	.postprocess = (void (*)(void *))&postprocess_data,
 	.clear       = (void (*)(void *))&clear_smtp_data,
+	.merge       = (void (*)(void *, const void *))&merge_smtp_data,
+	.carry       = (void (*)(void *, void *))&carry_smtp_data,
+	.size        = sizeof (struct smtp_statistics),
 };
 
 struct stat_func * smtp_func = &smtp;
@@ -493,10 +504,40 @@ ratelimitspp_clear() {
 
 void
 tcpserverlimits_clear() {
-	clear_limits(&aggregated_limits.maxload);
-	clear_limits(&aggregated_limits.maxconnip);
-	clear_limits(&aggregated_limits.maxconnnet);
-	clear_limits(&aggregated_limits.maxconnrule);
+	dim_registry_clear(&aggregated_limits.maxload);
+	dim_registry_clear(&aggregated_limits.maxconnip);
+	dim_registry_clear(&aggregated_limits.maxconnnet);
+	dim_registry_clear(&aggregated_limits.maxconnrule);
+}
+
+enum nd_err
+smtp_handoff_write(FILE * state) {
+	if (handoff_write_block(state, &aggregated_ratelimtspp, sizeof aggregated_ratelimtspp) != ND_SUCCESS
+	|| handoff_write_dims(state, &aggregated_limits.maxload) != ND_SUCCESS
+	|| handoff_write_dims(state, &aggregated_limits.maxconnip) != ND_SUCCESS
+	|| handoff_write_dims(state, &aggregated_limits.maxconnnet) != ND_SUCCESS
+	|| handoff_write_dims(state, &aggregated_limits.maxconnrule) != ND_SUCCESS)
+		return ND_FILE;
+
+	return ND_SUCCESS;
+}
+
+enum nd_err
+smtp_handoff_read(FILE * state) {
+	enum nd_err ret;
+
+	if (!dim_registry_is_init(&aggregated_limits.maxconnrule)
+	&& limits_init(&aggregated_limits) != ND_SUCCESS)
+		return ND_ALLOC;
+
+	if ((ret = handoff_read_block(state, &aggregated_ratelimtspp, sizeof aggregated_ratelimtspp)) != ND_SUCCESS
+	|| (ret = handoff_read_dims(state, &aggregated_limits.maxload)) != ND_SUCCESS
+	|| (ret = handoff_read_dims(state, &aggregated_limits.maxconnip)) != ND_SUCCESS
+	|| (ret = handoff_read_dims(state, &aggregated_limits.maxconnnet)) != ND_SUCCESS
+	|| (ret = handoff_read_dims(state, &aggregated_limits.maxconnrule)) != ND_SUCCESS)
+		return ret;
+
+	return ND_SUCCESS;
 }
 
 int
@@ -520,50 +561,24 @@ ratelimitspp_print(const unsigned long time) {
 
 static
 void
-print_limits(struct vector * limit, const char * limit_name, const unsigned long time) {
-	struct limit_t * l;
-
-	struct vector newdim;
-	vector_init(&newdim, sizeof(struct limit_t));
-
-	for (int i = 0; i < limit->len; i++) {
-		l = vector_item(limit, i);
-		if (l->new) {
-			vector_add(&newdim, l);
-		}
-	}
+print_limits(struct dim_registry * limit, const char * limit_name, const unsigned long time) {
+	char title[BUFSIZ];
 
-	if (limit->len > newdim.len) {
-		nd_begin_time("qmail", "limit", limit_name, time);
-		for (int i = 0; i < limit->len; i++) {
-			l = vector_item(limit, i);
-			if (l->new) {
-				l->new = 0;
-			} else {
-				nd_set(l->rulename, l->count);
-			}
-		}
-		nd_end();
-	}
+	if (!dim_registry_is_init(limit))
+		return;
 
-	for (int i = 0; i < newdim.len; i++) {
-		l = vector_item(&newdim, i);
-		char title[BUFSIZ];
+	if (limit->changed) {
 		sprintf(title, "Qmail SMTPD %s limit", limit_name);
 		nd_chart("qmail", "limit", limit_name, "", title, "# reaches",
 			"tcpserver", "qmail.qmail_smtpd_limits", ND_CHART_TYPE_LINE);
-		nd_dimension(l->rulename, l->rulename,     ND_ALG_ABSOLUTE, 1, 1, ND_VISIBLE);
+		dim_registry_print_dimensions(limit);
+	}
 
+	if (limit->dims.len) {
 		nd_begin_time("qmail", "limit", limit_name, time);
-		nd_set(l->rulename, l->count);
+		dim_registry_set(limit);
 		nd_end();
-		if (limit->len == newdim.len) {
-			l = vector_item(limit, i);
-			l->new = 0;
-		}
 	}
-	vector_free(&newdim);
-
 }
 
 int
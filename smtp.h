@@ -2,9 +2,18 @@
 
 extern struct stat_func * smtp_func;
 
+/* tcpserver limit rules are counted in registries shared by all smtp logs,
+ * 0 skips them when archives are processed by several threads */
+extern int smtp_limits;
+
 void ratelimitspp_clear();
 int  ratelimitspp_print_hdr();
 int  ratelimitspp_print(const unsigned long time);
 
 void tcpserverlimits_clear();
 int  tcpserverlimits_print(const unsigned long time);
+
+/* Statistics aggregated over all smtp log directories handed over to a new
+ * binary, stdio.h has to be included before this header */
+enum nd_err smtp_handoff_write(FILE *);
+enum nd_err smtp_handoff_read(FILE *);
@@ -0,0 +1,318 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "err.h"
+#include "callbacks.h"
+#include "vector.h"
+#include "fs.h"
+#include "handoff.h"
+
+#include "stream.h"
+
+#define LEN(x) ( sizeof x / sizeof * x )
+
+/* The index of a watch and whether the event is of its listening socket */
+#define STREAM_EVENT(idx, listening) ((uint64_t)(idx) << 1 | (listening))
+
+int
+prepare_stream_fd() {
+	int fd;
+
+	fd = epoll_create1(EPOLL_CLOEXEC);
+	if (fd == -1) {
+		perror("epoll_create1");
+		exit(1);
+	}
+
+	return fd;
+}
+
+static
+enum nd_err
+stream_add(const int fd, const int stream_fd, const uint32_t events, const uint64_t data) {
+	struct epoll_event event = { .events = events, .data.u64 = data };
+
+	if (epoll_ctl(fd, EPOLL_CTL_ADD, stream_fd, &event) == -1) {
+		perror("epoll_ctl");
+		return ND_ERROR;
+	}
+
+	return ND_SUCCESS;
+}
+
+static
+enum nd_err
+open_fifo(struct fs_watch * watch, const char * path) {
+	long capacity;
+
+	/* Opened for writing as well, the FIFO does not end when the producer
+	 * goes away */
+	if ((watch->fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC)) == -1) {
+		fprintf(stderr, "Cannot open FIFO '%s': %s\n", path, strerror(errno));
+		return ND_FILE;
+	}
+
+	fcntl(watch->fd, F_SETPIPE_SZ, STREAM_PIPE_SIZE);
+	if ((capacity = fcntl(watch->fd, F_GETPIPE_SZ)) == -1) {
+		perror("fcntl");
+		return ND_FILE;
+	}
+	watch->stream->capacity = capacity;
+
+	return ND_SUCCESS;
+}
+
+static
+enum nd_err
+open_socket(struct fs_watch * watch, const char * path) {
+	struct sockaddr_un addr;
+	socklen_t len;
+	int capacity;
+	int fd;
+
+	memset(&addr, 0, sizeof addr);
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof addr.sun_path) {
+		fprintf(stderr, "Socket path '%s' is too long\n", path);
+		return ND_CONFIG;
+	}
+	strcpy(addr.sun_path, path);
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1) {
+		perror("socket");
+		return ND_FILE;
+	}
+	watch->stream->listen_fd = fd;
+
+	/* The socket of a previous run */
+	unlink(path);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof addr) == -1 || listen(fd, 4) == -1) {
+		fprintf(stderr, "Cannot listen on '%s': %s\n", path, strerror(errno));
+		return ND_FILE;
+	}
+
+	len = sizeof capacity;
+	if (getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &capacity, &len) == -1) {
+		perror("getsockopt");
+		return ND_FILE;
+	}
+	/* The doubled size accounts the overhead of the queued buffers */
+	watch->stream->capacity = capacity / 2;
+
+	return ND_SUCCESS;
+}
+
+enum nd_err
+stream_open(const int fd, struct fs_watch * watch, const size_t idx, const char * path) {
+	struct stat st;
+	enum nd_err ret;
+
+	if (!(watch->stream = calloc(1, sizeof * watch->stream)))
+		return ND_ALLOC;
+
+	watch->type = WATCH_STREAM;
+	watch->watch_dir = -1;
+	watch->fd = -1;
+	watch->stream->listen_fd = -1;
+	watch->stream->path = path;
+
+	if (stat(path, &st) == 0 && S_ISFIFO(st.st_mode)) {
+		if ((ret = open_fifo(watch, path)) == ND_SUCCESS)
+			ret = stream_add(fd, watch->fd, EPOLLIN, STREAM_EVENT(idx, 0));
+	} else if (stat(path, &st) == 0 && !S_ISSOCK(st.st_mode)) {
+		fprintf(stderr, "'%s' is neither a FIFO nor a socket\n", path);
+		ret = ND_CONFIG;
+	} else if ((ret = open_socket(watch, path)) == ND_SUCCESS)
+		ret = stream_add(fd, watch->stream->listen_fd, EPOLLIN, STREAM_EVENT(idx, 1));
+
+	if (ret != ND_SUCCESS)
+		stream_close(watch);
+
+	return ret;
+}
+
+enum nd_err
+stream_read(struct fs_watch * watch) {
+	struct fs_stream * stream = watch->stream;
+	enum nd_err ret;
+	int queued;
+	int full;
+
+	if (watch->fd == -1)
+		return ND_SUCCESS;
+
+	/* The producer has been blocked by the full stream, which has no
+	 * room left for PIPE_BUF bytes as pipes keep writes in pages */
+	full = ioctl(watch->fd, FIONREAD, &queued) == 0 && (size_t)queued + PIPE_BUF >= stream->capacity;
+
+	ret = read_log_file(watch);
+
+	/* The queued lines are counted. A blocked write longer than PIPE_BUF
+	 * may have been split and interleaved with other writes, so the
+	 * partial line left at the end is dropped together with its rest. */
+	if (full && watch->buffered) {
+		stream->dropped += watch->buffered;
+		watch->buffered = 0;
+		watch->skip = SKIP_THE_REST;
+	}
+
+	return ret;
+}
+
+/* Fields of a stream kept by the new binary, the path comes from its
+ * options */
+struct handoff_stream {
+	int32_t listen_fd;
+	uint64_t capacity;
+	uint64_t dropped;
+};
+
+enum nd_err
+stream_handoff_write(FILE * state, const struct fs_watch * watch) {
+	struct handoff_stream s;
+
+	memset(&s, 0, sizeof s);
+	s.listen_fd = watch->stream->listen_fd;
+	s.capacity = watch->stream->capacity;
+	s.dropped = watch->stream->dropped;
+
+	return handoff_write_block(state, &s, sizeof s);
+}
+
+enum nd_err
+stream_handoff_read(FILE * state, struct fs_watch * watch, const char * path) {
+	struct handoff_stream s;
+	enum nd_err ret;
+
+	if ((ret = handoff_read_block(state, &s, sizeof s)) != ND_SUCCESS)
+		return ret;
+	if (!s.capacity)
+		return ND_ERROR;
+
+	if (!(watch->stream = calloc(1, sizeof * watch->stream)))
+		return ND_ALLOC;
+
+	watch->type = WATCH_STREAM;
+	watch->stream->path = path;
+	watch->stream->listen_fd = s.listen_fd;
+	watch->stream->capacity = s.capacity;
+	watch->stream->dropped = s.dropped;
+
+	return ND_SUCCESS;
+}
+
+enum nd_err
+stream_resume(const int fd, struct fs_watch * watch, const size_t idx) {
+	struct fs_stream * stream = watch->stream;
+
+	/* Kept open across exec only */
+	if (watch->fd != -1)
+		fcntl(watch->fd, F_SETFD, FD_CLOEXEC);
+	if (stream->listen_fd != -1)
+		fcntl(stream->listen_fd, F_SETFD, FD_CLOEXEC);
+
+	/* A connected producer keeps the listening socket out of the
+	 * events */
+	if (watch->fd != -1)
+		return stream_add(fd, watch->fd, stream->listen_fd == -1 ? EPOLLIN : EPOLLIN | EPOLLRDHUP, STREAM_EVENT(idx, 0));
+
+	return stream_add(fd, stream->listen_fd, EPOLLIN, STREAM_EVENT(idx, 1));
+}
+
+static
+void
+accept_producer(const int fd, struct fs_watch * watch, const size_t idx) {
+	int conn;
+
+	if ((conn = accept4(watch->stream->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) == -1) {
+		if (errno != EAGAIN)
+			perror("accept4");
+		return;
+	}
+
+	if (stream_add(fd, conn, EPOLLIN | EPOLLRDHUP, STREAM_EVENT(idx, 0)) != ND_SUCCESS) {
+		close(conn);
+		return;
+	}
+
+	/* Other producers wait in the backlog until this one goes away */
+	epoll_ctl(fd, EPOLL_CTL_DEL, watch->stream->listen_fd, NULL);
+	watch->fd = conn;
+	watch->skip = DO_NOT_SKIP;
+}
+
+static
+void
+close_producer(const int fd, struct fs_watch * watch, const size_t idx) {
+	/* A line not terminated by the producer is not counted */
+	watch->stream->dropped += watch->buffered;
+	watch->buffered = 0;
+
+	close(watch->fd);
+	watch->fd = -1;
+	stream_add(fd, watch->stream->listen_fd, EPOLLIN, STREAM_EVENT(idx, 1));
+}
+
+void
+process_stream_events(const int fd, struct watch_vector * v) {
+	struct epoll_event events[16];
+	struct fs_watch * watch;
+	size_t idx;
+	int len, i;
+
+	do {
+		if ((len = epoll_wait(fd, events, LEN(events), 0)) == -1) {
+			if (errno != EINTR)
+				perror("epoll_wait");
+			return;
+		}
+
+		for (i = 0; i < len; i++) {
+			idx = events[i].data.u64 >> 1;
+			watch = watch_vector_item(v, idx);
+
+			if (events[i].data.u64 & 1) {
+				accept_producer(fd, watch, idx);
+				continue;
+			}
+
+			stream_read(watch);
+			if (events[i].events & (EPOLLHUP | EPOLLRDHUP | EPOLLERR) && watch->stream->listen_fd != -1)
+				close_producer(fd, watch, idx);
+		}
+	} while (len == LEN(events));
+}
+
+void
+stream_close(struct fs_watch * watch) {
+	struct fs_stream * stream = watch->stream;
+
+	if (!stream)
+		return;
+
+	if (watch->fd != -1)
+		close(watch->fd);
+	watch->fd = -1;
+
+	if (stream->listen_fd != -1) {
+		close(stream->listen_fd);
+		unlink(stream->path);
+	}
+
+	free(stream);
+	watch->stream = NULL;
+}
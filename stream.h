@@ -0,0 +1,49 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+
+/* Log lines fed to a watch through a named FIFO or a UNIX stream socket,
+ * e.g. by a tee in front of multilog, instead of being read back from the
+ * log file. The lines are split and counted as those of a log file. The
+ * streams are drained as soon as they are readable, so the producer does
+ * not wait for the next update.
+ *
+ * A producer faster than the plugin fills the FIFO or the socket and
+ * blocks. When a stream is found full, its complete lines are counted and
+ * the partial line at its end is counted as dropped bytes, lines are
+ * counted again from the next one.
+ *
+ * err.h, stdio.h, vector.h and fs.h have to be included before this header. */
+
+/* Capacity asked for a FIFO, the system limit may be lower */
+#define STREAM_PIPE_SIZE (1024 * 1024)
+
+struct fs_stream {
+	const char * path;
+	int listen_fd;         /* -1 for a FIFO */
+	size_t capacity;       /* bytes queued when the producer blocks */
+	unsigned long dropped; /* bytes of partial lines dropped since the last update */
+};
+
+/* Returns the descriptor polled for all streams */
+int prepare_stream_fd();
+
+/* Opens the FIFO at the path or, if the path is not a FIFO, listens on a
+ * UNIX stream socket bound at it. A single producer is connected at a
+ * time. The watch is identified by its index in the watch vector. */
+enum nd_err stream_open(const int, struct fs_watch *, const size_t, const char *);
+
+/* The listening socket, the capacity and the dropped bytes of a stream
+ * handed over to a new binary */
+enum nd_err stream_handoff_write(FILE *, const struct fs_watch *);
+/* Reads them into a watch of the path read by handoff_read_watch */
+enum nd_err stream_handoff_read(FILE *, struct fs_watch *, const char *);
+
+/* Polls a stream taken over from the previous binary */
+enum nd_err stream_resume(const int, struct fs_watch *, const size_t);
+
+/* Reads all readable streams and accepts producers */
+void process_stream_events(const int, struct watch_vector *);
+
+enum nd_err stream_read(struct fs_watch *);
+
+/* Closes the stream and removes the socket */
+void stream_close(struct fs_watch *);
@@ -4,11 +4,14 @@
 #include <endian.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
 #include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/inotify.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -18,9 +21,30 @@
 #include "vector.h"
 
 #include "fs.h"
+#include "pool.h"
+#include "uring.h"
 
 #define DEFAULT_PATH "/service"
 
+/* supervise writes supervise/status.new and renames it to supervise/status */
+#define STATUS_EVENTS (IN_MOVED_TO | IN_CLOSE_WRITE | IN_ONLYDIR)
+/* A service with a restart in at least FLAP_TICKS of the last 64 ticks is
+ * flapping */
+#define FLAP_TICKS 3
+/* Services are added and removed as entries of the service directory,
+ * usually symbolic links */
+#define SERVICE_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR)
+/* Size of the buffer for /proc/<pid>/stat and statm and for entries of
+ * /proc/<pid>/fd */
+#define PROC_BUF_SIZE 1024
+#define DIRENT_BUF_SIZE (16 * 1024)
+/* Number of services whose status is read by one io_uring_enter call */
+#define URING_BATCH 256
+/* Size of supervise/status, see daemontools code */
+#define STATUS_SIZE 18
+/* Default number of milliseconds a tick waits for the collection */
+#define DEADLINE_DEFAULT 500
+
 struct dt_stat {
 	uint64_t seconds;
 	uint32_t nano;
@@ -31,27 +55,123 @@ struct dt_stat {
 
 enum status {
 	SUCCESS,
-	ERR_CHDIR,
+	ERR_DIR,
 	ERR_OPEN,
 	ERR_READ,
 };
 
+enum service_state {
+	SERVICE_ACTIVE,
+	SERVICE_NEW,     /* DIMENSION lines have not been printed yet */
+	SERVICE_REMOVED, /* obsoleted and freed once the charts are printed */
+};
+
 struct statistics {
 	struct {
 		uint64_t timestamp;
+		uint32_t pid;
 		int is_up;
 		char want;
 		enum status err;
 	} data;
 	const char * name;
+	int dir_fd;   /* service directory, kept open */
+	int wd;       /* watch of supervise/, -1 without inotify */
+	int dirty;    /* status has to be read on the next tick */
+	int pending;  /* status is read in this tick */
+	int seen;     /* found by the last rescan of the service directory */
+	enum service_state state;
+
+	/* Restart tracking, the previous sample and the last 64 ticks */
+	uint64_t timestamp;
+	uint64_t history;  /* bit set for a tick with a restart, newest lowest */
+	uint32_t pid;
+	uint16_t rewrites; /* status rewrites since the last tick, with -i */
+	uint16_t restarts; /* restarts in the last tick */
+
+	/* Resource usage of the supervised process, with -p. Procfs files of
+	 * proc_pid are kept open and read by pread. */
+	struct {
+		uint32_t proc_pid; /* 0 if the files are not open */
+		int stat_fd;
+		int statm_fd;
+		int fd_dir;
+		uint64_t cpu;      /* user and system time including waited-for children, ticks */
+		uint64_t rss;      /* pages */
+		uint32_t threads;
+		uint32_t fds;
+	} proc;
+
+	/* Values of the last finished collection, the only ones printed */
+	struct {
+		int published;     /* a collection finished since the service was opened */
+		enum status err;
+		int is_up;
+		uint64_t timestamp;
+		uint16_t restarts;
+		int flapping;
+		int proc;          /* the supervised process was found */
+		uint64_t cpu;
+		uint64_t rss;
+		uint32_t threads;
+		uint32_t fds;
+	} report;
+};
+
+static inline
+int
+statistics_cmp(const char * name, const struct statistics * st) {
+	return strcmp(name, st->name);
+}
+
+/* Services are kept sorted by name */
+VECTOR(statistics_vector, struct statistics)
+VECTOR_SEARCH(statistics_vector, const char *, statistics_cmp)
+
+/* Name of the service of a watch of supervise/, the services move within
+ * their vector */
+struct service_watch {
+	int wd;
+	const char * name;
 };
 
+static inline
+int
+service_watch_cmp(const int wd, const struct service_watch * w) {
+	return (wd > w->wd) - (wd < w->wd);
+}
+
+/* Watches are kept sorted by wd */
+VECTOR(service_watch_vector, struct service_watch)
+VECTOR_SEARCH(service_watch_vector, int, service_watch_cmp)
+
 int run;
 
+/* Inotify instance watching the service directory and, with -i, supervise/
+ * of all services */
+static int inotify_fd = -1;
+static int service_wd = -1;
+static int watch_status;
+static int watch_proc;
+static struct service_watch_vector service_watches = VECTOR_EMPTY;
+/* Status files are read in batches by io_uring unless unsupported */
+static struct uring ring;
+static int use_uring;
+/* Services were added or removed since the charts were printed */
+static int services_changed;
+/* Services are collected by the worker thread, a tick waits for it at most
+ * deadline milliseconds. A collection stuck on a hung file system keeps
+ * running and the last report is printed meanwhile. */
+static struct pool worker;
+static int use_worker;
+static long deadline = DEADLINE_DEFAULT;
+static struct timespec collected; /* CLOCK_MONOTONIC end of the collection */
+static struct timespec reported;  /* the same of the printed report */
+
 static
 void
 usage(const char * name) {
-	fprintf(stderr, "usage: %s <timeout> [path]\n", name);
+	fprintf(stderr, "usage: %s [-i] [-p] [-s] [-d deadline_ms] <interval> [path]\n", name);
 }
 
 static inline
@@ -66,20 +186,33 @@ quit(int unused) {
 	run = 0;
 }
 
+static
+void
+parse_status(struct statistics * statistics, const unsigned char * status) {
+	const struct dt_stat * stat = (const void *)status;
+
+	statistics->dirty = 0;
+
+	statistics->data.timestamp = be64toh(stat->seconds);
+	statistics->data.pid = le32toh(stat->pid);
+	statistics->data.is_up = !!stat->pid;
+	statistics->data.want = stat->want;
+	statistics->data.err = SUCCESS;
+}
+
 void
 collect_uptime(struct statistics * statistics) {
 	const char * dir = statistics->name;
-	unsigned char status[18]; /* See daemontools code */
-	struct dt_stat * stat;
+	unsigned char status[STATUS_SIZE];
 	int fd, ret;
 
-	if (chdir(dir) == -1) {
-		fprintf(stderr, "Cannot change directory to '%s': %s\n", dir, strerror(errno));
-		statistics->data.err = ERR_CHDIR;
+	if (statistics->dir_fd == -1) {
+		statistics->data.err = ERR_DIR;
 		return;
 	}
 
-	fd = open("supervise/status", O_RDONLY | O_NDELAY);
+	/* The status file is replaced by rename, it cannot be kept open */
+	fd = openat(statistics->dir_fd, "supervise/status", O_RDONLY | O_NDELAY | O_CLOEXEC);
 	if (fd == -1) {
 		fprintf(stderr, "Cannot open %s/supervise/status: %s\n", dir, strerror(errno));
 		statistics->data.err = ERR_OPEN;
@@ -95,32 +228,693 @@ collect_uptime(struct statistics * statistics) {
 		return;
 	}
 
-	stat = (void *)status;
-	statistics->data.timestamp = be64toh(stat->seconds);
-	statistics->data.is_up = !!stat->pid;
-	statistics->data.want = stat->want;
-	statistics->data.err = SUCCESS;
+	parse_status(statistics, status);
+}
+
+enum uring_op {
+	URING_OPEN,
+	URING_READ,
+	URING_CLOSE,
+};
+
+static
+void
+prepare_uring_read(struct statistics * st, const unsigned slot, unsigned char * status) {
+	struct io_uring_sqe * sqe;
+
+	/* The file is opened into the direct descriptor slot, read from it
+	 * and closed. The close is hard linked, it runs even after a short
+	 * read. A direct descriptor is not inherited, O_CLOEXEC is refused. */
+	sqe = uring_get_sqe(&ring);
+	sqe->opcode = IORING_OP_OPENAT;
+	sqe->fd = st->dir_fd;
+	sqe->addr = (uintptr_t)"supervise/status";
+	sqe->open_flags = O_RDONLY | O_NDELAY;
+	sqe->file_index = slot + 1;
+	sqe->flags = IOSQE_IO_LINK;
+	sqe->user_data = slot << 2 | URING_OPEN;
+
+	sqe = uring_get_sqe(&ring);
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = slot;
+	sqe->addr = (uintptr_t)status;
+	sqe->len = STATUS_SIZE;
+	sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+	sqe->user_data = slot << 2 | URING_READ;
+
+	sqe = uring_get_sqe(&ring);
+	sqe->opcode = IORING_OP_CLOSE;
+	sqe->file_index = slot + 1;
+	sqe->user_data = slot << 2 | URING_CLOSE;
+}
+
+/* Reads supervise/status of pending services, URING_BATCH services per
+ * io_uring_enter call instead of three system calls per service. Returns
+ * -1 if the kernel refuses the operations. */
+static
+int
+collect_uring(struct statistics_vector * v) {
+	static unsigned char status[URING_BATCH][STATUS_SIZE];
+	struct statistics * batch[URING_BATCH];
+	const struct io_uring_cqe * cqe;
+	struct statistics * st;
+	unsigned done, n, slot;
+	size_t i = 0;
+	int res;
+
+	while (i < v->len) {
+		for (n = 0; i < v->len && n < URING_BATCH; i++) {
+			st = statistics_vector_item(v, i);
+			if (!st->pending)
+				continue;
+
+			memset(&st->data, 0, sizeof st->data);
+			if (st->dir_fd == -1) {
+				st->data.err = ERR_DIR;
+				continue;
+			}
+
+			st->data.err = ERR_OPEN;
+			prepare_uring_read(st, n, status[n]);
+			batch[n++] = st;
+		}
+
+		for (done = 0; done < 3 * n;) {
+			if (uring_submit_and_wait(&ring, 3 * n - done) < 0)
+				return -1;
+
+			while ((cqe = uring_peek_cqe(&ring))) {
+				slot = cqe->user_data >> 2;
+				st = batch[slot];
+				res = cqe->res;
+
+				switch (cqe->user_data & 3) {
+				case URING_OPEN:
+					if (res == -EINVAL)
+						return -1;
+					if (res < 0)
+						fprintf(stderr, "Cannot open %s/supervise/status: %s\n", st->name, strerror(-res));
+					break;
+				case URING_READ:
+					if (res == -ECANCELED)
+						break;
+					if (res < STATUS_SIZE) {
+						fprintf(stderr, "Cannot read supervise/status\n");
+						st->data.err = ERR_READ;
+					} else {
+						parse_status(st, status[slot]);
+					}
+					break;
+				}
+
+				uring_cqe_seen(&ring);
+				done++;
+			}
+		}
+	}
+
+	return 0;
+}
+
+static
+void
+collect_status(struct statistics_vector * v) {
+	struct statistics * st;
+	size_t i;
+
+	if (use_uring && collect_uring(v) == -1) {
+		fputs("Cannot read status by io_uring, reading it serially\n", stderr);
+		uring_free(&ring);
+		use_uring = 0;
+	}
+
+	if (use_uring)
+		return;
+
+	for (i = 0; i < v->len; i++) {
+		st = statistics_vector_item(v, i);
+		if (!st->pending)
+			continue;
+		memset(&st->data, 0, sizeof st->data);
+		collect_uptime(st);
+	}
+}
+
+/* Direct descriptors opened by openat need kernel 5.15, the feature flag
+ * of 5.17 is the closest one to test */
+static
+int
+prepare_uring() {
+	if (uring_init(&ring, 4 * URING_BATCH) != ND_SUCCESS)
+		return 0;
+
+	if (!(ring.features & IORING_FEAT_CQE_SKIP) || uring_register_files(&ring, URING_BATCH) != ND_SUCCESS) {
+		uring_free(&ring);
+		return 0;
+	}
+
+	return 1;
+}
+
+/* A new pid or a new start time of a running service is a restart. A
+ * service crash looping faster than the update interval shows only one of
+ * them, with -i such a service is seen by supervise rewriting its status
+ * twice per restart, when the process exits and when it is started. */
+static
+void
+count_restarts(struct statistics * st) {
+	if (st->data.err != SUCCESS)
+		return;
+
+	if (st->timestamp && st->data.pid && (st->data.pid != st->pid || st->data.timestamp != st->timestamp))
+		st->restarts = 1;
+	if (st->rewrites / 2 > st->restarts)
+		st->restarts = st->rewrites / 2;
+
+	st->pid = st->data.pid;
+	st->timestamp = st->data.timestamp;
+}
+
+static inline
+int
+is_flapping(const struct statistics * st) {
+	return __builtin_popcountll(st->history) >= FLAP_TICKS;
+}
+
+static
+void
+close_proc(struct statistics * st) {
+	if (st->proc.proc_pid) {
+		close(st->proc.stat_fd);
+		close(st->proc.statm_fd);
+		if (st->proc.fd_dir != -1)
+			close(st->proc.fd_dir);
+	}
+	memset(&st->proc, 0, sizeof st->proc);
+}
+
+static
+int
+open_proc(struct statistics * st, const uint32_t pid) {
+	char path[32];
+
+	snprintf(path, sizeof path, "/proc/%u/stat", pid);
+	if ((st->proc.stat_fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+		return -1;
+
+	snprintf(path, sizeof path, "/proc/%u/statm", pid);
+	if ((st->proc.statm_fd = open(path, O_RDONLY | O_CLOEXEC)) == -1) {
+		close(st->proc.stat_fd);
+		return -1;
+	}
+
+	/* Without the permission to list fds the other values are still read */
+	snprintf(path, sizeof path, "/proc/%u/fd", pid);
+	st->proc.fd_dir = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+	st->proc.proc_pid = pid;
+
+	return 0;
+}
+
+static
+ssize_t
+pread_proc(const int fd, char * buf, const size_t size) {
+	ssize_t len;
+
+	if ((len = pread(fd, buf, size - 1, 0)) <= 0)
+		return -1;
+	buf[len] = '\0';
+
+	return len;
+}
+
+/* Fields of /proc/<pid>/stat after the command name, which may contain
+ * spaces and parentheses, see proc(5) */
+enum {
+	PROC_STAT_UTIME = 14,
+	PROC_STAT_STIME,
+	PROC_STAT_CUTIME,
+	PROC_STAT_CSTIME,
+	PROC_STAT_THREADS = 20,
+};
+
+static
+int
+parse_proc_stat(const char * buf, struct statistics * st) {
+	const char * p;
+	uint64_t value;
+	char * end;
+	int field;
+
+	if (!(p = strrchr(buf, ')')))
+		return -1;
+
+	st->proc.cpu = 0;
+	for (p++, field = 3; field <= PROC_STAT_THREADS; field++) {
+		while (*p == ' ')
+			p++;
+		value = strtoull(p, &end, 10);
+		/* The state is a letter */
+		if (end == p && field != 3)
+			return -1;
+		p = end == p ? p + 1 : end;
+
+		if (field >= PROC_STAT_UTIME && field <= PROC_STAT_CSTIME)
+			st->proc.cpu += value;
+		else if (field == PROC_STAT_THREADS)
+			st->proc.threads = value;
+	}
+
+	return 0;
+}
+
+static
+uint32_t
+count_fds(const int fd) {
+	char buf[DIRENT_BUF_SIZE] __attribute__((aligned(8)));
+	const struct dirent64 * de;
+	uint32_t res = 0;
+	ssize_t len;
+	ssize_t pos;
+
+	if (fd == -1 || lseek(fd, 0, SEEK_SET) == -1)
+		return 0;
+
+	while ((len = getdents64(fd, buf, sizeof buf)) > 0)
+		for (pos = 0; pos < len; pos += de->d_reclen) {
+			de = (const struct dirent64 *)(buf + pos);
+			if (de->d_name[0] != '.')
+				res++;
+		}
+
+	return res;
+}
+
+/* Procfs files are reopened only when the supervised pid changes */
+static
+void
+collect_proc(struct statistics * st) {
+	char buf[PROC_BUF_SIZE];
+	uint32_t pid;
+
+	pid = st->data.err == SUCCESS ? st->data.pid : 0;
+
+	if (pid != st->proc.proc_pid) {
+		close_proc(st);
+		if (pid && open_proc(st, pid) == -1)
+			return;
+	}
+
+	if (!st->proc.proc_pid)
+		return;
+
+	/* The process exited and supervise has not noticed yet */
+	if (pread_proc(st->proc.stat_fd, buf, sizeof buf) == -1 || parse_proc_stat(buf, st) == -1
+	|| pread_proc(st->proc.statm_fd, buf, sizeof buf) == -1
+	|| sscanf(buf, "%*u %" SCNu64, &st->proc.rss) != 1) {
+		close_proc(st);
+		return;
+	}
+
+	st->proc.fds = count_fds(st->proc.fd_dir);
+}
+
+static
+void
+watch_service(struct statistics * st) {
+	char path[PATH_MAX];
+
+	struct service_watch w;
+	ssize_t idx;
+
+	snprintf(path, sizeof path, "%s/supervise", st->name);
+	st->wd = inotify_add_watch(inotify_fd, path, STATUS_EVENTS);
+	/* A new service gets supervise/ once svscan notices it */
+	if (st->wd == -1) {
+		if (errno != ENOENT)
+			fprintf(stderr, "Cannot watch directory '%s': %s\n", path, strerror(errno));
+		return;
+	}
+
+	if ((idx = service_watch_vector_search(&service_watches, st->wd)) != -1) {
+		service_watch_vector_item(&service_watches, idx)->name = st->name;
+		return;
+	}
+
+	w.wd = st->wd;
+	w.name = st->name;
+	/* Without the index the events are lost, the watch is added again on
+	 * the next tick */
+	if (service_watch_vector_insert(&service_watches, service_watch_vector_lower_bound(&service_watches, st->wd), &w) != ND_SUCCESS) {
+		inotify_rm_watch(inotify_fd, st->wd);
+		st->wd = -1;
+	}
+}
+
+static
+void
+forget_service_watch(const int wd) {
+	ssize_t idx;
+
+	if ((idx = service_watch_vector_search(&service_watches, wd)) != -1)
+		service_watch_vector_remove(&service_watches, idx);
+}
+
+static
+void
+open_service(struct statistics * st) {
+	st->dir_fd = open(st->name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (st->dir_fd == -1)
+		fprintf(stderr, "Cannot open directory '%s': %s\n", st->name, strerror(errno));
+
+	st->wd = -1;
+	st->dirty = 1;
+	st->seen = 1;
+	st->state = SERVICE_NEW;
+	st->timestamp = 0;
+	st->history = 0;
+	st->rewrites = 0;
+	/* Nothing is printed for the service until a collection has read its
+	 * status */
+	memset(&st->data, 0, sizeof st->data);
+	memset(&st->report, 0, sizeof st->report);
+	st->data.err = ERR_READ;
+	st->report.err = ERR_READ;
+	if (watch_status)
+		watch_service(st);
+}
+
+static
+void
+close_service(struct statistics * st) {
+	close_proc(st);
+	if (st->dir_fd != -1)
+		close(st->dir_fd);
+	/* The watch outlives removal of a symbolic link to the service */
+	if (st->wd != -1) {
+		inotify_rm_watch(inotify_fd, st->wd);
+		forget_service_watch(st->wd);
+	}
+	st->dir_fd = -1;
+	st->wd = -1;
+}
+
+static
+void
+add_service(struct statistics_vector * v, const char * name) {
+	struct statistics st;
+	ssize_t idx;
+
+	if (name[0] == '.' || is_directory(name) != 1)
+		return;
+
+	if ((idx = statistics_vector_search(v, name)) != -1) {
+		statistics_vector_item(v, idx)->seen = 1;
+		if (statistics_vector_item(v, idx)->state != SERVICE_REMOVED)
+			return;
+		/* Removed and created again before the charts were printed */
+		open_service(statistics_vector_item(v, idx));
+		services_changed = 1;
+		return;
+	}
+
+	memset(&st, 0, sizeof st);
+	if (!(st.name = strdup(name)))
+		return;
+
+	open_service(&st);
+	if (statistics_vector_insert(v, statistics_vector_lower_bound(v, name), &st) != ND_SUCCESS) {
+		close_service(&st);
+		free((void *)st.name);
+		return;
+	}
+	services_changed = 1;
+}
+
+static
+void
+remove_service(struct statistics * st) {
+	if (st->state == SERVICE_REMOVED)
+		return;
+
+	close_service(st);
+	st->state = SERVICE_REMOVED;
+	services_changed = 1;
+}
+
+/* Lists the service directory, services which disappeared are removed */
+static
+void
+rescan_services(struct statistics_vector * v) {
+	struct dirent * dir_entry;
+	DIR * dir;
+	size_t i;
+
+	if (!(dir = opendir("."))) {
+		perror("opendir");
+		return;
+	}
+
+	for (i = 0; i < v->len; i++)
+		statistics_vector_item(v, i)->seen = 0;
+
+	while ((dir_entry = readdir(dir)))
+		add_service(v, dir_entry->d_name);
+	closedir(dir);
+
+	for (i = 0; i < v->len; i++)
+		if (!statistics_vector_item(v, i)->seen)
+			remove_service(statistics_vector_item(v, i));
+}
+
+static
+void
+process_service_event(struct statistics_vector * v, const struct inotify_event * event) {
+	ssize_t idx;
+
+	if (!event->len)
+		return;
+
+	if (event->mask & (IN_CREATE | IN_MOVED_TO))
+		add_service(v, event->name);
+	else if ((idx = statistics_vector_search(v, event->name)) != -1)
+		remove_service(statistics_vector_item(v, idx));
+}
+
+/* Applies changes of the service directory and marks services whose status
+ * was rewritten since the last tick. Events are rare, they come only with a
+ * change of a service state or of the set of services. */
+static
+void
+process_events(struct statistics_vector * v) {
+	char buf[16 * BUFSIZ] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event * event;
+	struct statistics * st;
+	ssize_t len, idx;
+	char * ptr;
+	size_t i;
+
+	while ((len = read(inotify_fd, buf, sizeof buf)) > 0) {
+		for (ptr = buf; ptr < buf + len; ptr += sizeof * event + event->len) {
+			event = (const struct inotify_event *)ptr;
+
+			if (event->mask & IN_Q_OVERFLOW) {
+				for (i = 0; i < v->len; i++)
+					statistics_vector_item(v, i)->dirty = 1;
+				rescan_services(v);
+				continue;
+			}
+
+			if (event->wd == service_wd) {
+				process_service_event(v, event);
+				continue;
+			}
+
+			if ((idx = service_watch_vector_search(&service_watches, event->wd)) == -1
+			|| (idx = statistics_vector_search(v, service_watch_vector_item(&service_watches, idx)->name)) == -1)
+				continue;
+
+			st = statistics_vector_item(v, idx);
+			/* supervise/ was removed, it is watched again once it
+			 * appears */
+			if (event->mask & IN_IGNORED) {
+				forget_service_watch(event->wd);
+				st->wd = -1;
+				st->dirty = 1;
+			}
+			if (event->len && !strcmp(event->name, "status")) {
+				st->dirty = 1;
+				st->rewrites++;
+			}
+		}
+	}
+
+	if (len == -1 && errno != EAGAIN)
+		perror("read");
+}
+
+/* Prints DIMENSION lines of new and removed services only, a chart keeps
+ * dimensions defined earlier */
+static
+void
+print_dimensions(const struct statistics_vector * v, const enum nd_algorithm alg, const int mul, const int div) {
+	const struct statistics * st;
+	size_t i;
+
+	for (i = 0; i < v->len; i++) {
+		st = statistics_vector_item(v, i);
+		if (st->state == SERVICE_NEW)
+			nd_dimension(st->name, st->name, alg, mul, div, ND_VISIBLE);
+		else if (st->state == SERVICE_REMOVED)
+			nd_dimension(st->name, st->name, alg, mul, div, ND_OBSOLETE);
+	}
+}
+
+/* Runs on the worker thread, the main thread leaves services alone until it
+ * finishes */
+static
+void
+collect_services(void * arg) {
+	struct statistics_vector * v = arg;
+	struct statistics * st;
+	size_t i;
+
+	collect_status(v);
+
+	for (i = 0; i < v->len; i++) {
+		st = statistics_vector_item(v, i);
+		if (st->pending)
+			count_restarts(st);
+		st->history = st->history << 1 | !!st->restarts;
+		st->rewrites = 0;
+		if (watch_proc)
+			collect_proc(st);
+	}
+
+	init_timestamp(&collected);
+}
+
+static
+void
+publish_services(struct statistics_vector * v) {
+	struct statistics * st;
+	size_t i;
+
+	for (i = 0; i < v->len; i++) {
+		st = statistics_vector_item(v, i);
+		st->report.published = 1;
+		st->report.err = st->data.err;
+		st->report.is_up = st->data.is_up;
+		st->report.timestamp = st->data.timestamp;
+		st->report.restarts = st->restarts;
+		st->report.flapping = is_flapping(st);
+		st->report.proc = !!st->proc.proc_pid;
+		st->report.cpu = st->proc.cpu;
+		st->report.rss = st->proc.rss;
+		st->report.threads = st->proc.threads;
+		st->report.fds = st->proc.fds;
+	}
+
+	reported = collected;
+}
+
+static
+void
+print_charts(struct statistics_vector * v) {
+	struct statistics * st;
+	size_t i, j;
+
+	nd_chart("daemontools", "uptime", NULL, NULL, "Service Uptime", "seconds", "daemontools", "daemontools.uptime", ND_CHART_TYPE_LINE);
+	print_dimensions(v, ND_ALG_ABSOLUTE, 1, 1);
+
+	nd_chart("daemontools", "downtime", NULL, NULL, "Service Downtime", "seconds", "daemontools", "daemontools.downtime", ND_CHART_TYPE_LINE);
+	print_dimensions(v, ND_ALG_ABSOLUTE, 1, 1);
+
+	nd_chart("daemontools", "up_down", NULL, NULL, "Service Up/Down", "up/down", "daemontools", "daemontools.up_down", ND_CHART_TYPE_LINE);
+	print_dimensions(v, ND_ALG_ABSOLUTE, 1, 1);
+
+	nd_chart("daemontools", "restarts", NULL, NULL, "Service Restarts", "restarts", "daemontools", "daemontools.restarts", ND_CHART_TYPE_LINE);
+	print_dimensions(v, ND_ALG_ABSOLUTE, 1, 1);
+
+	nd_chart("daemontools", "flapping", NULL, NULL, "Service Flapping", "flapping", "daemontools", "daemontools.flapping", ND_CHART_TYPE_LINE);
+	print_dimensions(v, ND_ALG_ABSOLUTE, 1, 1);
+
+	if (watch_proc) {
+		nd_chart("daemontools", "cpu", NULL, NULL, "Service CPU Time", "percentage", "resources", "daemontools.cpu", ND_CHART_TYPE_STACKED);
+		print_dimensions(v, ND_ALG_INCREMENTAL, 100, sysconf(_SC_CLK_TCK));
+
+		nd_chart("daemontools", "rss", NULL, NULL, "Service Resident Memory", "KiB", "resources", "daemontools.rss", ND_CHART_TYPE_STACKED);
+		print_dimensions(v, ND_ALG_ABSOLUTE, sysconf(_SC_PAGESIZE), 1024);
+
+		nd_chart("daemontools", "threads", NULL, NULL, "Service Threads", "threads", "resources", "daemontools.threads", ND_CHART_TYPE_LINE);
+		print_dimensions(v, ND_ALG_ABSOLUTE, 1, 1);
+
+		nd_chart("daemontools", "fds", NULL, NULL, "Service Open Files", "files", "resources", "daemontools.fds", ND_CHART_TYPE_LINE);
+		print_dimensions(v, ND_ALG_ABSOLUTE, 1, 1);
+	}
+
+	for (i = 0, j = 0; i < v->len; i++) {
+		st = statistics_vector_item(v, i);
+		if (st->state == SERVICE_REMOVED) {
+			free((void *)st->name);
+			continue;
+		}
+
+		st->state = SERVICE_ACTIVE;
+		if (i != j)
+			*statistics_vector_item(v, j) = *st;
+		j++;
+	}
+	v->len = j;
+
+	services_changed = 0;
 }
 
 int
 main(int argc, char * argv[]) {
-	struct vector directories = VECTOR_EMPTY;
-	struct statistics statistics;
+	struct statistics_vector directories = VECTOR_EMPTY;
 	unsigned long last_update;
 	struct timespec timestamp;
-	struct dirent * dir_entry;
-	const char * dir_name;
 	const char * argv0;
 	const char * path;
-	int timeout = 1;
-	int dir_fd;
-	DIR * dir;
+	struct timespec deadline_time;
+	long interval = 1000;
+	int collecting = 0;
+	int timer_fd;
+	int opt;
 
 	path = DEFAULT_PATH;
-	argv0 = *argv; argv++; argc--;
+	argv0 = *argv;
+
+	use_uring = 1;
+
+	while ((opt = getopt(argc, argv, "ipsd:")) != -1) {
+		switch (opt) {
+		case 'i':
+			watch_status = 1;
+			break;
+		case 'p':
+			watch_proc = 1;
+			break;
+		case 's':
+			use_uring = 0;
+			break;
+		case 'd':
+			deadline = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			usage(argv0);
+			exit(1);
+		}
+	}
+	argv += optind; argc -= optind;
 
 	if (argc > 0) {
-		timeout = atoi(*argv);
+		if (!(interval = parse_interval(*argv))) {
+			usage(argv0);
+			exit(1);
+		}
 		argv++; argc--;
 	} else {
 		usage(argv0);
@@ -140,98 +934,172 @@ main(int argc, char * argv[]) {
 	signal(SIGTERM, quit);
 	signal(SIGINT, quit);
 
-	vector_init(&directories, sizeof statistics);
-	memset(&statistics, 0, sizeof statistics);
-
-	dir = opendir(".");
-	while ((dir_entry = readdir(dir))) {
-		dir_name = dir_entry->d_name;
+	/* The directory is watched before it is listed, no service is missed */
+	inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (inotify_fd == -1) {
+		perror("inotify_init1");
+		watch_status = 0;
+	} else if ((service_wd = inotify_add_watch(inotify_fd, ".", SERVICE_EVENTS)) == -1) {
+		fprintf(stderr, "Cannot watch directory '%s': %s\n", path, strerror(errno));
+	}
 
-		if (dir_name[0] == '.')
-			continue;
+	if (use_uring && !(use_uring = prepare_uring()))
+		fputs("io_uring is not supported, reading status serially\n", stderr);
 
-		if (is_directory(dir_name) == 1) {
-			statistics.name = strdup(dir_name);
-			if (statistics.name) {
-				vector_add(&directories, &statistics);
-			}
-		}
-	}
-	closedir(dir);
+	statistics_vector_init(&directories, 64);
+	rescan_services(&directories);
 
-	if (vector_is_empty(&directories)) {
+	if (statistics_vector_is_empty(&directories)) {
 		fprintf(stderr, "No service directory detected\n");
 		exit(1);
 	}
 
-	dir_fd = open(".", O_DIRECTORY | O_RDONLY | O_NDELAY);
-	if (dir_fd == -1) {
-		fprintf(stderr, "Cannot open directory '%s': %s\n", path, strerror(errno));
-		exit(1);
-	}
+	if (!(use_worker = pool_init(&worker, 1) == ND_SUCCESS))
+		fputs("Cannot start collecting thread, collecting without deadline\n", stderr);
 
-	nd_chart("daemontools", "uptime", NULL, NULL, "Service Uptime", "seconds", "daemontools", "daemontools.uptime", ND_CHART_TYPE_LINE);
-	for (int i = 0; i < directories.len; i++) {
-		struct statistics * st = vector_item(&directories, i);
-		nd_dimension(st->name, st->name, ND_ALG_ABSOLUTE, 1, 1, ND_VISIBLE);
-	}
-
-	nd_chart("daemontools", "downtime", NULL, NULL, "Service Downtime", "seconds", "daemontools", "daemontools.downtime", ND_CHART_TYPE_LINE);
-	for (int i = 0; i < directories.len; i++) {
-		struct statistics * st = vector_item(&directories, i);
-		nd_dimension(st->name, st->name, ND_ALG_ABSOLUTE, 1, 1, ND_VISIBLE);
-	}
-
-	nd_chart("daemontools", "up_down", NULL, NULL, "Service Up/Down", "up/down", "daemontools", "daemontools.up_down", ND_CHART_TYPE_LINE);
-	for (int i = 0; i < directories.len; i++) {
-		struct statistics * st = vector_item(&directories, i);
-		nd_dimension(st->name, st->name, ND_ALG_ABSOLUTE, 1, 1, ND_VISIBLE);
-	}
+	print_charts(&directories);
+	nd_chart("daemontools", "stale", NULL, NULL, "Age of reported service status", "seconds", "daemontools", "daemontools.stale", ND_CHART_TYPE_LINE);
+	nd_dimension("stale", NULL, ND_ALG_ABSOLUTE, 1, 1000, ND_VISIBLE);
 	fflush(stdout);
 
-	clock_gettime(CLOCK_REALTIME, &timestamp);
+	timer_fd = prepare_timer_fd(interval);
+	init_timestamp(&timestamp);
 
 	for (run = 1; run;) {
-		/* Collect statistics */
-		for (int i = 0; i < directories.len; i++) {
-			struct statistics * st = vector_item(&directories, i);
-			memset(&st->data, 0, sizeof st->data);
-			collect_uptime(st);
-			if (fchdir(dir_fd) == -1) {
-				fprintf(stderr, "Cannot change directory back to '%s': %s\n", path, strerror(errno));
-				break;
+		set_deadline(&deadline_time, deadline);
+
+		/* Collect statistics, with -i only rewritten status files are
+		 * read, services failed to be read are retried. Services are
+		 * added and removed only while no collection runs. */
+		if (!collecting) {
+			if (inotify_fd != -1)
+				process_events(&directories);
+
+			if (services_changed)
+				print_charts(&directories);
+
+			for (int i = 0; i < directories.len; i++) {
+				struct statistics * st = statistics_vector_item(&directories, i);
+				if (watch_status && st->wd == -1)
+					watch_service(st);
+				st->restarts = 0;
+				st->pending = !watch_status || st->dirty || st->data.err != SUCCESS;
+			}
+
+			if (use_worker) {
+				pool_clear(&worker);
+				pool_add(&worker, &collect_services, &directories);
+				pool_start(&worker);
+				collecting = 1;
+			} else {
+				collect_services(&directories);
+				publish_services(&directories);
 			}
 		}
 
+		if (collecting && pool_wait(&worker, &deadline_time)) {
+			publish_services(&directories);
+			collecting = 0;
+		}
+
 		/* Present statistics */
 		last_update = update_timestamp(&timestamp);
 		time_t now = tai_now();
 
 		nd_begin_time("daemontools", "uptime", NULL, last_update);
 		for (int i = 0; i < directories.len; i++) {
-			struct statistics * st = vector_item(&directories, i);
-			if (st->data.err == SUCCESS && st->data.is_up) {
-				nd_set(st->name, now - st->data.timestamp);
+			struct statistics * st = statistics_vector_item(&directories, i);
+			if (!st->report.published)
+				continue;
+			if (st->report.err == SUCCESS && st->report.is_up) {
+				nd_set(st->name, now - st->report.timestamp);
 			}
 		}
 		nd_end();
 
 		nd_begin_time("daemontools", "downtime", NULL, last_update);
 		for (int i = 0; i < directories.len; i++) {
-			struct statistics * st = vector_item(&directories, i);
-			if (st->data.err == SUCCESS) {
-				nd_set(st->name, !st->data.is_up ? now - st->data.timestamp : 0);
+			struct statistics * st = statistics_vector_item(&directories, i);
+			if (!st->report.published)
+				continue;
+			if (st->report.err == SUCCESS) {
+				nd_set(st->name, !st->report.is_up ? now - st->report.timestamp : 0);
 			}
 		}
 		nd_end();
 
 		nd_begin_time("daemontools", "up_down", NULL, last_update);
 		for (int i = 0; i < directories.len; i++) {
-			struct statistics * st = vector_item(&directories, i);
-			if (st->data.err == SUCCESS) {
-				nd_set(st->name, st->data.is_up);
+			struct statistics * st = statistics_vector_item(&directories, i);
+			if (!st->report.published)
+				continue;
+			if (st->report.err == SUCCESS) {
+				nd_set(st->name, st->report.is_up);
+			}
+		}
+		nd_end();
+
+		nd_begin_time("daemontools", "restarts", NULL, last_update);
+		for (int i = 0; i < directories.len; i++) {
+			struct statistics * st = statistics_vector_item(&directories, i);
+			if (!st->report.published)
+				continue;
+			nd_set(st->name, st->report.restarts);
+			/* A late collection does not repeat restarts */
+			st->report.restarts = 0;
+		}
+		nd_end();
+
+		nd_begin_time("daemontools", "flapping", NULL, last_update);
+		for (int i = 0; i < directories.len; i++) {
+			struct statistics * st = statistics_vector_item(&directories, i);
+			if (!st->report.published)
+				continue;
+			nd_set(st->name, st->report.flapping);
+		}
+		nd_end();
+
+		if (watch_proc) {
+			nd_begin_time("daemontools", "cpu", NULL, last_update);
+			for (int i = 0; i < directories.len; i++) {
+				struct statistics * st = statistics_vector_item(&directories, i);
+				if (!st->report.published)
+					continue;
+				if (st->report.proc)
+					nd_set(st->name, st->report.cpu);
+			}
+			nd_end();
+
+			nd_begin_time("daemontools", "rss", NULL, last_update);
+			for (int i = 0; i < directories.len; i++) {
+				struct statistics * st = statistics_vector_item(&directories, i);
+				if (!st->report.published)
+					continue;
+				nd_set(st->name, st->report.rss);
 			}
+			nd_end();
+
+			nd_begin_time("daemontools", "threads", NULL, last_update);
+			for (int i = 0; i < directories.len; i++) {
+				struct statistics * st = statistics_vector_item(&directories, i);
+				if (!st->report.published)
+					continue;
+				nd_set(st->name, st->report.threads);
+			}
+			nd_end();
+
+			nd_begin_time("daemontools", "fds", NULL, last_update);
+			for (int i = 0; i < directories.len; i++) {
+				struct statistics * st = statistics_vector_item(&directories, i);
+				if (!st->report.published)
+					continue;
+				nd_set(st->name, st->report.fds);
+			}
+			nd_end();
 		}
+
+		nd_begin_time("daemontools", "stale", NULL, last_update);
+		nd_set("stale", timestamp_age(&reported));
 		nd_end();
 
 		if (fflush(stdout) == EOF) {
@@ -239,12 +1107,31 @@ main(int argc, char * argv[]) {
 			break;
 		}
 
-		sleep(timeout);
+		if (wait_timer_fd(timer_fd) == -1) {
+			fprintf(stderr, "Cannot wait for timer: %s\n", strerror(errno));
+			break;
+		}
 	}
-	close(dir_fd);
+
+	/* A collection stuck on a hung file system still uses the services,
+	 * they are left to the exit */
+	if (use_worker) {
+		if (pool_is_busy(&worker))
+			return 0;
+		pool_free(&worker);
+	}
+
 	for (int i = 0; i < directories.len; i++) {
-		free((void *)((struct statistics *)vector_item(&directories, i))->name);
+		struct statistics * st = statistics_vector_item(&directories, i);
+		close_service(st);
+		free((void *)st->name);
 	}
-	vector_free(&directories);
+	if (inotify_fd != -1)
+		close(inotify_fd);
+	close(timer_fd);
+	if (use_uring)
+		uring_free(&ring);
+	statistics_vector_free(&directories);
+	service_watch_vector_free(&service_watches);
 	return 0;
 }
@@ -0,0 +1,230 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "err.h"
+
+#include "template.h"
+
+#define WILDCARD_LEN (sizeof TEMPLATE_WILDCARD - 1)
+
+struct template_miner template_unknown;
+const char * template_dump = NULL;
+
+static inline
+int
+is_blank(const char c) {
+	return c == ' ' || c == '\t';
+}
+
+static inline
+int
+is_digit(const char c) {
+	return c >= '0' && c <= '9';
+}
+
+static inline
+int
+is_hex(const char c) {
+	return is_digit(c) || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
+}
+
+/* Numbers, IPv4 and IPv6 addresses, ports, sizes, hashes and e-mail
+ * addresses are replaced as a whole */
+static
+int
+is_variable(const char * tok, const size_t len) {
+	int digits = 0;
+	int hex = 1;
+	int num = 1;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if (tok[i] == '@')
+			return 1;
+		if (is_digit(tok[i]))
+			digits = 1;
+		if (!is_hex(tok[i]))
+			hex = 0;
+		if (!is_hex(tok[i]) && !strchr(".:,/-_x()[]<>=", tok[i]))
+			num = 0;
+	}
+
+	return (num && digits) || (hex && len >= 8);
+}
+
+/* Appends a wildcard or the token with runs of digits replaced by the
+ * wildcard, returns the new length or 0 if there is no space left */
+static
+size_t
+append_token(char * out, size_t len, const char * tok, const size_t tok_len) {
+	size_t i;
+
+	if (is_variable(tok, tok_len)) {
+		if (len + WILDCARD_LEN >= TEMPLATE_LEN)
+			return 0;
+		memcpy(out + len, TEMPLATE_WILDCARD, WILDCARD_LEN);
+		return len + WILDCARD_LEN;
+	}
+
+	for (i = 0; i < tok_len; i++) {
+		if (!is_digit(tok[i])) {
+			if (len + 1 >= TEMPLATE_LEN)
+				return 0;
+			out[len++] = tok[i];
+			continue;
+		}
+
+		if (len + WILDCARD_LEN >= TEMPLATE_LEN)
+			return 0;
+		memcpy(out + len, TEMPLATE_WILDCARD, WILDCARD_LEN);
+		len += WILDCARD_LEN;
+		while (i + 1 < tok_len && is_digit(tok[i + 1]))
+			i++;
+	}
+
+	return len;
+}
+
+/* Builds the template of a line and returns its FNV-1a hash */
+static
+unsigned int
+make_template(const char * line, char * out) {
+	const char * end = line + strnlen(line, TEMPLATE_SCAN_MAX);
+	const char * tok;
+	unsigned int h = 2166136261u;
+	size_t tokens = 0;
+	size_t len = 0;
+	size_t next;
+	char * p;
+
+	while (tokens < TEMPLATE_TOKENS_MAX) {
+		while (line < end && is_blank(*line))
+			line++;
+		if (line == end)
+			break;
+
+		for (tok = line; line < end && !is_blank(*line); line++)
+			;
+
+		if (tokens++) {
+			if (len + 1 >= TEMPLATE_LEN)
+				break;
+			out[len++] = ' ';
+		}
+
+		if (!(next = append_token(out, len, tok, line - tok)))
+			break;
+		len = next;
+	}
+	out[len] = '\0';
+
+	for (p = out; *p; p++) {
+		h ^= (unsigned char)*p;
+		h *= 16777619u;
+	}
+
+	return h;
+}
+
+enum nd_err
+template_miner_init(struct template_miner * m) {
+	memset(m, 0, sizeof * m);
+
+	if (!(m->slots = calloc(TEMPLATE_SLOTS, sizeof * m->slots)))
+		return ND_ALLOC;
+
+	return ND_SUCCESS;
+}
+
+void
+template_miner_add(struct template_miner * m, const char * line) {
+	char text[TEMPLATE_LEN];
+	struct template * t;
+	unsigned int hash;
+	size_t i, min;
+
+	hash = make_template(line, text);
+	m->lines++;
+	m->changed = 1;
+
+	for (i = 0, min = 0; i < m->len; i++) {
+		t = m->slots + i;
+		if (t->hash == hash && !strcmp(t->text, text)) {
+			t->count++;
+			return;
+		}
+		if (t->count < m->slots[min].count)
+			min = i;
+	}
+
+	if (m->len < TEMPLATE_SLOTS) {
+		t = m->slots + m->len++;
+		t->error = 0;
+		t->count = 1;
+	} else {
+		t = m->slots + min;
+		t->error = t->count;
+		t->count++;
+	}
+
+	t->hash = hash;
+	memcpy(t->text, text, sizeof text);
+}
+
+static
+int
+template_cmp(const void * a, const void * b) {
+	const struct template * ta = a;
+	const struct template * tb = b;
+
+	return (tb->count > ta->count) - (tb->count < ta->count);
+}
+
+/* The dump is written to a temporary file renamed over the previous one, so
+ * readers never see a partial file */
+enum nd_err
+template_miner_dump(struct template_miner * m, const char * path) {
+	struct template sorted[TEMPLATE_SLOTS];
+	char tmp[PATH_MAX];
+	FILE * f;
+	size_t i;
+
+	if (!m->changed)
+		return ND_SUCCESS;
+
+	memcpy(sorted, m->slots, m->len * sizeof * sorted);
+	qsort(sorted, m->len, sizeof * sorted, &template_cmp);
+
+	snprintf(tmp, sizeof tmp, "%s.tmp", path);
+	if (!(f = fopen(tmp, "w"))) {
+		fprintf(stderr, "Cannot open '%s': %s\n", tmp, strerror(errno));
+		return ND_FILE;
+	}
+
+	fprintf(f, "# unclassified lines: %ld\n# count\terror\ttemplate\n", m->lines);
+	for (i = 0; i < m->len; i++)
+		fprintf(f, "%ld\t%ld\t%s\n", sorted[i].count, sorted[i].error, sorted[i].text);
+
+	if (fclose(f) || rename(tmp, path)) {
+		fprintf(stderr, "Cannot write '%s': %s\n", path, strerror(errno));
+		unlink(tmp);
+		return ND_FILE;
+	}
+
+	m->changed = 0;
+
+	return ND_SUCCESS;
+}
+
+void
+template_miner_free(struct template_miner * m) {
+	free(m->slots);
+	m->slots = NULL;
+	m->len = 0;
+}
@@ -0,0 +1,59 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+
+/* Online mining of templates of log lines which no rule has matched.
+ * Variable tokens (numbers, IP addresses, hexadecimal strings, e-mail
+ * addresses) are replaced by a wildcard, so lines of the same kind share
+ * one template. The most frequent templates are tracked in a fixed number of
+ * slots by the Space-Saving algorithm: a new template replaces the least
+ * frequent one and inherits its count as a possible overestimation. Work per
+ * line is bounded by TEMPLATE_SCAN_MAX bytes and TEMPLATE_TOKENS_MAX tokens.
+ *
+ * err.h has to be included before this header. */
+
+/* Number of tracked templates */
+#define TEMPLATE_SLOTS 32
+/* Maximum length of a template including the terminating zero */
+#define TEMPLATE_LEN 160
+/* Maximum number of bytes of a line inspected */
+#define TEMPLATE_SCAN_MAX 512
+/* Maximum number of tokens of a line inspected */
+#define TEMPLATE_TOKENS_MAX 24
+#define TEMPLATE_WILDCARD "<*>"
+
+struct template {
+	unsigned int hash;
+	long count;
+	long error;              /* count inherited from the replaced template */
+	char text[TEMPLATE_LEN];
+};
+
+struct template_miner {
+	struct template * slots; /* NULL if mining is disabled */
+	size_t len;              /* number of used slots */
+	long lines;              /* number of mined lines */
+	int changed;             /* there are lines not dumped yet */
+};
+
+/* Templates of unclassified lines of all collectors of a plugin */
+extern struct template_miner template_unknown;
+/* Path of the dump file set from command line, mining is disabled if NULL */
+extern const char * template_dump;
+
+enum nd_err
+template_miner_init(struct template_miner *);
+
+void
+template_miner_add(struct template_miner *, const char *);
+
+enum nd_err
+template_miner_dump(struct template_miner *, const char *);
+
+void
+template_miner_free(struct template_miner *);
+
+static inline
+void
+template_unknown_add(const char * line) {
+	if (template_unknown.slots)
+		template_miner_add(&template_unknown, line);
+}
@@ -1,29 +1,92 @@
 /* SPDX-License-Identifier: GPL-3.0-or-later */
 
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/timerfd.h>
+#include <unistd.h>
 
 #include "timer.h"
 
+#define NSEC_PER_SEC  1000000000LL
+#define NSEC_PER_MSEC 1000000LL
+
+long
+parse_interval(const char * str) {
+	double interval;
+	char * end;
+
+	errno = 0;
+	interval = strtod(str, &end);
+	if (errno || end == str)
+		return 0;
+
+	if (!strcmp(end, "ms"))
+		;
+	else if (!*end || !strcmp(end, "s"))
+		interval *= 1000;
+	else
+		return 0;
+
+	if (interval < 1 || interval > LONG_MAX / NSEC_PER_MSEC)
+		return 0;
+
+	return interval;
+}
+
+static
+long long
+timespec_ns(const struct timespec * ts) {
+	return ts->tv_sec * NSEC_PER_SEC + ts->tv_nsec;
+}
+
 int
-prepare_timer_fd(const int timeout) {
+interval_update_every(const long interval) {
+	return interval < 1000 ? 1 : (interval + 999) / 1000;
+}
+
+unsigned long
+interval_ticks(const long interval) {
+	struct timespec real;
+
+	clock_gettime(CLOCK_REALTIME, &real);
+
+	return timespec_ns(&real) / (interval * NSEC_PER_MSEC);
+}
+
+int
+prepare_timer_fd(const long interval) {
+	const long long interval_ns = interval * NSEC_PER_MSEC;
+	struct timespec mono, real;
 	struct itimerspec tv;
+	long long first;
 	int ret, fd;
 
-	fd = timerfd_create(CLOCK_REALTIME, TFD_CLOEXEC | TFD_NONBLOCK);
+	fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
 
 	if (fd == -1) {
 		perror("E: Cannot create timer");
 		exit(1);
 	}
 
+	/* Ticks of plugins with the same interval coincide with each other
+	 * and with netdata, while stepping the wall clock does not move
+	 * them. */
+	clock_gettime(CLOCK_MONOTONIC, &mono);
+	clock_gettime(CLOCK_REALTIME, &real);
+	first = timespec_ns(&mono) + interval_ns - timespec_ns(&real) % interval_ns;
+
 	memset(&tv, 0, sizeof tv);
-	tv.it_interval.tv_sec = timeout;
-	tv.it_value.tv_sec = timeout;
+	tv.it_interval.tv_sec  = interval_ns / NSEC_PER_SEC;
+	tv.it_interval.tv_nsec = interval_ns % NSEC_PER_SEC;
+	tv.it_value.tv_sec  = first / NSEC_PER_SEC;
+	tv.it_value.tv_nsec = first % NSEC_PER_SEC;
 
-	ret = timerfd_settime(fd, 0, &tv, NULL);
+	ret = timerfd_settime(fd, TFD_TIMER_ABSTIME, &tv, NULL);
 
 	if (ret == -1) {
 		perror("E: Cannot set timer");
@@ -33,6 +96,55 @@ prepare_timer_fd(const int timeout) {
 	return fd;
 }
 
+long
+read_timer_fd(const int fd) {
+	uint64_t expirations;
+
+	if (read(fd, &expirations, sizeof expirations) != sizeof expirations)
+		return errno == EAGAIN ? 0 : -1;
+
+	if (expirations > 1)
+		fprintf(stderr, "Missed %llu ticks, collection takes longer than the update interval\n",
+			(unsigned long long)expirations - 1);
+
+	return expirations;
+}
+
+long
+wait_timer_fd(const int fd) {
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+	if (poll(&pfd, 1, -1) == -1)
+		return errno == EINTR ? 0 : -1;
+
+	return read_timer_fd(fd);
+}
+
+void
+init_timestamp(struct timespec * now) {
+	clock_gettime(CLOCK_MONOTONIC, now);
+}
+
+void
+set_deadline(struct timespec * deadline, const long ms) {
+	clock_gettime(CLOCK_MONOTONIC, deadline);
+	deadline->tv_sec  += ms / 1000;
+	deadline->tv_nsec += ms % 1000 * NSEC_PER_MSEC;
+	if (deadline->tv_nsec >= NSEC_PER_SEC) {
+		deadline->tv_sec++;
+		deadline->tv_nsec -= NSEC_PER_SEC;
+	}
+}
+
+long
+timestamp_age(const struct timespec * then) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (timespec_ns(&now) - timespec_ns(then)) / NSEC_PER_MSEC;
+}
+
 unsigned long
 update_timestamp(struct timespec * now) {
 	struct timespec old, tmp;
@@ -41,7 +153,7 @@ update_timestamp(struct timespec * now) {
 	old.tv_sec  = now->tv_sec;
 	old.tv_nsec = now->tv_nsec;
 
-	clock_gettime(CLOCK_REALTIME, now);
+	clock_gettime(CLOCK_MONOTONIC, now);
 
 	tmp.tv_sec  = now->tv_sec  - old.tv_sec;
 	tmp.tv_nsec = now->tv_nsec - old.tv_nsec;
@@ -1,5 +1,35 @@
 /* SPDX-License-Identifier: GPL-3.0-or-later */
 
-int prepare_timer_fd(const int);
+/* Parses an update interval given in seconds ("1", "0.5") or in
+ * milliseconds ("250ms"), returns milliseconds or 0 if it is not valid */
+long parse_interval(const char *);
 
+/* Whole seconds of an interval in milliseconds, as update_every of netdata
+ * charts, at least 1 */
+int interval_update_every(const long);
+
+/* Number of intervals elapsed since the epoch on the wall clock, the next
+ * tick of prepare_timer_fd is the following one */
+unsigned long interval_ticks(const long);
+
+/* The timer ticks every interval milliseconds on CLOCK_MONOTONIC, the
+ * first tick is aligned to a multiple of the interval on the wall clock */
+int prepare_timer_fd(const long);
+
+/* Consumes expirations of the timer, ticks missed since the last call are
+ * reported. Returns the number of expirations, -1 on error. */
+long read_timer_fd(const int);
+
+/* Blocks until the timer expires, returns 0 if interrupted by a signal */
+long wait_timer_fd(const int);
+
+void init_timestamp(struct timespec *);
+
+/* Sets a CLOCK_MONOTONIC deadline the given milliseconds from now */
+void set_deadline(struct timespec *, const long);
+
+/* Returns milliseconds elapsed on CLOCK_MONOTONIC since the timestamp */
+long timestamp_age(const struct timespec *);
+
+/* Returns microseconds elapsed on CLOCK_MONOTONIC since the last call */
 unsigned long update_timestamp(struct timespec *);
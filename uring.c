@@ -0,0 +1,154 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "err.h"
+
+#include "uring.h"
+
+#define RING_PTR(ring, offset) ((unsigned *)((char *)(ring) + (offset)))
+
+static
+void
+uring_unmap(struct uring * ring) {
+	if (ring->sqes && ring->sqes != MAP_FAILED)
+		munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ring && ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	if (ring->sq_ring && ring->sq_ring != MAP_FAILED)
+		munmap(ring->sq_ring, ring->sq_ring_size);
+}
+
+enum nd_err
+uring_init(struct uring * ring, const unsigned entries) {
+	struct io_uring_params p;
+	unsigned * array;
+	unsigned i;
+
+	memset(ring, 0, sizeof * ring);
+	memset(&p, 0, sizeof p);
+
+	ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (ring->fd == -1)
+		return ND_ERROR;
+
+	ring->entries = p.sq_entries;
+	ring->features = p.features;
+	ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	/* Both rings share one mapping on kernels since 5.4 */
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_ring_size > ring->sq_ring_size)
+			ring->sq_ring_size = ring->cq_ring_size;
+		ring->cq_ring_size = ring->sq_ring_size;
+	}
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		ring->cq_ring = ring->sq_ring;
+	else
+		ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+
+	if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+		uring_unmap(ring);
+		close(ring->fd);
+		return ND_ALLOC;
+	}
+
+	ring->sq_head = RING_PTR(ring->sq_ring, p.sq_off.head);
+	ring->sq_tail = RING_PTR(ring->sq_ring, p.sq_off.tail);
+	ring->sq_mask = RING_PTR(ring->sq_ring, p.sq_off.ring_mask);
+	ring->cq_head = RING_PTR(ring->cq_ring, p.cq_off.head);
+	ring->cq_tail = RING_PTR(ring->cq_ring, p.cq_off.tail);
+	ring->cq_mask = RING_PTR(ring->cq_ring, p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ring + p.cq_off.cqes);
+
+	/* Entries are always submitted in order, the indirection array is
+	 * the identity */
+	array = RING_PTR(ring->sq_ring, p.sq_off.array);
+	for (i = 0; i < p.sq_entries; i++)
+		array[i] = i;
+
+	return ND_SUCCESS;
+}
+
+enum nd_err
+uring_register_files(struct uring * ring, const unsigned len) {
+	int * fds;
+	unsigned i;
+	long ret;
+
+	if (!(fds = malloc(len * sizeof * fds)))
+		return ND_ALLOC;
+
+	for (i = 0; i < len; i++)
+		fds[i] = -1;
+
+	ret = syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_FILES, fds, len);
+	free(fds);
+
+	return ret == -1 ? ND_ERROR : ND_SUCCESS;
+}
+
+struct io_uring_sqe *
+uring_get_sqe(struct uring * ring) {
+	const unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	const unsigned tail = *ring->sq_tail + ring->sq_pending;
+	struct io_uring_sqe * sqe;
+
+	if (tail - head >= ring->entries)
+		return NULL;
+
+	sqe = &ring->sqes[tail & *ring->sq_mask];
+	memset(sqe, 0, sizeof * sqe);
+	ring->sq_pending++;
+
+	return sqe;
+}
+
+int
+uring_submit_and_wait(struct uring * ring, const unsigned wait) {
+	const unsigned submit = ring->sq_pending;
+	long ret;
+
+	__atomic_store_n(ring->sq_tail, *ring->sq_tail + submit, __ATOMIC_RELEASE);
+	ring->sq_pending = 0;
+
+	do {
+		ret = syscall(__NR_io_uring_enter, ring->fd, submit, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	} while (ret == -1 && errno == EINTR);
+
+	return ret == -1 ? -errno : ret;
+}
+
+struct io_uring_cqe *
+uring_peek_cqe(struct uring * ring) {
+	const unsigned head = *ring->cq_head;
+
+	if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+		return NULL;
+
+	return &ring->cqes[head & *ring->cq_mask];
+}
+
+void
+uring_cqe_seen(struct uring * ring) {
+	__atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+void
+uring_free(struct uring * ring) {
+	uring_unmap(ring);
+	close(ring->fd);
+}
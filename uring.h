@@ -0,0 +1,59 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+
+/* A minimal io_uring on top of the raw system calls: one submission and one
+ * completion queue mapped into memory, submitted and waited for in a single
+ * io_uring_enter call.
+ *
+ * err.h has to be included before this header. */
+
+#include <linux/io_uring.h>
+
+struct uring {
+	int fd;
+	unsigned entries;
+	unsigned features;     /* IORING_FEAT_* */
+
+	unsigned * sq_head;
+	unsigned * sq_tail;
+	unsigned * sq_mask;
+	struct io_uring_sqe * sqes;
+	unsigned sq_pending;   /* entries prepared and not submitted yet */
+
+	unsigned * cq_head;
+	unsigned * cq_tail;
+	unsigned * cq_mask;
+	struct io_uring_cqe * cqes;
+
+	void * sq_ring;
+	void * cq_ring;
+	size_t sq_ring_size;
+	size_t cq_ring_size;
+	size_t sqes_size;
+};
+
+/* Fails with ND_ERROR if the kernel does not support io_uring */
+enum nd_err
+uring_init(struct uring *, const unsigned);
+
+/* Registers a table of empty direct descriptors */
+enum nd_err
+uring_register_files(struct uring *, const unsigned);
+
+/* Returns a cleared submission entry, NULL if the queue is full */
+struct io_uring_sqe *
+uring_get_sqe(struct uring *);
+
+/* Submits prepared entries and waits for the given number of completions,
+ * returns the number of submitted entries or -errno */
+int
+uring_submit_and_wait(struct uring *, const unsigned);
+
+/* Returns the next completion, NULL if there is none */
+struct io_uring_cqe *
+uring_peek_cqe(struct uring *);
+
+void
+uring_cqe_seen(struct uring *);
+
+void
+uring_free(struct uring *);
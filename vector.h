@@ -1,40 +1,144 @@
 /* SPDX-License-Identifier: GPL-3.0-or-later */
 
-struct vector {
-	size_t cap;  /* vector capapcity */
-	size_t size; /* size of one item */
-	size_t len;  /* number of items in vector */
-	void * data; /* pointer to data */
-};
+/* Type specialized vectors. VECTOR(name, type) defines `struct name` holding
+ * items of `type` together with name_init, name_reserve, name_add,
+ * name_insert, name_remove, name_item, name_shrink and name_free functions.
+ * Items are copied by assignment, so the compiler sees the real type.
+ *
+ * VECTOR_SEARCH(name, key_type, cmp) additionally defines name_lower_bound
+ * and name_search for vectors kept sorted by `cmp(key, item)`, which returns
+ * negative, zero or positive value as strcmp does.
+ *
+ * err.h and stdlib.h have to be included before this header. */
 
-#define VECTOR_EMPTY { .cap = 0, .size = 0, .len = 0, .data = NULL }
+#include <string.h>
+#include <sys/types.h>
 
-static inline
-int
-vector_is_init(struct vector * v) {
-	return v && v->data;
-}
+#define VECTOR_EMPTY { .cap = 0, .len = 0, .data = NULL }
 
-static inline
-int
-vector_is_empty(struct vector * v) {
-	return !vector_is_init(v) || v->len == 0;
+#define VECTOR(name, type) \
+struct name { \
+	size_t cap;  /* vector capacity */ \
+	size_t len;  /* number of items in vector */ \
+	type * data; /* pointer to data */ \
+}; \
+\
+static inline \
+int \
+name##_is_init(const struct name * v) { \
+	return v && v->data; \
+} \
+\
+static inline \
+int \
+name##_is_empty(const struct name * v) { \
+	return !name##_is_init(v) || v->len == 0; \
+} \
+\
+static inline \
+enum nd_err \
+name##_reserve(struct name * v, const size_t cap) { \
+	type * data; \
+	if (cap <= v->cap) \
+		return ND_SUCCESS; \
+	if (!(data = realloc(v->data, cap * sizeof * data))) \
+		return ND_ALLOC; \
+	v->data = data; \
+	v->cap = cap; \
+	return ND_SUCCESS; \
+} \
+\
+static inline \
+enum nd_err \
+name##_init(struct name * v, const size_t cap) { \
+	v->data = NULL; \
+	v->cap = 0; \
+	v->len = 0; \
+	return name##_reserve(v, cap ? cap : 1); \
+} \
+\
+static inline \
+enum nd_err \
+name##_grow(struct name * v) { \
+	if (v->len < v->cap) \
+		return ND_SUCCESS; \
+	return name##_reserve(v, v->cap < 4 ? 4 : v->cap * 3 / 2); \
+} \
+\
+static inline \
+type * \
+name##_item(const struct name * v, const size_t idx) { \
+	return v->data + idx; \
+} \
+\
+static inline \
+enum nd_err \
+name##_add(struct name * v, type const * item) { \
+	enum nd_err ret; \
+	if ((ret = name##_grow(v)) == ND_SUCCESS) \
+		v->data[v->len++] = *item; \
+	return ret; \
+} \
+\
+static inline \
+enum nd_err \
+name##_insert(struct name * v, const size_t idx, type const * item) { \
+	enum nd_err ret; \
+	if ((ret = name##_grow(v)) == ND_SUCCESS) { \
+		memmove(v->data + idx + 1, v->data + idx, (v->len - idx) * sizeof * v->data); \
+		v->data[idx] = *item; \
+		v->len++; \
+	} \
+	return ret; \
+} \
+\
+static inline \
+void \
+name##_remove(struct name * v, const size_t idx) { \
+	memmove(v->data + idx, v->data + idx + 1, (v->len - idx - 1) * sizeof * v->data); \
+	v->len--; \
+} \
+\
+static inline \
+void \
+name##_shrink(struct name * v) { \
+	const size_t cap = v->len ? v->len : 1; \
+	type * data; \
+	if (cap < v->cap && (data = realloc(v->data, cap * sizeof * data))) { \
+		v->data = data; \
+		v->cap = cap; \
+	} \
+} \
+\
+static inline \
+void \
+name##_free(struct name * v) { \
+	free(v->data); \
+	v->data = NULL; \
+	v->cap = 0; \
+	v->len = 0; \
 }
 
-enum nd_err
-vector_init(struct vector *, const size_t);
-
-enum nd_err
-vector_add(struct vector *, const void *);
-
-static inline
-void *
-vector_item(const struct vector * v, const size_t idx) {
-	return (char *)v->data + idx * v->size;
+#define VECTOR_SEARCH(name, key_type, cmp) \
+static inline \
+size_t \
+name##_lower_bound(const struct name * v, key_type key) { \
+	size_t lo = 0, hi = v->len, mid; \
+	while (lo < hi) { \
+		mid = lo + (hi - lo) / 2; \
+		if (cmp(key, v->data + mid) > 0) \
+			lo = mid + 1; \
+		else \
+			hi = mid; \
+	} \
+	return lo; \
+} \
+\
+static inline \
+ssize_t \
+name##_search(const struct name * v, key_type key) { \
+	const size_t idx = name##_lower_bound(v, key); \
+	if (idx < v->len && cmp(key, v->data + idx) == 0) \
+		return idx; \
+	return -1; \
 }
-
-int
-vector_search(const struct vector *, const void *);
-
-void
-vector_free(struct vector *);
@@ -0,0 +1,87 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+
+#include <stdlib.h>
+
+#include "err.h"
+#include "vector.h"
+
+#include "wheel.h"
+
+static
+void
+insert_entry(struct wheel * wheel, const size_t id) {
+	struct wheel_entry * entry = wheel_entry_vector_item(&wheel->entries, id);
+	size_t * slot = &wheel->slots[entry->due % WHEEL_SLOTS];
+
+	entry->next = *slot;
+	*slot = id;
+}
+
+enum nd_err
+wheel_init(struct wheel * wheel, const unsigned long now) {
+	size_t i;
+
+	wheel->now = now;
+	for (i = 0; i < WHEEL_SLOTS; i++)
+		wheel->slots[i] = WHEEL_NONE;
+
+	if (wheel_entry_vector_init(&wheel->entries, 4) != ND_SUCCESS)
+		return ND_ALLOC;
+	if (wheel_id_vector_init(&wheel->fired, 4) != ND_SUCCESS) {
+		wheel_entry_vector_free(&wheel->entries);
+		return ND_ALLOC;
+	}
+
+	return ND_SUCCESS;
+}
+
+enum nd_err
+wheel_add(struct wheel * wheel, const unsigned long period) {
+	struct wheel_entry entry;
+
+	entry.period = period ? period : 1;
+	entry.due = (wheel->now / entry.period + 1) * entry.period;
+
+	if (wheel_entry_vector_add(&wheel->entries, &entry) != ND_SUCCESS)
+		return ND_ALLOC;
+
+	insert_entry(wheel, wheel->entries.len - 1);
+
+	return ND_SUCCESS;
+}
+
+void
+wheel_advance(struct wheel * wheel, const unsigned long ticks) {
+	const unsigned long end = wheel->now + ticks;
+	struct wheel_entry * entry;
+	size_t id, next;
+	unsigned long t;
+
+	wheel->fired.len = 0;
+
+	/* Every slot is visited at most once, it holds all entries due at
+	 * any of its ticks */
+	for (t = 1; t <= ticks && t <= WHEEL_SLOTS; t++) {
+		id = wheel->slots[(wheel->now + t) % WHEEL_SLOTS];
+		wheel->slots[(wheel->now + t) % WHEEL_SLOTS] = WHEEL_NONE;
+
+		for (; id != WHEEL_NONE; id = next) {
+			entry = wheel_entry_vector_item(&wheel->entries, id);
+			next = entry->next;
+
+			if (entry->due <= end) {
+				wheel_id_vector_add(&wheel->fired, &id);
+				entry->due += ((end - entry->due) / entry->period + 1) * entry->period;
+			}
+			insert_entry(wheel, id);
+		}
+	}
+
+	wheel->now = end;
+}
+
+void
+wheel_free(struct wheel * wheel) {
+	wheel_entry_vector_free(&wheel->entries);
+	wheel_id_vector_free(&wheel->fired);
+}
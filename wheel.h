@@ -0,0 +1,45 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+
+/* A hashed timer wheel of collectors running at multiples of a base tick.
+ * An entry is kept in the slot of the tick it is due at, advancing the wheel
+ * by a tick visits a single slot, so the cost of a tick does not depend on
+ * the number of slower collectors waiting.
+ *
+ * err.h, stdlib.h and vector.h have to be included before this header. */
+
+#define WHEEL_SLOTS 64
+
+struct wheel_entry {
+	unsigned long period; /* in ticks */
+	unsigned long due;    /* tick the entry fires at */
+	size_t next;          /* next entry in the slot, WHEEL_NONE at the end */
+};
+
+#define WHEEL_NONE ((size_t)-1)
+
+VECTOR(wheel_entry_vector, struct wheel_entry)
+VECTOR(wheel_id_vector, size_t)
+
+struct wheel {
+	unsigned long now;                 /* the last tick */
+	size_t slots[WHEEL_SLOTS];         /* first entry of every slot */
+	struct wheel_entry_vector entries; /* indexed by id */
+	struct wheel_id_vector fired;      /* ids fired by the last advance */
+};
+
+/* Starts the wheel at the given tick, entries fire at multiples of their
+ * period */
+enum nd_err
+wheel_init(struct wheel *, const unsigned long);
+
+/* Adds an entry firing every period ticks, ids are assigned in order from 0 */
+enum nd_err
+wheel_add(struct wheel *, const unsigned long);
+
+/* Advances the wheel by the given number of ticks and collects fired entries.
+ * An entry due several times during missed ticks fires once. */
+void
+wheel_advance(struct wheel *, const unsigned long);
+
+void
+wheel_free(struct wheel *);